@@ -38,10 +38,51 @@ constexpr int kDefaultQuotaRefreshInMs = 1000;
 // to expire quota cache items in 1 minute.
 constexpr int kDefaultQuotaExpirationInMS = 60000;
 
+// Decides which entries stay in a full check or quota cache.
+enum class CacheAdmissionPolicy {
+  // Every new entry is cached, evicting the least recently used one.
+  LRU,
+  // W-TinyLFU: a new entry first goes to a small window of the cache. When it
+  // leaves the window, it only evicts the least recently used entry if its
+  // request was seen more often recently. This keeps the frequently used
+  // entries when many requests are seen only once, e.g. from a crawler.
+  TINY_LFU,
+};
+
+// Default maximum number of log entries aggregated into one reported
+// operation.
+constexpr int kDefaultMaxLogEntries = 100;
+
+// Label set on a log entry aggregated by LogEntryPolicy::DEDUP, to the
+// number of identical log entries it stands for.
+constexpr char kLogEntryCountLabel[] = "aggregated_log_entry_count";
+
+// Decides what happens to the log entries of reported operations once an
+// aggregated operation holds max_log_entries of them. With the policies other
+// than FLUSH, the metric values keep being aggregated, and the dropped log
+// entries are summarized by one more log entry, with the name, severity and
+// timestamp of the latest dropped one.
+enum class LogEntryPolicy {
+  // The aggregated operation is flushed, and a new one is started.
+  FLUSH,
+  // Only the latest max_log_entries log entries are kept.
+  RING_BUFFER,
+  // A uniform sample of max_log_entries log entries is kept, by reservoir
+  // sampling.
+  SAMPLE,
+  // Log entries differing only by timestamp and insert id are merged into the
+  // first one, with their number in the kLogEntryCountLabel label. Up to
+  // max_log_entries distinct log entries are kept.
+  DEDUP,
+};
+
 struct QuotaAggregationOptions {
   QuotaAggregationOptions() : num_entries(kDefaultQuotaCacheSize),
                               refresh_interval_ms(kDefaultQuotaRefreshInMs),
-                              expiration_interval_ms(kDefaultQuotaExpirationInMS){}
+                              expiration_interval_ms(kDefaultQuotaExpirationInMS),
+                              num_shards(1),
+                              admission_policy(CacheAdmissionPolicy::LRU),
+                              max_bytes(0) {}
 
   // Constructor.
   // cache_entries is the maximum number of cache entries that can be kept in
@@ -50,10 +91,20 @@ struct QuotaAggregationOptions {
   // request needs to send to remote server again.
   // expiration_interval_ms should be at lease 10 times bigger
   // than the rate limit service's refill time window.
+  // cache_shards is the number of independently locked cache shards.
+  // cache_admission_policy decides which entries stay in a full cache.
+  // cache_max_bytes bounds the estimated memory of the cache, 0 for no bound.
   QuotaAggregationOptions(int cache_entries, int refresh_interval_ms,
-                          int expiration_interval_ms = kDefaultQuotaExpirationInMS)
+                          int expiration_interval_ms = kDefaultQuotaExpirationInMS,
+                          int cache_shards = 1,
+                          CacheAdmissionPolicy cache_admission_policy =
+                              CacheAdmissionPolicy::LRU,
+                          int64_t cache_max_bytes = 0)
       : num_entries(cache_entries), refresh_interval_ms(refresh_interval_ms),
-        expiration_interval_ms(expiration_interval_ms) {}
+        expiration_interval_ms(expiration_interval_ms),
+        num_shards(cache_shards),
+        admission_policy(cache_admission_policy),
+        max_bytes(cache_max_bytes) {}
 
   // Maximum number of cache entries kept in the aggregation cache.
   // Set to 0 will disable caching and aggregation.
@@ -66,13 +117,36 @@ struct QuotaAggregationOptions {
   // The expiration interval in milliseconds. Cached element will be dropped
   // when the last refresh time is older than expiration_interval_ms
   int expiration_interval_ms;
+
+  // Number of cache shards. Quota requests are split over the shards by
+  // signature, each shard has its own lock and holds up to
+  // num_entries / num_shards entries. The periodic refresh sweeps one shard
+  // at a time. Values less than 1 are treated as 1.
+  int num_shards;
+
+  // Decides which entries stay in the cache when it is full.
+  CacheAdmissionPolicy admission_policy;
+
+  // Maximum estimated bytes of the cache entries, in addition to
+  // num_entries. Entries are charged by the size of their messages. Entries
+  // evicted to meet either bound are dropped, after sending their aggregated
+  // cost. Set to 0 to only bound the number of entries.
+  int64_t max_bytes;
 };
 
 // Options controlling check aggregation behavior.
 struct CheckAggregationOptions {
   // Default constructor.
   CheckAggregationOptions()
-      : num_entries(10000), flush_interval_ms(500), expiration_ms(1000) {}
+      : num_entries(10000),
+        flush_interval_ms(500),
+        expiration_ms(1000),
+        num_shards(1),
+        admission_policy(CacheAdmissionPolicy::LRU),
+        max_bytes(0),
+        stale_while_revalidate_ms(0),
+        max_aggregated_tokens(0),
+        max_aggregated_operations(0) {}
 
   // Constructor.
   // cache_entries is the maximum number of cache entries that can be kept in
@@ -82,12 +156,32 @@ struct CheckAggregationOptions {
   // response_expiration_ms is the maximum milliseconds before a cached check
   // response is invalidated. We make sure that it is at least
   // flush_cache_entry_interval_ms + 1.
+  // cache_shards is the number of independently locked cache shards.
+  // cache_admission_policy decides which entries stay in a full cache.
+  // cache_max_bytes bounds the estimated memory of the cache, 0 for no bound.
+  // stale_while_revalidate_ms is how long a positive response may be served
+  // past flush_cache_entry_interval_ms while it is refreshed in background.
+  // flush_cache_entry_tokens and flush_cache_entry_operations flush the
+  // aggregated check requests of an entry once they reach that many tokens
+  // or requests, 0 for no limit.
   CheckAggregationOptions(int cache_entries, int flush_cache_entry_interval_ms,
-                          int response_expiration_ms)
+                          int response_expiration_ms, int cache_shards = 1,
+                          CacheAdmissionPolicy cache_admission_policy =
+                              CacheAdmissionPolicy::LRU,
+                          int64_t cache_max_bytes = 0,
+                          int stale_while_revalidate_ms = 0,
+                          int64_t flush_cache_entry_tokens = 0,
+                          int flush_cache_entry_operations = 0)
       : num_entries(cache_entries),
         flush_interval_ms(flush_cache_entry_interval_ms),
         expiration_ms(std::max(flush_cache_entry_interval_ms + 1,
-                               response_expiration_ms)) {}
+                               response_expiration_ms)),
+        num_shards(std::max(1, cache_shards)),
+        admission_policy(cache_admission_policy),
+        max_bytes(cache_max_bytes),
+        stale_while_revalidate_ms(std::max(0, stale_while_revalidate_ms)),
+        max_aggregated_tokens(flush_cache_entry_tokens),
+        max_aggregated_operations(flush_cache_entry_operations) {}
 
   // Maximum number of cache entries kept in the aggregation cache.
   // Set to 0 will disable caching and aggregation.
@@ -101,12 +195,50 @@ struct CheckAggregationOptions {
   // deletion is triggered by a timer. This value must be larger than
   // flush_interval_ms.
   const int expiration_ms;
+
+  // Number of cache shards. Check requests are split over the shards by
+  // signature, each shard has its own lock and holds up to
+  // num_entries / num_shards entries. More shards reduce lock contention
+  // between threads.
+  const int num_shards;
+
+  // Decides which entries stay in the cache when it is full.
+  const CacheAdmissionPolicy admission_policy;
+
+  // Maximum estimated bytes of the cache entries, in addition to
+  // num_entries. Entries are charged by the size of their messages, updated
+  // as checks are aggregated into them, so every check then takes the writer
+  // lock of its shard. Set to 0 to only bound the number of entries.
+  const int64_t max_bytes;
+
+  // Maximum milliseconds past flush_interval_ms a positive cached response
+  // keeps being served while its refresh is in flight. The check finding
+  // the response due for a refresh is answered from the cache, and the
+  // refresh is sent in the background. Past this window the response is
+  // only refreshed by a check sent to the server. Set to 0 to always
+  // refresh with a check sent to the server.
+  const int stale_while_revalidate_ms;
+
+  // The aggregated check requests of a cache entry are flushed to the server
+  // as soon as the tokens they request, the sum of their int64 DELTA metric
+  // values, reach max_aggregated_tokens, or as soon as
+  // max_aggregated_operations requests are aggregated. The cached response is
+  // still used. Hot entries then report their usage sooner, while cold
+  // entries keep aggregating until they expire. Set to 0 for no limit.
+  const int64_t max_aggregated_tokens;
+  const int max_aggregated_operations;
 };
 
 // Options controlling report aggregation behavior.
 struct ReportAggregationOptions {
   // Default constructor.
-  ReportAggregationOptions() : num_entries(10000), flush_interval_ms(1000) {}
+  ReportAggregationOptions()
+      : num_entries(10000),
+        flush_interval_ms(1000),
+        num_shards(1),
+        max_bytes(0),
+        log_entry_policy(LogEntryPolicy::FLUSH),
+        max_log_entries(kDefaultMaxLogEntries) {}
 
   // Constructor.
   // cache_entries is the maximum number of cache entries that can be kept in
@@ -114,9 +246,21 @@ struct ReportAggregationOptions {
   // flush_cache_entry_interval_ms is the maximum milliseconds before aggregated
   // report requests are flushed to the server. The cache entry is deleted after
   // the flush.
-  ReportAggregationOptions(int cache_entries, int flush_cache_entry_interval_ms)
+  // cache_shards is the number of independently locked cache shards.
+  // cache_max_bytes bounds the estimated memory of the cache, 0 for no bound.
+  // cache_log_entry_policy decides what happens once an aggregated operation
+  // holds cache_max_log_entries log entries.
+  ReportAggregationOptions(int cache_entries, int flush_cache_entry_interval_ms,
+                           int cache_shards = 1, int64_t cache_max_bytes = 0,
+                           LogEntryPolicy cache_log_entry_policy =
+                               LogEntryPolicy::FLUSH,
+                           int cache_max_log_entries = kDefaultMaxLogEntries)
       : num_entries(cache_entries),
-        flush_interval_ms(flush_cache_entry_interval_ms) {}
+        flush_interval_ms(flush_cache_entry_interval_ms),
+        num_shards(std::max(1, cache_shards)),
+        max_bytes(cache_max_bytes),
+        log_entry_policy(cache_log_entry_policy),
+        max_log_entries(std::max(1, cache_max_log_entries)) {}
 
   // Maximum number of cache entries kept in the aggregation cache.
   // Set to 0 will disable caching and aggregation.
@@ -125,6 +269,26 @@ struct ReportAggregationOptions {
   // Maximum milliseconds before aggregated report requests are flushed to the
   // server. The flush is triggered by a timer.
   const int flush_interval_ms;
+
+  // Number of cache shards. Operations are split over the shards by
+  // signature, each shard has its own lock and holds up to
+  // num_entries / num_shards entries. More shards reduce lock contention
+  // between threads.
+  const int num_shards;
+
+  // Maximum estimated bytes of the cache entries, in addition to
+  // num_entries. An operation is charged by the size of its log entries and
+  // metric values, updated as operations are merged. An operation growing
+  // past the bytes of its shard is flushed. Set to 0 to only bound the number
+  // of entries.
+  const int64_t max_bytes;
+
+  // Decides what happens once an aggregated operation holds max_log_entries
+  // log entries. With FLUSH, the default, chatty operations are flushed every
+  // max_log_entries log entries. The other policies bound the log entries of
+  // an operation in memory, so it is only flushed by its interval.
+  const LogEntryPolicy log_entry_policy;
+  const int max_log_entries;
 };
 
 }  // namespace service_control_client
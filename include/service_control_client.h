@@ -132,6 +132,9 @@ struct Statistics {
   uint64_t send_checks_by_flush;
   // Check sends to remote sever during Check() calls.
   uint64_t send_checks_in_flight;
+  // Check() calls completed by the server call of an identical pending
+  // check instead of calling the server.
+  uint64_t coalesced_checks;
 
   // Total number of Report() calls received.
   uint64_t total_called_reports;
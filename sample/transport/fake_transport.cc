@@ -0,0 +1,182 @@
+/* Copyright 2021 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "sample/transport/fake_transport.h"
+#include <random>
+#include <string>
+
+using ::google::api::servicecontrol::v1::AllocateQuotaRequest;
+using ::google::api::servicecontrol::v1::AllocateQuotaResponse;
+using ::google::api::servicecontrol::v1::CheckError;
+using ::google::api::servicecontrol::v1::CheckRequest;
+using ::google::api::servicecontrol::v1::CheckResponse;
+using ::google::api::servicecontrol::v1::QuotaError;
+using ::google::api::servicecontrol::v1::ReportRequest;
+using ::google::api::servicecontrol::v1::ReportResponse;
+
+using ::google::protobuf::util::OkStatus;
+using ::google::protobuf::util::Status;
+using ::google::protobuf::util::StatusCode;
+
+namespace google {
+namespace service_control_client {
+namespace sample {
+namespace transport {
+
+FakeTransport::FakeTransport(const Options& options)
+    : options_(options),
+      checks_(0),
+      quotas_(0),
+      reports_(0),
+      report_operations_(0),
+      errors_(0),
+      stopped_(false) {
+  dispatcher_ = std::thread(&FakeTransport::Dispatch, this);
+}
+
+FakeTransport::~FakeTransport() { Stop(); }
+
+void FakeTransport::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stopped_) {
+      return;
+    }
+    stopped_ = true;
+  }
+  cv_.notify_one();
+  dispatcher_.join();
+}
+
+void FakeTransport::Check(const CheckRequest& request, CheckResponse* response,
+                          TransportDoneFunc on_done) {
+  ++checks_;
+  std::string operation_id = request.operation().operation_id();
+  bool check_error = Sample(options_.check_error_rate);
+  Complete(
+      [response, operation_id, check_error]() {
+        response->set_operation_id(operation_id);
+        if (check_error) {
+          CheckError* error = response->add_check_errors();
+          error->set_code(CheckError::PERMISSION_DENIED);
+          error->set_detail("Denied by the fake server.");
+        }
+      },
+      on_done);
+}
+
+void FakeTransport::Quota(const AllocateQuotaRequest& request,
+                          AllocateQuotaResponse* response,
+                          TransportDoneFunc on_done) {
+  ++quotas_;
+  std::string operation_id = request.allocate_operation().operation_id();
+  bool exhausted = Sample(options_.quota_exhausted_rate);
+  Complete(
+      [response, operation_id, exhausted]() {
+        response->set_operation_id(operation_id);
+        if (exhausted) {
+          QuotaError* error = response->add_allocate_errors();
+          error->set_code(QuotaError::RESOURCE_EXHAUSTED);
+          error->set_description("Quota exhausted by the fake server.");
+        }
+      },
+      on_done);
+}
+
+void FakeTransport::Report(const ReportRequest& request,
+                           ReportResponse* response,
+                           TransportDoneFunc on_done) {
+  ++reports_;
+  report_operations_ += request.operations_size();
+  Complete([]() {}, on_done);
+}
+
+FakeTransport::Stats FakeTransport::GetStats() const {
+  Stats stats;
+  stats.checks = checks_;
+  stats.quotas = quotas_;
+  stats.reports = reports_;
+  stats.report_operations = report_operations_;
+  stats.errors = errors_;
+  return stats;
+}
+
+bool FakeTransport::Sample(double probability) {
+  if (probability <= 0) {
+    return false;
+  }
+  static thread_local std::mt19937 engine(std::random_device{}());
+  std::uniform_real_distribution<double> distribution(0, 1);
+  return distribution(engine) < probability;
+}
+
+void FakeTransport::Complete(std::function<void()> fill_response,
+                             TransportDoneFunc on_done) {
+  bool failed = Sample(options_.error_rate);
+  if (failed) {
+    ++errors_;
+  }
+  std::function<void()> done = [fill_response, on_done, failed]() {
+    if (failed) {
+      on_done(Status(StatusCode::kUnavailable,
+                     std::string("Injected by the fake server.")));
+      return;
+    }
+    fill_response();
+    on_done(OkStatus());
+  };
+
+  auto due = std::chrono::steady_clock::now() +
+             std::chrono::milliseconds(options_.latency_ms);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!stopped_) {
+      pending_.emplace(due, std::move(done));
+      done = nullptr;
+    }
+  }
+  if (done) {
+    done();
+    return;
+  }
+  cv_.notify_one();
+}
+
+void FakeTransport::Dispatch() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (!stopped_ || !pending_.empty()) {
+    if (pending_.empty()) {
+      cv_.wait(lock);
+      continue;
+    }
+    auto first = pending_.begin();
+    // Pending calls are completed right away once stopped.
+    if (!stopped_ && first->first > std::chrono::steady_clock::now()) {
+      cv_.wait_until(lock, first->first);
+      continue;
+    }
+    std::function<void()> done = std::move(first->second);
+    pending_.erase(first);
+    // on_done may call back into the transport, e.g. from a flush callback.
+    lock.unlock();
+    done();
+    lock.lock();
+  }
+}
+
+}  // namespace transport
+}  // namespace sample
+}  // namespace service_control_client
+}  // namespace google
@@ -0,0 +1,130 @@
+/* Copyright 2021 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef SERVICE_CONTROL_CLIENT_CXX_SAMPLE_FAKE_TRANSPORT_H
+#define SERVICE_CONTROL_CLIENT_CXX_SAMPLE_FAKE_TRANSPORT_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include "google/api/servicecontrol/v1/quota_controller.pb.h"
+#include "google/api/servicecontrol/v1/service_controller.pb.h"
+#include "google/protobuf/stubs/status.h"
+#include "include/service_control_client.h"
+
+namespace google {
+namespace service_control_client {
+namespace sample {
+namespace transport {
+
+// An in-process fake of the Service Control server. Each call completes
+// asynchronously on a dispatcher thread after the configured latency, the
+// same way a real network transport calls on_done from its own thread.
+class FakeTransport {
+ public:
+  struct Options {
+    Options()
+        : latency_ms(0),
+          error_rate(0),
+          check_error_rate(0),
+          quota_exhausted_rate(0) {}
+
+    // Latency of every call in milliseconds.
+    int latency_ms;
+    // Fraction of calls failing with UNAVAILABLE, in [0, 1].
+    double error_rate;
+    // Fraction of successful Check calls responding with a check error.
+    double check_error_rate;
+    // Fraction of successful AllocateQuota calls responding with a
+    // RESOURCE_EXHAUSTED quota error.
+    double quota_exhausted_rate;
+  };
+
+  // Number of calls received by the fake, per method.
+  struct Stats {
+    uint64_t checks;
+    uint64_t quotas;
+    uint64_t reports;
+    // Number of operations in all the received report requests.
+    uint64_t report_operations;
+    // Number of calls that failed with a transport error.
+    uint64_t errors;
+  };
+
+  explicit FakeTransport(const Options& options);
+
+  // Calls Stop().
+  ~FakeTransport();
+
+  // Completes the pending calls without waiting for their latency. Calls made
+  // after Stop() complete synchronously on the calling thread. This lets the
+  // final flush of a ServiceControlClient being destroyed complete while the
+  // client is still alive.
+  void Stop();
+
+  void Check(const ::google::api::servicecontrol::v1::CheckRequest& request,
+             ::google::api::servicecontrol::v1::CheckResponse* response,
+             TransportDoneFunc on_done);
+
+  void Quota(
+      const ::google::api::servicecontrol::v1::AllocateQuotaRequest& request,
+      ::google::api::servicecontrol::v1::AllocateQuotaResponse* response,
+      TransportDoneFunc on_done);
+
+  void Report(const ::google::api::servicecontrol::v1::ReportRequest& request,
+              ::google::api::servicecontrol::v1::ReportResponse* response,
+              TransportDoneFunc on_done);
+
+  Stats GetStats() const;
+
+ private:
+  // Returns true with the given probability.
+  bool Sample(double probability);
+
+  // Runs on_done with the status on the dispatcher thread once the latency
+  // has elapsed. fill_response is called right before on_done when the call
+  // succeeds.
+  void Complete(std::function<void()> fill_response, TransportDoneFunc on_done);
+
+  // The dispatcher thread loop.
+  void Dispatch();
+
+  const Options options_;
+
+  std::atomic<uint64_t> checks_;
+  std::atomic<uint64_t> quotas_;
+  std::atomic<uint64_t> reports_;
+  std::atomic<uint64_t> report_operations_;
+  std::atomic<uint64_t> errors_;
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  // Pending completions ordered by their due time.
+  std::multimap<std::chrono::steady_clock::time_point, std::function<void()>>
+      pending_;
+  bool stopped_;
+  std::thread dispatcher_;
+};
+
+}  // namespace transport
+}  // namespace sample
+}  // namespace service_control_client
+}  // namespace google
+
+#endif  // SERVICE_CONTROL_CLIENT_CXX_SAMPLE_FAKE_TRANSPORT_H
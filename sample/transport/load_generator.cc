@@ -0,0 +1,498 @@
+/* Copyright 2021 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Load generator driving ServiceControlClient against an in-process fake
+// Service Control server. It replays a synthetic mix of Check, Quota and
+// Report calls at a target rate and prints the client side latency, the
+// number of RPCs that reached the fake server and the aggregation ratios.
+//
+// Usage:
+//   load_generator [--flag=value ...]
+// Run with --help to list the flags.
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+#include "google/api/servicecontrol/v1/quota_controller.pb.h"
+#include "google/api/servicecontrol/v1/service_controller.pb.h"
+#include "google/protobuf/stubs/status.h"
+#include "include/service_control_client.h"
+#include "sample/transport/fake_transport.h"
+
+using ::google::api::servicecontrol::v1::AllocateQuotaRequest;
+using ::google::api::servicecontrol::v1::AllocateQuotaResponse;
+using ::google::api::servicecontrol::v1::CheckRequest;
+using ::google::api::servicecontrol::v1::CheckResponse;
+using ::google::api::servicecontrol::v1::MetricValue;
+using ::google::api::servicecontrol::v1::MetricValueSet;
+using ::google::api::servicecontrol::v1::Operation;
+using ::google::api::servicecontrol::v1::QuotaOperation;
+using ::google::api::servicecontrol::v1::ReportRequest;
+using ::google::api::servicecontrol::v1::ReportResponse;
+using ::google::protobuf::util::Status;
+using ::google::service_control_client::CheckAggregationOptions;
+using ::google::service_control_client::kDefaultQuotaExpirationInMS;
+using ::google::service_control_client::PeriodicTimer;
+using ::google::service_control_client::QuotaAggregationOptions;
+using ::google::service_control_client::ReportAggregationOptions;
+using ::google::service_control_client::ServiceControlClient;
+using ::google::service_control_client::ServiceControlClientOptions;
+using ::google::service_control_client::Statistics;
+using ::google::service_control_client::TransportDoneFunc;
+using ::google::service_control_client::sample::transport::FakeTransport;
+
+namespace {
+
+typedef std::chrono::steady_clock Clock;
+
+const char kServiceName[] = "library.googleapis.com";
+const char kServiceConfigId[] = "2021-06-01r0";
+
+struct Flags {
+  // Target rate of calls per second, over all the threads.
+  double qps = 1000;
+  int duration_s = 10;
+  int threads = 4;
+  // Number of distinct consumers the calls are spread over.
+  int consumers = 100;
+  // Distinct operation names per consumer.
+  int methods = 4;
+  // The call mix in percent, the rest are Report calls.
+  int check_percent = 50;
+  int quota_percent = 20;
+
+  // Fake server behavior.
+  int latency_ms = 10;
+  double error_rate = 0;
+  double check_error_rate = 0;
+  double quota_exhausted_rate = 0;
+
+  // Aggregation options. A cache size of 0 disables the cache.
+  int check_cache_entries = 10000;
+  int check_flush_interval_ms = 500;
+  int check_expiration_ms = 1000;
+  int quota_cache_entries = 10000;
+  int quota_refresh_interval_ms = 1000;
+  int report_cache_entries = 10000;
+  int report_flush_interval_ms = 1000;
+  // Shards of each of the three caches.
+  int cache_shards = 1;
+};
+
+struct FlagInfo {
+  const char* name;
+  const char* help;
+  std::function<void(const char*)> set;
+};
+
+std::vector<FlagInfo> FlagInfos(Flags* flags) {
+  auto int_flag = [](int* value) {
+    return [value](const char* text) { *value = atoi(text); };
+  };
+  auto double_flag = [](double* value) {
+    return [value](const char* text) { *value = atof(text); };
+  };
+  return {
+      {"qps", "target calls per second", double_flag(&flags->qps)},
+      {"duration_s", "seconds to run", int_flag(&flags->duration_s)},
+      {"threads", "calling threads", int_flag(&flags->threads)},
+      {"consumers", "distinct consumers", int_flag(&flags->consumers)},
+      {"methods", "distinct operation names", int_flag(&flags->methods)},
+      {"check_percent", "percent of Check calls",
+       int_flag(&flags->check_percent)},
+      {"quota_percent", "percent of Quota calls",
+       int_flag(&flags->quota_percent)},
+      {"latency_ms", "fake server latency", int_flag(&flags->latency_ms)},
+      {"error_rate", "fraction of failing RPCs",
+       double_flag(&flags->error_rate)},
+      {"check_error_rate", "fraction of Check responses with errors",
+       double_flag(&flags->check_error_rate)},
+      {"quota_exhausted_rate", "fraction of exhausted Quota responses",
+       double_flag(&flags->quota_exhausted_rate)},
+      {"check_cache_entries", "check cache size",
+       int_flag(&flags->check_cache_entries)},
+      {"check_flush_interval_ms", "check flush interval",
+       int_flag(&flags->check_flush_interval_ms)},
+      {"check_expiration_ms", "check response expiration",
+       int_flag(&flags->check_expiration_ms)},
+      {"quota_cache_entries", "quota cache size",
+       int_flag(&flags->quota_cache_entries)},
+      {"quota_refresh_interval_ms", "quota refresh interval",
+       int_flag(&flags->quota_refresh_interval_ms)},
+      {"report_cache_entries", "report cache size",
+       int_flag(&flags->report_cache_entries)},
+      {"report_flush_interval_ms", "report flush interval",
+       int_flag(&flags->report_flush_interval_ms)},
+      {"cache_shards", "shards of each cache",
+       int_flag(&flags->cache_shards)},
+  };
+}
+
+void PrintUsage(const std::vector<FlagInfo>& infos) {
+  fprintf(stderr, "Usage: load_generator [--flag=value ...]\nFlags:\n");
+  for (const auto& info : infos) {
+    fprintf(stderr, "  --%-28s %s\n", info.name, info.help);
+  }
+}
+
+// Returns false if an argument is not a known flag.
+bool ParseFlags(int argc, char** argv, Flags* flags) {
+  std::vector<FlagInfo> infos = FlagInfos(flags);
+  for (int i = 1; i < argc; ++i) {
+    const char* arg = argv[i];
+    const char* equal = strchr(arg, '=');
+    bool found = false;
+    if (strncmp(arg, "--", 2) == 0 && equal != nullptr) {
+      std::string name(arg + 2, equal);
+      for (const auto& info : infos) {
+        if (name == info.name) {
+          info.set(equal + 1);
+          found = true;
+          break;
+        }
+      }
+    }
+    if (!found) {
+      PrintUsage(infos);
+      return false;
+    }
+  }
+  return true;
+}
+
+// A periodic timer backed by a thread, used to flush the aggregators.
+class ThreadPeriodicTimer : public PeriodicTimer {
+ public:
+  ThreadPeriodicTimer(int interval_ms, std::function<void()> timer_func)
+      : stopped_(false) {
+    thread_ = std::thread([this, interval_ms, timer_func]() {
+      std::unique_lock<std::mutex> lock(mutex_);
+      while (!cv_.wait_for(lock, std::chrono::milliseconds(interval_ms),
+                           [this]() { return stopped_; })) {
+        lock.unlock();
+        timer_func();
+        lock.lock();
+      }
+    });
+  }
+
+  ~ThreadPeriodicTimer() { Stop(); }
+
+  void Stop() override {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopped_ = true;
+    }
+    cv_.notify_one();
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+  }
+
+ private:
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  bool stopped_;
+  std::thread thread_;
+};
+
+std::string ConsumerId(int consumer) {
+  return "project:consumer-" + std::to_string(consumer);
+}
+
+std::string MethodName(int method) {
+  return "google.example.library.v1.Method" + std::to_string(method);
+}
+
+CheckRequest CreateCheckRequest(int consumer, int method) {
+  CheckRequest request;
+  request.set_service_name(kServiceName);
+  request.set_service_config_id(kServiceConfigId);
+  Operation* operation = request.mutable_operation();
+  operation->set_operation_id("check-" + std::to_string(consumer));
+  operation->set_operation_name(MethodName(method));
+  operation->set_consumer_id(ConsumerId(consumer));
+  operation->set_importance(Operation::LOW);
+  (*operation->mutable_labels())["servicecontrol.googleapis.com/caller_ip"] =
+      "10.0.0.1";
+  return request;
+}
+
+AllocateQuotaRequest CreateQuotaRequest(int consumer, int method) {
+  AllocateQuotaRequest request;
+  request.set_service_name(kServiceName);
+  request.set_service_config_id(kServiceConfigId);
+  QuotaOperation* operation = request.mutable_allocate_operation();
+  operation->set_operation_id("quota-" + std::to_string(consumer));
+  operation->set_method_name(MethodName(method));
+  operation->set_consumer_id(ConsumerId(consumer));
+  MetricValueSet* metric_value_set = operation->add_quota_metrics();
+  metric_value_set->set_metric_name("library.googleapis.com/read_calls");
+  metric_value_set->add_metric_values()->set_int64_value(1);
+  return request;
+}
+
+ReportRequest CreateReportRequest(int consumer, int method) {
+  ReportRequest request;
+  request.set_service_name(kServiceName);
+  request.set_service_config_id(kServiceConfigId);
+  Operation* operation = request.add_operations();
+  operation->set_operation_id("report-" + std::to_string(consumer));
+  operation->set_operation_name(MethodName(method));
+  operation->set_consumer_id(ConsumerId(consumer));
+  operation->mutable_start_time()->set_seconds(1000);
+  operation->mutable_end_time()->set_seconds(1001);
+  MetricValueSet* metric_value_set = operation->add_metric_value_sets();
+  metric_value_set->set_metric_name(
+      "serviceruntime.googleapis.com/api/consumer/request_count");
+  MetricValue* metric_value = metric_value_set->add_metric_values();
+  metric_value->set_int64_value(1);
+  return request;
+}
+
+// Pre-built requests for every consumer and method.
+struct Workload {
+  std::vector<CheckRequest> checks;
+  std::vector<AllocateQuotaRequest> quotas;
+  std::vector<ReportRequest> reports;
+};
+
+Workload CreateWorkload(const Flags& flags) {
+  Workload workload;
+  for (int consumer = 0; consumer < flags.consumers; ++consumer) {
+    for (int method = 0; method < flags.methods; ++method) {
+      workload.checks.push_back(CreateCheckRequest(consumer, method));
+      workload.quotas.push_back(CreateQuotaRequest(consumer, method));
+      workload.reports.push_back(CreateReportRequest(consumer, method));
+    }
+  }
+  return workload;
+}
+
+enum CallType { CHECK = 0, QUOTA = 1, REPORT = 2, NUM_CALL_TYPES = 3 };
+const char* const kCallTypeNames[] = {"Check", "Quota", "Report"};
+
+// Results recorded by one calling thread.
+struct ThreadResult {
+  // Client side latencies in nanoseconds, per call type.
+  std::vector<int64_t> latencies[NUM_CALL_TYPES];
+  // Calls completing with a non-OK status, per call type.
+  int64_t failures[NUM_CALL_TYPES] = {0, 0, 0};
+};
+
+// Issues calls at qps / threads per second until end_time. Calls are
+// scheduled at fixed intervals and the latency of a call is measured from
+// its scheduled time, so a slow call also accounts for the delay it causes
+// to the following ones.
+void RunThread(const Flags& flags, const Workload& workload,
+               ServiceControlClient* client, Clock::time_point end_time,
+               unsigned seed, ThreadResult* result) {
+  std::mt19937 engine(seed);
+  std::uniform_int_distribution<size_t> request_distribution(
+      0, workload.checks.size() - 1);
+  std::uniform_int_distribution<int> percent_distribution(0, 99);
+  auto interval = std::chrono::duration_cast<Clock::duration>(
+      std::chrono::duration<double>(flags.threads / flags.qps));
+
+  Clock::time_point scheduled = Clock::now();
+  while (scheduled < end_time) {
+    std::this_thread::sleep_until(scheduled);
+    size_t index = request_distribution(engine);
+    int percent = percent_distribution(engine);
+    CallType type;
+    Status status;
+    if (percent < flags.check_percent) {
+      type = CHECK;
+      CheckResponse response;
+      status = client->Check(workload.checks[index], &response);
+    } else if (percent < flags.check_percent + flags.quota_percent) {
+      type = QUOTA;
+      AllocateQuotaResponse response;
+      status = client->Quota(workload.quotas[index], &response);
+    } else {
+      type = REPORT;
+      ReportResponse response;
+      status = client->Report(workload.reports[index], &response);
+    }
+    result->latencies[type].push_back(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() -
+                                                             scheduled)
+            .count());
+    if (!status.ok()) {
+      ++result->failures[type];
+    }
+    scheduled += interval;
+  }
+}
+
+// Returns the given percentile of sorted latencies, in microseconds.
+double Percentile(const std::vector<int64_t>& sorted, double percentile) {
+  if (sorted.empty()) {
+    return 0;
+  }
+  size_t index = static_cast<size_t>(percentile / 100 * (sorted.size() - 1));
+  return sorted[index] / 1000.0;
+}
+
+double Ratio(uint64_t numerator, uint64_t denominator) {
+  return denominator == 0 ? 0 : static_cast<double>(numerator) / denominator;
+}
+
+void PrintResults(const Flags& flags, double elapsed_s,
+                  const std::vector<ThreadResult>& results,
+                  const Statistics& stat, const FakeTransport::Stats& fake) {
+  int64_t total_calls = 0;
+  printf("%-8s %10s %10s %10s %10s %10s %10s\n", "call", "count", "failed",
+         "p50(us)", "p99(us)", "p999(us)", "max(us)");
+  for (int type = 0; type < NUM_CALL_TYPES; ++type) {
+    std::vector<int64_t> latencies;
+    int64_t failures = 0;
+    for (const auto& result : results) {
+      latencies.insert(latencies.end(), result.latencies[type].begin(),
+                       result.latencies[type].end());
+      failures += result.failures[type];
+    }
+    std::sort(latencies.begin(), latencies.end());
+    total_calls += latencies.size();
+    printf("%-8s %10zu %10lld %10.1f %10.1f %10.1f %10.1f\n",
+           kCallTypeNames[type], latencies.size(),
+           static_cast<long long>(failures), Percentile(latencies, 50),
+           Percentile(latencies, 99), Percentile(latencies, 99.9),
+           Percentile(latencies, 100));
+  }
+  printf("\nachieved qps: %.1f (target %.1f)\n", total_calls / elapsed_s,
+         flags.qps);
+
+  // Includes the RPCs sent by the final flush when the client is destroyed.
+  printf("\nupstream RPCs received by the fake server:\n");
+  printf("  Check:  %llu\n", static_cast<unsigned long long>(fake.checks));
+  printf("  Quota:  %llu\n", static_cast<unsigned long long>(fake.quotas));
+  printf("  Report: %llu (%llu operations)\n",
+         static_cast<unsigned long long>(fake.reports),
+         static_cast<unsigned long long>(fake.report_operations));
+  printf("  failed: %llu\n", static_cast<unsigned long long>(fake.errors));
+
+  // The ratio of upstream RPCs to client calls; lower means more of the
+  // calls were served from the cache or aggregated.
+  printf("\nupstream RPCs per client call:\n");
+  printf("  Check:  %.4f (in flight %llu, by flush %llu)\n",
+         Ratio(stat.send_checks_in_flight + stat.send_checks_by_flush,
+               stat.total_called_checks),
+         static_cast<unsigned long long>(stat.send_checks_in_flight),
+         static_cast<unsigned long long>(stat.send_checks_by_flush));
+  printf("  Quota:  %.4f (in flight %llu, by flush %llu)\n",
+         Ratio(stat.send_quotas_in_flight + stat.send_quotas_by_flush,
+               stat.total_called_quotas),
+         static_cast<unsigned long long>(stat.send_quotas_in_flight),
+         static_cast<unsigned long long>(stat.send_quotas_by_flush));
+  printf("  Report: %.4f (in flight %llu, by flush %llu)\n",
+         Ratio(stat.send_reports_in_flight + stat.send_reports_by_flush,
+               stat.total_called_reports),
+         static_cast<unsigned long long>(stat.send_reports_in_flight),
+         static_cast<unsigned long long>(stat.send_reports_by_flush));
+  printf("  Report operations per upstream Report: %.2f\n",
+         Ratio(stat.send_report_operations,
+               stat.send_reports_in_flight + stat.send_reports_by_flush));
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  Flags flags;
+  if (!ParseFlags(argc, argv, &flags)) {
+    return 1;
+  }
+  if (flags.qps <= 0 || flags.threads <= 0 || flags.consumers <= 0 ||
+      flags.methods <= 0 || flags.check_percent + flags.quota_percent > 100) {
+    fprintf(stderr, "Invalid flag values.\n");
+    return 1;
+  }
+
+  FakeTransport::Options fake_options;
+  fake_options.latency_ms = flags.latency_ms;
+  fake_options.error_rate = flags.error_rate;
+  fake_options.check_error_rate = flags.check_error_rate;
+  fake_options.quota_exhausted_rate = flags.quota_exhausted_rate;
+  FakeTransport transport(fake_options);
+
+  ServiceControlClientOptions options(
+      CheckAggregationOptions(
+          flags.check_cache_entries, flags.check_flush_interval_ms,
+          flags.check_expiration_ms, flags.cache_shards),
+      QuotaAggregationOptions(flags.quota_cache_entries,
+                              flags.quota_refresh_interval_ms,
+                              kDefaultQuotaExpirationInMS, flags.cache_shards),
+      ReportAggregationOptions(flags.report_cache_entries,
+                               flags.report_flush_interval_ms,
+                               flags.cache_shards));
+  options.check_transport = [&transport](const CheckRequest& request,
+                                         CheckResponse* response,
+                                         TransportDoneFunc on_done) {
+    transport.Check(request, response, on_done);
+  };
+  options.quota_transport = [&transport](const AllocateQuotaRequest& request,
+                                         AllocateQuotaResponse* response,
+                                         TransportDoneFunc on_done) {
+    transport.Quota(request, response, on_done);
+  };
+  options.report_transport = [&transport](const ReportRequest& request,
+                                          ReportResponse* response,
+                                          TransportDoneFunc on_done) {
+    transport.Report(request, response, on_done);
+  };
+  options.periodic_timer = [](int interval_ms,
+                              std::function<void()> timer_func) {
+    return std::unique_ptr<PeriodicTimer>(
+        new ThreadPeriodicTimer(interval_ms, timer_func));
+  };
+
+  std::unique_ptr<ServiceControlClient> client =
+      CreateServiceControlClient(kServiceName, kServiceConfigId, options);
+
+  Workload workload = CreateWorkload(flags);
+  std::vector<ThreadResult> results(flags.threads);
+  std::vector<std::thread> threads;
+  Clock::time_point start_time = Clock::now();
+  Clock::time_point end_time =
+      start_time + std::chrono::seconds(flags.duration_s);
+  for (int i = 0; i < flags.threads; ++i) {
+    threads.emplace_back(RunThread, std::cref(flags), std::cref(workload),
+                         client.get(), end_time, i + 1, &results[i]);
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+  double elapsed_s =
+      std::chrono::duration<double>(Clock::now() - start_time).count();
+
+  // Completes the calls still in flight, then lets the client flush what is
+  // left in its caches.
+  transport.Stop();
+  Statistics stat;
+  (void)client->GetStatistics(&stat);
+  client.reset();
+
+  PrintResults(flags, elapsed_s, results, stat, transport.GetStats());
+  return 0;
+}
@@ -25,6 +25,7 @@ limitations under the License.
 #include "google/api/servicecontrol/v1/service_controller.pb.h"
 #include "google/protobuf/stubs/status.h"
 #include "include/aggregation_options.h"
+#include "src/signature.h"
 
 namespace google {
 namespace service_control_client {
@@ -89,6 +90,14 @@ class QuotaAggregator {
       const ::google::api::servicecontrol::v1::AllocateQuotaRequest& request,
       ::google::api::servicecontrol::v1::AllocateQuotaResponse* response) = 0;
 
+  // Same as above, but returns the cached response itself instead of a copy.
+  // The response is immutable, an update of the cache entry replaces it.
+  virtual ::google::protobuf::util::Status Quota(
+      const ::google::api::servicecontrol::v1::AllocateQuotaRequest& request,
+      std::shared_ptr<
+          const ::google::api::servicecontrol::v1::AllocateQuotaResponse>*
+          response) = 0;
+
   // Caches a response from a remote Service Controller AllocateQuota call.
   virtual ::google::protobuf::util::Status CacheResponse(
       const ::google::api::servicecontrol::v1::AllocateQuotaRequest& request,
@@ -122,6 +131,14 @@ class CheckAggregator {
   using FlushCallback = std::function<void(
       const ::google::api::servicecontrol::v1::CheckRequest&)>;
 
+  // Refresh callback is called, after the cache lock is released, to refresh
+  // a cached response in the background. It needs to send the request to
+  // server and call CacheResponse() with the signature once the response
+  // arrives. See CheckAggregationOptions::stale_while_revalidate_ms.
+  using RefreshCallback = std::function<void(
+      const Signature&,
+      const ::google::api::servicecontrol::v1::CheckRequest&)>;
+
   virtual ~CheckAggregator() {}
 
   // Sets the flush callback function.
@@ -131,6 +148,10 @@ class CheckAggregator {
   // It will cause dead-lock.
   virtual void SetFlushCallback(FlushCallback callback) = 0;
 
+  // Sets the refresh callback function. Same requirements as the flush
+  // callback.
+  virtual void SetRefreshCallback(RefreshCallback callback) = 0;
+
   // If the check could not be handled by the cache, returns NOT_FOUND,
   // caller has to send the request to service control.
   // Otherwise, returns OK and cached response.
@@ -138,11 +159,42 @@ class CheckAggregator {
       const ::google::api::servicecontrol::v1::CheckRequest& request,
       ::google::api::servicecontrol::v1::CheckResponse* response) = 0;
 
+  // Same as above. When it returns NOT_FOUND, it also sets signature to the
+  // signature of the request. The caller can pass it to CacheResponse() once
+  // the response arrives instead of hashing the request again.
+  virtual ::google::protobuf::util::Status Check(
+      const ::google::api::servicecontrol::v1::CheckRequest& request,
+      ::google::api::servicecontrol::v1::CheckResponse* response,
+      Signature* signature) = 0;
+
+  // Same as above, but returns the cached response itself instead of a copy.
+  // The response is immutable, an update of the cache entry replaces it.
+  virtual ::google::protobuf::util::Status Check(
+      const ::google::api::servicecontrol::v1::CheckRequest& request,
+      std::shared_ptr<const ::google::api::servicecontrol::v1::CheckResponse>*
+          response,
+      Signature* signature) = 0;
+
   // Caches a response from a remote Service Controller Check call.
   virtual ::google::protobuf::util::Status CacheResponse(
       const ::google::api::servicecontrol::v1::CheckRequest& request,
       const ::google::api::servicecontrol::v1::CheckResponse& response) = 0;
 
+  // Caches a response for the request with the given signature, as set by
+  // Check().
+  virtual ::google::protobuf::util::Status CacheResponse(
+      const Signature& signature,
+      const ::google::api::servicecontrol::v1::CheckResponse& response) = 0;
+
+  // Aggregates the request into the cached positive response with the given
+  // signature, as set by Check(). Unlike Check(), it never refreshes the
+  // response, the aggregated requests are only flushed once above the limits
+  // of CheckAggregationOptions. Returns NOT_FOUND if no positive response is
+  // cached, the request is not aggregated then.
+  virtual ::google::protobuf::util::Status AggregateRequest(
+      const Signature& signature,
+      const ::google::api::servicecontrol::v1::CheckRequest& request) = 0;
+
   // When the next Flush() should be called.
   // Returns in ms from now, or -1 for never
   virtual int GetNextFlushInterval() = 0;
@@ -16,6 +16,9 @@ limitations under the License.
 #ifndef GOOGLE_SERVICE_CONTROL_CLIENT_CACHE_REMOVED_ITEMS_HANDLER_H
 #define GOOGLE_SERVICE_CONTROL_CLIENT_CACHE_REMOVED_ITEMS_HANDLER_H
 
+#include <utility>
+#include <vector>
+
 #include "src/aggregator_interface.h"
 #include "utils/simple_lru_cache.h"
 #include "utils/simple_lru_cache_inl.h"
@@ -46,6 +49,15 @@ namespace service_control_client {
 // cache_mutex_ lock has to be in between of the instantiation of StackBuffer
 // and the instantiation ofSwapper. All cache operations (which may evict cache
 // items) need to be wrapped by this code pattern.
+//
+// A sharded cache has one lock per shard, so several threads may hold a
+// shard lock at the same time. Each shard then keeps its own StackBuffer
+// pointer, set by the Swapper constructor taking that pointer's address, and
+// the shard's cache deleter passes it to AddRemovedItem():
+//    CheckCacheRemovedItemsHandler::StackBuffer stack_buffer(this);
+//    MutexLock lock(shard->mutex);
+//    CheckCacheRemovedItemsHandler::StackBuffer::Swapper swapper(
+//        &shard->stack_buffer, &stack_buffer);
 template <class RequestType>
 class CacheRemovedItemsHandler {
  public:
@@ -63,9 +75,11 @@ class CacheRemovedItemsHandler {
     flush_callback_ = callback;
   }
 
-  void AddRemovedItem(const RequestType& item) {
+  // Items are taken by value, callers pass them with std::move() to buffer
+  // them without a copy.
+  void AddRemovedItem(RequestType item) {
     if (stack_buffer_) {
-      stack_buffer_->Add(item);
+      stack_buffer_->Add(std::move(item));
     }
   }
 
@@ -73,7 +87,9 @@ class CacheRemovedItemsHandler {
   // Derived class will implement this: CheckRequest will never merge.
   // A ReportRequest can carry multiple operations, it can merge many
   // reuqests until number of operations reaches certain size.
-  virtual bool MergeItem(const RequestType& new_item, RequestType* old_item) {
+  // When it merges, it may move the content out of new_item, which is
+  // dropped afterwards.
+  virtual bool MergeItem(RequestType* new_item, RequestType* old_item) {
     return false;
   }
 
@@ -90,10 +106,10 @@ class CacheRemovedItemsHandler {
       }
     }
 
-    void Add(const RequestType& item) {
+    void Add(RequestType item) {
       if (items_.empty() ||
-          !handler_->MergeItem(item, &items_[items_.size() - 1])) {
-        items_.push_back(item);
+          !handler_->MergeItem(&item, &items_[items_.size() - 1])) {
+        items_.push_back(std::move(item));
       }
     }
 
@@ -102,14 +118,20 @@ class CacheRemovedItemsHandler {
     class Swapper final {
      public:
       Swapper(CacheRemovedItemsHandler* handler, StackBuffer* buffer)
-          : handler_(handler) {
-        handler_->stack_buffer_ = buffer;
+          : slot_(&handler->stack_buffer_) {
+        *slot_ = buffer;
+      }
+
+      // Swaps the StackBuffer pointer of a cache shard instead. It should be
+      // used within the shard lock.
+      Swapper(StackBuffer** slot, StackBuffer* buffer) : slot_(slot) {
+        *slot_ = buffer;
       }
 
-      virtual ~Swapper() { handler_->stack_buffer_ = NULL; }
+      virtual ~Swapper() { *slot_ = NULL; }
 
      private:
-      CacheRemovedItemsHandler* handler_;
+      StackBuffer** slot_;
     };
 
    private:
@@ -118,6 +140,13 @@ class CacheRemovedItemsHandler {
     std::vector<RequestType> items_;
   };
 
+  // Adds a removed item to the StackBuffer of a cache shard.
+  void AddRemovedItem(RequestType item, StackBuffer* stack_buffer) {
+    if (stack_buffer) {
+      stack_buffer->Add(std::move(item));
+    }
+  }
+
  private:
   // Mutex guarding the access of flush_callback_;
   Mutex callback_mutex_;
@@ -16,6 +16,8 @@ limitations under the License.
 #include "src/check_aggregator_impl.h"
 #include "src/signature.h"
 
+#include <algorithm>
+
 #include "google/protobuf/stubs/logging.h"
 
 using std::string;
@@ -33,6 +35,7 @@ namespace service_control_client {
 
 void CheckAggregatorImpl::CacheElem::Aggregate(
     const CheckRequest& request, const MetricKindMap* metric_kinds) {
+  MutexLock lock(aggregator_mutex_);
   if (operation_aggregator_ == NULL) {
     operation_aggregator_.reset(
         new OperationAggregator(request.operation(), metric_kinds));
@@ -47,13 +50,35 @@ CheckRequest CheckAggregatorImpl::CacheElem::ReturnCheckRequestAndClear(
   request.set_service_name(service_name);
   request.set_service_config_id(service_config_id);
 
+  MutexLock lock(aggregator_mutex_);
   if (operation_aggregator_ != NULL) {
-    *(request.mutable_operation()) = operation_aggregator_->ToOperationProto();
+    operation_aggregator_->MoveToOperationProto(request.mutable_operation());
     operation_aggregator_ = NULL;
   }
   return request;
 }
 
+bool CheckAggregatorImpl::CacheElem::ReturnCheckRequestIfAbove(
+    int64_t max_tokens, int max_operations, const string& service_name,
+    const std::string& service_config_id, CheckRequest* request) {
+  MutexLock lock(aggregator_mutex_);
+  if (operation_aggregator_ == NULL) {
+    return false;
+  }
+  if (!(max_tokens > 0 &&
+        operation_aggregator_->delta_int64_sum() >= max_tokens) &&
+      !(max_operations > 0 &&
+        operation_aggregator_->merged_operations() >= max_operations)) {
+    return false;
+  }
+
+  request->set_service_name(service_name);
+  request->set_service_config_id(service_config_id);
+  operation_aggregator_->MoveToOperationProto(request->mutable_operation());
+  operation_aggregator_ = NULL;
+  return true;
+}
+
 CheckAggregatorImpl::CheckAggregatorImpl(
     const string& service_name, const std::string& service_config_id,
     const CheckAggregationOptions& options,
@@ -65,12 +90,31 @@ CheckAggregatorImpl::CheckAggregatorImpl(
   // Converts flush_interval_ms to Cycle used by SimpleCycleTimer.
   flush_interval_in_cycle_ =
       options_.flush_interval_ms * SimpleCycleTimer::Frequency() / 1000;
+  stale_interval_in_cycle_ =
+      options_.stale_while_revalidate_ms > 0
+          ? (options_.flush_interval_ms + options_.stale_while_revalidate_ms) *
+                SimpleCycleTimer::Frequency() / 1000
+          : 0;
 
   if (options.num_entries > 0) {
-    cache_.reset(new CheckCache(
-        options.num_entries, std::bind(&CheckAggregatorImpl::OnCacheEntryDelete,
-                                       this, std::placeholders::_1)));
-    cache_->SetMaxIdleSeconds(options.expiration_ms / 1000.0);
+    int num_shards = std::min(options.num_shards, options.num_entries);
+    int shard_entries = (options.num_entries + num_shards - 1) / num_shards;
+    int64_t shard_bytes = (options.max_bytes + num_shards - 1) / num_shards;
+    for (int i = 0; i < num_shards; ++i) {
+      std::unique_ptr<CacheShard> shard(new CacheShard);
+      shard->cache.reset(new CheckCache(
+          options.max_bytes > 0 ? shard_bytes : shard_entries,
+          std::bind(&CheckAggregatorImpl::OnCacheEntryDelete, this,
+                    shard.get(), std::placeholders::_1)));
+      if (options.max_bytes > 0) {
+        shard->cache->SetMaxEntries(shard_entries);
+      }
+      if (options.admission_policy == CacheAdmissionPolicy::TINY_LFU) {
+        shard->cache->EnableTinyLfuAdmission();
+      }
+      shard->cache->SetMaxIdleSeconds(options.expiration_ms / 1000.0);
+      shards_.push_back(std::move(shard));
+    }
   }
 }
 
@@ -78,6 +122,7 @@ CheckAggregatorImpl::~CheckAggregatorImpl() {
   // FlushAll() will remove all cache items. For each removed item, it will call
   // flush_callback.  At destructor, it is better not to call the callback.
   SetFlushCallback(NULL);
+  SetRefreshCallback(NULL);
   (void)FlushAll();
 }
 
@@ -86,9 +131,34 @@ void CheckAggregatorImpl::SetFlushCallback(FlushCallback callback) {
   InternalSetFlushCallback(callback);
 }
 
+// Set the refresh callback function.
+void CheckAggregatorImpl::SetRefreshCallback(RefreshCallback callback) {
+  MutexLock lock(refresh_callback_mutex_);
+  refresh_callback_ = callback;
+}
+
 // Add a check request to cache
 Status CheckAggregatorImpl::Check(const CheckRequest& request,
                                   CheckResponse* response) {
+  Signature signature;
+  return Check(request, response, &signature);
+}
+
+Status CheckAggregatorImpl::Check(const CheckRequest& request,
+                                  CheckResponse* response,
+                                  Signature* signature) {
+  std::shared_ptr<const CheckResponse> cached_response;
+  Status status = Check(request, &cached_response, signature);
+  if (status.ok()) {
+    // Copies the response out of the shard lock.
+    *response = *cached_response;
+  }
+  return status;
+}
+
+Status CheckAggregatorImpl::Check(
+    const CheckRequest& request,
+    std::shared_ptr<const CheckResponse>* response, Signature* signature) {
   if (request.service_name() != service_name_) {
     return Status(StatusCode::kInvalidArgument,
                   (string("Invalid service name: ") + request.service_name() +
@@ -97,19 +167,104 @@ Status CheckAggregatorImpl::Check(const CheckRequest& request,
   if (!request.has_operation()) {
     return Status(StatusCode::kInvalidArgument, "operation field is required.");
   }
-  if (request.operation().importance() != Operation::LOW || !cache_) {
+  if (shards_.empty()) {
     // By returning NO_FOUND, caller will send request to server.
     return Status(StatusCode::kNotFound, "");
   }
 
-  string request_signature = GenerateCheckRequestSignature(request);
-
+  // The response of a high important operation is cached too, so the
+  // signature is needed for CacheResponse().
+  *signature = GenerateCheckRequestSignature(request);
+  if (request.operation().importance() != Operation::LOW) {
+    // By returning NO_FOUND, caller will send request to server.
+    return Status(StatusCode::kNotFound, "");
+  }
+  const Signature& request_signature = *signature;
+  CacheShard* shard = GetShard(request_signature);
+
+  // Most checks hit a cached positive response that does not need a flush.
+  // They only aggregate into the entry, which has its own lock, so they
+  // share the shard under a reader lock. The hits are recorded, and applied
+  // to the eviction order of the cache by the next writer. With max_bytes,
+  // the entry is re-charged after every aggregation, so checks skip this
+  // path.
   CheckCacheRemovedItemsHandler::StackBuffer stack_buffer(this);
-  MutexLock lock(cache_mutex_);
-  CheckCacheRemovedItemsHandler::StackBuffer::Swapper swapper(this,
-                                                              &stack_buffer);
+  if (options_.max_bytes <= 0) {
+    bool hit = false;
+    bool hits_full = false;
+    {
+      ReaderMutexLock lock(shard->mutex);
+      CacheElem* elem = shard->cache->Peek(request_signature);
+      if (elem != nullptr && elem->check_response().check_errors_size() == 0 &&
+          !ShouldFlush(*elem)) {
+        elem->Aggregate(request, metric_kinds_.get());
+        FlushIfAboveLimits(elem, &stack_buffer);
+        *response = elem->shared_check_response();
+        hit = true;
+        hits_full = RecordHit(shard, request_signature);
+      }
+    }
+    if (hit) {
+      if (hits_full) {
+        WriterMutexLock lock(shard->mutex);
+        CheckCacheRemovedItemsHandler::StackBuffer::Swapper swapper(
+            &shard->stack_buffer, &stack_buffer);
+        ApplyHits(shard);
+      }
+      return OkStatus();
+    }
+  }
+
+  std::unique_ptr<CheckRequest> refresh_request;
+  Status status = OkStatus();
+  {
+    WriterMutexLock lock(shard->mutex);
+    CheckCacheRemovedItemsHandler::StackBuffer::Swapper swapper(
+        &shard->stack_buffer, &stack_buffer);
+    ApplyHits(shard);
+    status = CheckLocked(shard, request_signature, request, response,
+                         &refresh_request);
+  }
 
-  CheckCache::ScopedLookup lookup(cache_.get(), request_signature);
+  if (refresh_request) {
+    // The callback sends a request, it is called without holding the mutex.
+    RefreshCallback refresh_callback;
+    {
+      MutexLock lock(refresh_callback_mutex_);
+      refresh_callback = refresh_callback_;
+    }
+    if (refresh_callback) {
+      refresh_callback(request_signature, *refresh_request);
+    }
+  }
+  return status;
+}
+
+bool CheckAggregatorImpl::RecordHit(CacheShard* shard,
+                                    const Signature& signature) {
+  uint32_t index = shard->num_hits.fetch_add(1, std::memory_order_relaxed);
+  if (index < kMaxHits) {
+    shard->hits[index] = signature;
+  }
+  return index == kMaxHits - 1;
+}
+
+void CheckAggregatorImpl::ApplyHits(CacheShard* shard) {
+  uint32_t num_hits = shard->num_hits.load(std::memory_order_relaxed);
+  if (num_hits == 0) return;
+  shard->num_hits.store(0, std::memory_order_relaxed);
+  if (num_hits > kMaxHits) num_hits = kMaxHits;
+  for (uint32_t i = 0; i < num_hits; ++i) {
+    CheckCache::ScopedLookup lookup(shard->cache.get(), shard->hits[i]);
+  }
+}
+
+Status CheckAggregatorImpl::CheckLocked(
+    CacheShard* shard, const Signature& request_signature,
+    const CheckRequest& request,
+    std::shared_ptr<const CheckResponse>* response,
+    std::unique_ptr<CheckRequest>* refresh_request) {
+  CheckCache::ScopedLookup lookup(shard->cache.get(), request_signature);
   if (!lookup.Found()) {
     // By returning NO_FOUND, caller will send request to server.
     return Status(StatusCode::kNotFound, "");
@@ -138,11 +293,15 @@ Status CheckAggregatorImpl::Check(const CheckRequest& request,
       return Status(StatusCode::kNotFound, "");
     } else {
       // Use cached response.
-      *response = elem->check_response();
+      *response = elem->shared_check_response();
       return OkStatus();
     }
   } else {
     elem->Aggregate(request, metric_kinds_.get());
+    FlushIfAboveLimits(elem, shard->stack_buffer);
+    if (options_.max_bytes > 0) {
+      shard->cache->UpdateSize(request_signature, elem, CacheUnits(*elem));
+    }
 
     if (ShouldFlush(*elem)) {
       if (elem->is_flushing()) {
@@ -151,11 +310,23 @@ Status CheckAggregatorImpl::Check(const CheckRequest& request,
       elem->set_is_flushing(true);
       // Setting last check to now to block more check requests to Chemist.
       elem->set_last_check_time(SimpleCycleTimer::Now());
+      if (CanServeStale(*elem)) {
+        // Sends the aggregated requests to refresh the response in
+        // background, and uses the cached response meanwhile.
+        refresh_request->reset(new CheckRequest(
+            elem->ReturnCheckRequestAndClear(service_name_,
+                                             service_config_id_)));
+        if (options_.max_bytes > 0) {
+          shard->cache->UpdateSize(request_signature, elem, CacheUnits(*elem));
+        }
+        *response = elem->shared_check_response();
+        return OkStatus();
+      }
       // By returning NO_FOUND, caller will send request to server.
       return Status(StatusCode::kNotFound, "");
     }
 
-    *response = elem->check_response();
+    *response = elem->shared_check_response();
   }
   // TODO(qiwzhang): supports quota
   // ScaleQuotaTokens(request, elem->quota_scale(), response);
@@ -163,11 +334,29 @@ Status CheckAggregatorImpl::Check(const CheckRequest& request,
   return OkStatus();
 }
 
+void CheckAggregatorImpl::FlushIfAboveLimits(
+    CacheElem* elem, CheckCacheRemovedItemsHandler::StackBuffer* stack_buffer) {
+  if (options_.max_aggregated_tokens <= 0 &&
+      options_.max_aggregated_operations <= 0) {
+    return;
+  }
+  CheckRequest request;
+  if (elem->ReturnCheckRequestIfAbove(
+          options_.max_aggregated_tokens, options_.max_aggregated_operations,
+          service_name_, service_config_id_, &request)) {
+    AddRemovedItem(std::move(request), stack_buffer);
+  }
+}
+
+bool CheckAggregatorImpl::CanServeStale(const CacheElem& elem) {
+  int64_t age = SimpleCycleTimer::Now() - elem.last_response_time();
+  return age < stale_interval_in_cycle_;
+}
+
 bool CheckAggregatorImpl::ShouldFlush(const CacheElem& elem) {
   int64_t age = SimpleCycleTimer::Now() - elem.last_check_time();
-  // TODO(chengliang): consider accumulated tokens as well. If the
-  // accumulated number of tokens is larger than a threshold, we may also
-  // decide to send the request.
+  // The accumulated tokens do not refresh the response, they are flushed by
+  // FlushIfAboveLimits() instead.
   //
   // This will prevent sending more RPCs while there is an ongoing one most of
   // the time, except when there is a long RPC that exceeds the flush interval.
@@ -176,13 +365,23 @@ bool CheckAggregatorImpl::ShouldFlush(const CacheElem& elem) {
 
 Status CheckAggregatorImpl::CacheResponse(const CheckRequest& request,
                                           const CheckResponse& response) {
-  CheckCacheRemovedItemsHandler::StackBuffer stack_buffer(this);
-  MutexLock lock(cache_mutex_);
-  CheckCacheRemovedItemsHandler::StackBuffer::Swapper swapper(this,
-                                                              &stack_buffer);
-  if (cache_) {
-    string request_signature = GenerateCheckRequestSignature(request);
-    CheckCache::ScopedLookup lookup(cache_.get(), request_signature);
+  if (shards_.empty()) {
+    return OkStatus();
+  }
+  return CacheResponse(GenerateCheckRequestSignature(request), response);
+}
+
+Status CheckAggregatorImpl::CacheResponse(const Signature& request_signature,
+                                          const CheckResponse& response) {
+  if (!shards_.empty()) {
+    CacheShard* shard = GetShard(request_signature);
+    CheckCacheRemovedItemsHandler::StackBuffer stack_buffer(this);
+    WriterMutexLock lock(shard->mutex);
+    CheckCacheRemovedItemsHandler::StackBuffer::Swapper swapper(
+        &shard->stack_buffer, &stack_buffer);
+    ApplyHits(shard);
+
+    CheckCache::ScopedLookup lookup(shard->cache.get(), request_signature);
 
     int64_t now = SimpleCycleTimer::Now();
     // TODO(qiwzhang): supports quota
@@ -190,60 +389,98 @@ Status CheckAggregatorImpl::CacheResponse(const CheckRequest& request,
     int quota_scale = 0;
     if (lookup.Found()) {
       lookup.value()->set_last_check_time(now);
+      lookup.value()->set_last_response_time(now);
       lookup.value()->set_check_response(response);
       lookup.value()->set_quota_scale(quota_scale);
       lookup.value()->set_is_flushing(false);
+      if (options_.max_bytes > 0) {
+        shard->cache->UpdateSize(request_signature, lookup.value(),
+                                 CacheUnits(*lookup.value()));
+      }
     } else {
-      CacheElem* cache_elem = new CacheElem(response, now, quota_scale);
-      cache_->Insert(request_signature, cache_elem, 1);
+      CacheElem* cache_elem =
+          shard->cache->value_pool().New(response, now, quota_scale);
+      shard->cache->Insert(request_signature, cache_elem,
+                           CacheUnits(*cache_elem));
     }
   }
 
   return OkStatus();
 }
 
+// Aggregates a request into a cached positive response. The entry is neither
+// pinned nor marked as checked, so its flush interval and eviction order are
+// left as they are.
+Status CheckAggregatorImpl::AggregateRequest(const Signature& request_signature,
+                                             const CheckRequest& request) {
+  if (shards_.empty()) {
+    return Status(StatusCode::kNotFound, "");
+  }
+  CacheShard* shard = GetShard(request_signature);
+  CheckCacheRemovedItemsHandler::StackBuffer stack_buffer(this);
+  WriterMutexLock lock(shard->mutex);
+  CheckCacheRemovedItemsHandler::StackBuffer::Swapper swapper(
+      &shard->stack_buffer, &stack_buffer);
+  ApplyHits(shard);
+
+  CacheElem* elem = shard->cache->Peek(request_signature);
+  if (elem == nullptr || elem->check_response().check_errors_size() > 0) {
+    return Status(StatusCode::kNotFound, "");
+  }
+  elem->Aggregate(request, metric_kinds_.get());
+  FlushIfAboveLimits(elem, shard->stack_buffer);
+  if (options_.max_bytes > 0) {
+    shard->cache->UpdateSize(request_signature, elem, CacheUnits(*elem));
+  }
+  return OkStatus();
+}
+
 // When the next Flush() should be called.
 // Flush() call remove expired response.
 int CheckAggregatorImpl::GetNextFlushInterval() {
-  if (!cache_) return -1;
+  if (shards_.empty()) return -1;
   return options_.expiration_ms;
 }
 
 // Flush aggregated requests whom are longer than flush_interval.
 // Called at time specified by GetNextFlushInterval().
+// The shards are flushed one at a time, the flush callback is called for the
+// items of a shard after its lock is released.
 Status CheckAggregatorImpl::Flush() {
-  CheckCacheRemovedItemsHandler::StackBuffer stack_buffer(this);
-  MutexLock lock(cache_mutex_);
-  CheckCacheRemovedItemsHandler::StackBuffer::Swapper swapper(this,
-                                                              &stack_buffer);
-  if (cache_) {
-    cache_->RemoveExpiredEntries();
+  for (const auto& shard : shards_) {
+    CheckCacheRemovedItemsHandler::StackBuffer stack_buffer(this);
+    WriterMutexLock lock(shard->mutex);
+    CheckCacheRemovedItemsHandler::StackBuffer::Swapper swapper(
+        &shard->stack_buffer, &stack_buffer);
+    ApplyHits(shard.get());
+    shard->cache->RemoveExpiredEntries();
   }
 
   return OkStatus();
 }
 
-void CheckAggregatorImpl::OnCacheEntryDelete(CacheElem* elem) {
+void CheckAggregatorImpl::OnCacheEntryDelete(CacheShard* shard,
+                                             CacheElem* elem) {
   if (!elem->HasPendingCheckRequest()) {
-    delete elem;
+    shard->cache->value_pool().Delete(elem);
     return;
   }
 
-  CheckRequest request;
-  request = elem->ReturnCheckRequestAndClear(service_name_, service_config_id_);
-  AddRemovedItem(request);
-  delete elem;
+  AddRemovedItem(
+      elem->ReturnCheckRequestAndClear(service_name_, service_config_id_),
+      shard->stack_buffer);
+  shard->cache->value_pool().Delete(elem);
 }
 
 // Flush out aggregated check requests, clear all cache items.
 // Usually called at destructor.
 Status CheckAggregatorImpl::FlushAll() {
-  CheckCacheRemovedItemsHandler::StackBuffer stack_buffer(this);
-  MutexLock lock(cache_mutex_);
-  CheckCacheRemovedItemsHandler::StackBuffer::Swapper swapper(this,
-                                                              &stack_buffer);
-  if (cache_) {
-    cache_->RemoveAll();
+  for (const auto& shard : shards_) {
+    CheckCacheRemovedItemsHandler::StackBuffer stack_buffer(this);
+    WriterMutexLock lock(shard->mutex);
+    CheckCacheRemovedItemsHandler::StackBuffer::Swapper swapper(
+        &shard->stack_buffer, &stack_buffer);
+    shard->cache->RemoveAll();
   }
 
   return OkStatus();
@@ -18,9 +18,13 @@ limitations under the License.
 #ifndef GOOGLE_SERVICE_CONTROL_CLIENT_CHECK_AGGREGATOR_IMPL_H_
 #define GOOGLE_SERVICE_CONTROL_CLIENT_CHECK_AGGREGATOR_IMPL_H_
 
+#include <array>
+#include <atomic>
+#include <memory>
 #include <string>
 #include <unordered_map>
 #include <utility>
+#include <vector>
 
 #include "google/api/metric.pb.h"
 #include "google/api/servicecontrol/v1/operation.pb.h"
@@ -28,8 +32,10 @@ limitations under the License.
 #include "src/aggregator_interface.h"
 #include "src/cache_removed_items_handler.h"
 #include "src/operation_aggregator.h"
+#include "src/signature.h"
 #include "utils/simple_lru_cache.h"
 #include "utils/simple_lru_cache_inl.h"
+#include "utils/slab_allocator.h"
 #include "utils/thread.h"
 
 namespace google {
@@ -55,6 +61,10 @@ namespace service_control_client {
 //      arrives.
 // 4) Callers will set the new response by calling CacheResponse().
 // 5) The new Check() calls after will use the new response.
+// With options.stale_while_revalidate_ms, Check() in 2) returns OK and the
+// cached response instead, and calls refresh_callback to send the aggregated
+// requests to server. Until stale_while_revalidate_ms after the refresh
+// interval, the callers never wait for the server.
 //
 // After a response is expired:
 // 1) During Flush() call, if a cached response is expired, it wil be flushed
@@ -93,10 +103,19 @@ class CheckAggregatorImpl : public CheckAggregator,
 
   // Sets the flush callback function.
   // It is called when a cache entry is expired and it has aggregated quota
-  // in the request. The callback function needs to send the request to server,
-  // calls CacheResponse() to set its response.
+  // in the request, or when the aggregated requests of an entry reach
+  // options.max_aggregated_tokens or options.max_aggregated_operations. The
+  // callback function needs to send the request to server, calls
+  // CacheResponse() to set its response.
   virtual void SetFlushCallback(FlushCallback callback);
 
+  // Sets the refresh callback function.
+  // It is called when a positive cached response is served while it is
+  // refreshed, see CheckAggregationOptions::stale_while_revalidate_ms. The
+  // callback function needs to send the request to server, calls
+  // CacheResponse() with the signature to set its response.
+  virtual void SetRefreshCallback(RefreshCallback callback);
+
   // If the check could not be handled by the cache, returns NOT_FOUND,
   // caller has to send the request to service control server and call
   // CacheResponse() to set the response to the cache.
@@ -105,11 +124,36 @@ class CheckAggregatorImpl : public CheckAggregator,
       const ::google::api::servicecontrol::v1::CheckRequest& request,
       ::google::api::servicecontrol::v1::CheckResponse* response);
 
+  // Same as above, also returns the signature of the request when it returns
+  // NOT_FOUND.
+  virtual ::google::protobuf::util::Status Check(
+      const ::google::api::servicecontrol::v1::CheckRequest& request,
+      ::google::api::servicecontrol::v1::CheckResponse* response,
+      Signature* signature);
+
+  // Same as above, returns the cached response without copying it.
+  virtual ::google::protobuf::util::Status Check(
+      const ::google::api::servicecontrol::v1::CheckRequest& request,
+      std::shared_ptr<const ::google::api::servicecontrol::v1::CheckResponse>*
+          response,
+      Signature* signature);
+
   // Caches a response from a remote Service Controller Check call.
   virtual ::google::protobuf::util::Status CacheResponse(
       const ::google::api::servicecontrol::v1::CheckRequest& request,
       const ::google::api::servicecontrol::v1::CheckResponse& response);
 
+  // Caches a response for the request with the given signature.
+  virtual ::google::protobuf::util::Status CacheResponse(
+      const Signature& signature,
+      const ::google::api::servicecontrol::v1::CheckResponse& response);
+
+  // Aggregates the request into the cached positive response with the given
+  // signature, without refreshing the response.
+  virtual ::google::protobuf::util::Status AggregateRequest(
+      const Signature& signature,
+      const ::google::api::servicecontrol::v1::CheckRequest& request);
+
   // When the next Flush() should be called.
   // Returns in ms from now, or -1 for never
   virtual int GetNextFlushInterval();
@@ -127,12 +171,16 @@ class CheckAggregatorImpl : public CheckAggregator,
    public:
     CacheElem(const ::google::api::servicecontrol::v1::CheckResponse& response,
               const int64_t time, const int quota_scale)
-        : check_response_(response),
+        : check_response_(std::make_shared<
+              ::google::api::servicecontrol::v1::CheckResponse>(response)),
+          check_response_space_(response.SpaceUsedLong()),
           last_check_time_(time),
+          last_response_time_(time),
           quota_scale_(quota_scale),
           is_flushing_(false) {}
 
-    // Aggregates the given request to this cache entry.
+    // Aggregates the given request to this cache entry. May be called by
+    // several threads holding the shard reader lock.
     void Aggregate(
         const ::google::api::servicecontrol::v1::CheckRequest& request,
         const MetricKindMap* metric_kinds);
@@ -141,19 +189,47 @@ class CheckAggregatorImpl : public CheckAggregator,
     ::google::api::servicecontrol::v1::CheckRequest ReturnCheckRequestAndClear(
         const std::string& service_name, const std::string& service_config_id);
 
+    // If the aggregated requests reach max_tokens tokens or max_operations
+    // requests, sets request to them, resets the cache entry and returns
+    // true. A limit of 0 is ignored.
+    bool ReturnCheckRequestIfAbove(
+        int64_t max_tokens, int max_operations,
+        const std::string& service_name, const std::string& service_config_id,
+        ::google::api::servicecontrol::v1::CheckRequest* request);
+
     bool HasPendingCheckRequest() const {
+      MutexLock lock(aggregator_mutex_);
       return operation_aggregator_ != NULL;
     }
 
-    // Setter for check response.
+    // Returns an estimate of the memory used by this entry in bytes.
+    size_t SpaceUsed() const {
+      MutexLock lock(aggregator_mutex_);
+      size_t space = sizeof(CacheElem) + check_response_space_;
+      if (operation_aggregator_ != NULL) {
+        space += operation_aggregator_->SpaceUsed();
+      }
+      return space;
+    }
+
+    // Setter for check response. Replaces the shared response, the ones
+    // already returned by Check() are not modified.
     inline void set_check_response(
         const ::google::api::servicecontrol::v1::CheckResponse&
             check_response) {
-      check_response_ = check_response;
+      check_response_ = std::make_shared<
+          ::google::api::servicecontrol::v1::CheckResponse>(check_response);
+      check_response_space_ = check_response_->SpaceUsedLong();
     }
     // Getter for check response.
     inline const ::google::api::servicecontrol::v1::CheckResponse&
     check_response() const {
+      return *check_response_;
+    }
+    // Getter for the shared check response.
+    inline const std::shared_ptr<
+        const ::google::api::servicecontrol::v1::CheckResponse>&
+    shared_check_response() const {
       return check_response_;
     }
 
@@ -164,6 +240,15 @@ class CheckAggregatorImpl : public CheckAggregator,
     // Getter for last check time.
     inline const int64_t last_check_time() const { return last_check_time_; }
 
+    // Setter for last response time.
+    inline void set_last_response_time(const int64_t last_response_time) {
+      last_response_time_ = last_response_time;
+    }
+    // Getter for last response time.
+    inline int64_t last_response_time() const {
+      return last_response_time_;
+    }
+
     // Setter for check response.
     inline void set_quota_scale(const int quota_scale) {
       quota_scale_ = quota_scale;
@@ -176,11 +261,19 @@ class CheckAggregatorImpl : public CheckAggregator,
     inline void set_is_flushing(bool v) { is_flushing_ = v; }
 
    private:
+    // Guards operation_aggregator_, which is updated under the shard reader
+    // lock. The other fields are only updated under the shard writer lock.
+    mutable Mutex aggregator_mutex_;
+
     // Internal operation.
     std::unique_ptr<OperationAggregator> operation_aggregator_;
 
-    // The check response for the last check request.
-    ::google::api::servicecontrol::v1::CheckResponse check_response_;
+    // The check response for the last check request. It is shared with the
+    // callers of Check() and never modified.
+    std::shared_ptr<const ::google::api::servicecontrol::v1::CheckResponse>
+        check_response_;
+    // The SpaceUsedLong() of check_response_.
+    size_t check_response_space_;
     // In general, this is the last time a check response is updated.
     //
     // During flush, we set it to be the request start time to prevent a next
@@ -188,6 +281,9 @@ class CheckAggregatorImpl : public CheckAggregator,
     // works only during the flush interval, which means for long RPC, there
     // could be up to RPC_time/flush_interval ongoing check requests.
     int64_t last_check_time_;
+    // The last time a check response is set, used to bound how long it is
+    // served stale.
+    int64_t last_response_time_;
     // Scale used to predict how much quota are charged. It is calculated
     // as the tokens charged in the last check response / requested tokens.
     // The predicated amount tokens consumed is then request tokens * scale.
@@ -201,18 +297,90 @@ class CheckAggregatorImpl : public CheckAggregator,
   using CacheDeleter = std::function<void(CacheElem*)>;
   // Key is the signature of the check request. Value is the CacheElem.
   // It is a LRU cache with MaxIdelTime as response_expiration_time.
-  using CheckCache =
-      SimpleLRUCacheWithDeleter<std::string, CacheElem, CacheDeleter>;
+  // Entries and CacheElems are allocated from the slabs of the cache.
+  using CheckCache = SimpleFlatLRUCacheWithDeleter<
+      Signature, CacheElem, CacheDeleter, internal::SimpleLRUHash<Signature>,
+      std::equal_to<Signature>, SlabAllocator>;
 
   // Returns whether we should flush a cache entry.
   //   If the aggregated check request is less than flush interval, no need to
   //   flush.
   bool ShouldFlush(const CacheElem& elem);
 
+  // Adds the aggregated requests of the entry to stack_buffer if they reach
+  // options.max_aggregated_tokens or options.max_aggregated_operations.
+  void FlushIfAboveLimits(
+      CacheElem* elem, CheckCacheRemovedItemsHandler::StackBuffer* stack_buffer);
+
+  // Returns whether a positive cached response may still be served while it
+  // is refreshed in background.
+  bool CanServeStale(const CacheElem& elem);
+
+  // Returns the cost units of a cache entry: its estimated bytes if the
+  // cache is bounded in bytes, 1 otherwise.
+  size_t CacheUnits(const CacheElem& elem) const {
+    return options_.max_bytes > 0 ? elem.SpaceUsed() : 1;
+  }
+
+  // The number of cache hits of the reader lock path buffered by a shard.
+  static const uint32_t kMaxHits = 64;
+
+  // A shard of the cache. Requests are split over the shards by signature,
+  // so requests of different shards do not contend on the same mutex.
+  struct CacheShard {
+    CacheShard() : stack_buffer(NULL), num_hits(0) {}
+
+    // Mutex guarding the access of cache and stack_buffer. Check() looks up
+    // cached positive responses under a reader lock, everything else takes
+    // the writer lock.
+    SharedMutex mutex;
+
+    // The cache that maps from operation signature to an operation.
+    // Each entry costs CacheUnits().
+    std::unique_ptr<CheckCache> cache;
+
+    // Where the items removed from cache are buffered. It should only be set
+    // and reset by StackBuffer::Swapper.
+    CheckCacheRemovedItemsHandler::StackBuffer* stack_buffer;
+
+    // The signatures hit under the reader lock, see RecordHit(). A slot is
+    // written by the reader that claimed it, and read under the writer lock.
+    std::array<Signature, kMaxHits> hits;
+
+    // The number of hits recorded since the last ApplyHits(), including the
+    // ones dropped once hits is full.
+    std::atomic<uint32_t> num_hits;
+  };
+
+  // Returns the shard of the given signature. The cache must be enabled.
+  CacheShard* GetShard(const Signature& signature) {
+    return shards_[signature.shard_hash() % shards_.size()].get();
+  }
+
+  // Checks the request against its cache shard, under the shard writer lock.
+  // If the cached response is served while it is refreshed, sets
+  // refresh_request to the request refreshing it and returns OK.
+  ::google::protobuf::util::Status CheckLocked(
+      CacheShard* shard, const Signature& signature,
+      const ::google::api::servicecontrol::v1::CheckRequest& request,
+      std::shared_ptr<const ::google::api::servicecontrol::v1::CheckResponse>*
+          response,
+      std::unique_ptr<::google::api::servicecontrol::v1::CheckRequest>*
+          refresh_request);
+
+  // Records a hit of the reader lock path, to be applied later under the
+  // writer lock. Returns true if it fills the buffer of the shard, the caller
+  // should then call ApplyHits().
+  bool RecordHit(CacheShard* shard, const Signature& signature);
+
+  // Looks up the recorded hits in the cache, under the shard writer lock, so
+  // they update its eviction order and admission sketch like other hits.
+  void ApplyHits(CacheShard* shard);
+
   // Flushes the internal operation in the elem and delete the elem. The
   // response from the server is NOT cached.
   // Takes ownership of the elem.
-  void OnCacheEntryDelete(CacheElem* elem);
+  void OnCacheEntryDelete(CacheShard* shard, CacheElem* elem);
 
   // The service name for this cache.
   const std::string service_name_;
@@ -226,18 +394,21 @@ class CheckAggregatorImpl : public CheckAggregator,
   // Defaults to DELTA if not specified. Not owned.
   std::shared_ptr<MetricKindMap> metric_kinds_;
 
-  // Mutex guarding the access of cache_;
-  Mutex cache_mutex_;
-
-  // The cache that maps from operation signature to an operation.
-  // We don't calculate fine grained cost for cache entries, assign each
-  // entry 1 cost unit.
-  // Guarded by mutex_, except when compare against NULL.
-  std::unique_ptr<CheckCache> cache_;
+  // The cache shards. Empty if the cache is disabled.
+  std::vector<std::unique_ptr<CacheShard>> shards_;
 
   // flush interval in cycles.
   int64_t flush_interval_in_cycle_;
 
+  // flush interval plus stale_while_revalidate_ms in cycles.
+  int64_t stale_interval_in_cycle_;
+
+  // Mutex guarding the access of refresh_callback_.
+  Mutex refresh_callback_mutex_;
+
+  // The callback function to refresh cached responses.
+  RefreshCallback refresh_callback_;
+
   GOOGLE_DISALLOW_EVIL_CONSTRUCTORS(CheckAggregatorImpl);
 };
 
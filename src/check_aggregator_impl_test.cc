@@ -14,14 +14,17 @@ limitations under the License.
 ==============================================================================*/
 
 #include "src/check_aggregator_impl.h"
+#include "src/signature.h"
 
 #include "gmock/gmock.h"
 #include "google/protobuf/text_format.h"
 #include "google/protobuf/util/message_differencer.h"
 #include "gtest/gtest.h"
 #include "utils/status_test_util.h"
+#include "utils/thread.h"
 
 #include <unistd.h>
+#include <vector>
 
 using std::string;
 using ::google::api::servicecontrol::v1::Operation;
@@ -207,6 +210,41 @@ TEST_F(CheckAggregatorImplTest, TestCachePassResponses) {
   EXPECT_TRUE(MessageDifferencer::Equals(flushed_[0], request1_));
 }
 
+TEST_F(CheckAggregatorImplTest, TestCacheResponseWithSignature) {
+  CheckResponse response;
+  Signature signature;
+  EXPECT_ERROR_CODE(StatusCode::kNotFound,
+                    aggregator_->Check(request1_, &response, &signature));
+  EXPECT_EQ(signature, GenerateCheckRequestSignature(request1_));
+
+  EXPECT_OK(aggregator_->CacheResponse(signature, pass_response1_));
+  EXPECT_OK(aggregator_->Check(request1_, &response));
+  EXPECT_TRUE(MessageDifferencer::Equals(response, pass_response1_));
+}
+
+TEST_F(CheckAggregatorImplTest, TestSharedResponses) {
+  std::shared_ptr<const CheckResponse> response;
+  Signature signature;
+  EXPECT_ERROR_CODE(StatusCode::kNotFound,
+                    aggregator_->Check(request1_, &response, &signature));
+  EXPECT_OK(aggregator_->CacheResponse(signature, pass_response1_));
+
+  // Hits return the same cached response.
+  EXPECT_OK(aggregator_->Check(request1_, &response, &signature));
+  ASSERT_TRUE(response != nullptr);
+  EXPECT_TRUE(MessageDifferencer::Equals(*response, pass_response1_));
+  std::shared_ptr<const CheckResponse> response2;
+  EXPECT_OK(aggregator_->Check(request1_, &response2, &signature));
+  EXPECT_EQ(response, response2);
+
+  // A new response replaces the cached one, the old one is not modified.
+  EXPECT_OK(aggregator_->CacheResponse(request1_, error_response1_));
+  EXPECT_OK(aggregator_->Check(request1_, &response2, &signature));
+  EXPECT_NE(response, response2);
+  EXPECT_TRUE(MessageDifferencer::Equals(*response, pass_response1_));
+  EXPECT_TRUE(MessageDifferencer::Equals(*response2, error_response1_));
+}
+
 TEST_F(CheckAggregatorImplTest, TestCacheErrorResponses) {
   CheckResponse response;
   EXPECT_ERROR_CODE(StatusCode::kNotFound, aggregator_->Check(request1_, &response));
@@ -242,6 +280,160 @@ TEST_F(CheckAggregatorImplTest, TestCacheCapacity) {
   EXPECT_TRUE(MessageDifferencer::Equals(flushed_[1], request2_));
 }
 
+TEST_F(CheckAggregatorImplTest, TestCachedChecksUpdateEvictionOrder) {
+  CheckAggregationOptions options(2 /*entries*/, kFlushIntervalMs,
+                                  kExpirationMs);
+  aggregator_ =
+      CreateCheckAggregator(kServiceName, kServiceConfigId, options,
+                            std::shared_ptr<MetricKindMap>(new MetricKindMap));
+  ASSERT_TRUE((bool)(aggregator_));
+
+  CheckResponse response;
+  EXPECT_OK(aggregator_->CacheResponse(request1_, pass_response1_));
+  EXPECT_OK(aggregator_->CacheResponse(request2_, pass_response2_));
+
+  // The cached check makes request1 the most recently used entry.
+  EXPECT_OK(aggregator_->Check(request1_, &response));
+
+  // So request2 is evicted for request3.
+  CheckRequest request3 = request2_;
+  request3.mutable_operation()->set_operation_name("check-quota-3");
+  EXPECT_OK(aggregator_->CacheResponse(request3, pass_response2_));
+  EXPECT_OK(aggregator_->Check(request1_, &response));
+  EXPECT_TRUE(MessageDifferencer::Equals(response, pass_response1_));
+  EXPECT_ERROR_CODE(StatusCode::kNotFound,
+                    aggregator_->Check(request2_, &response));
+}
+
+TEST_F(CheckAggregatorImplTest, TestShardedCache) {
+  CheckAggregationOptions options(4 /*entries*/, kFlushIntervalMs,
+                                  kExpirationMs, 2 /*shards*/);
+  aggregator_ =
+      CreateCheckAggregator(kServiceName, kServiceConfigId, options,
+                            std::shared_ptr<MetricKindMap>(new MetricKindMap));
+  ASSERT_TRUE((bool)(aggregator_));
+  aggregator_->SetFlushCallback(std::bind(
+      &CheckAggregatorImplTest::FlushCallback, this, std::placeholders::_1));
+
+  CheckResponse response;
+  EXPECT_OK(aggregator_->CacheResponse(request1_, pass_response1_));
+  EXPECT_OK(aggregator_->CacheResponse(request2_, pass_response2_));
+  EXPECT_OK(aggregator_->Check(request1_, &response));
+  EXPECT_TRUE(MessageDifferencer::Equals(response, pass_response1_));
+  EXPECT_OK(aggregator_->Check(request2_, &response));
+  EXPECT_TRUE(MessageDifferencer::Equals(response, pass_response2_));
+
+  // FlushAll flushes the entries of all the shards.
+  EXPECT_OK(aggregator_->FlushAll());
+  EXPECT_EQ(flushed_.size(), 2);
+  EXPECT_ERROR_CODE(StatusCode::kNotFound,
+                    aggregator_->Check(request1_, &response));
+}
+
+TEST_F(CheckAggregatorImplTest, TestTinyLfuAdmission) {
+  CheckAggregationOptions options(2 /*entries*/, kFlushIntervalMs,
+                                  kExpirationMs, 1 /*shards*/,
+                                  CacheAdmissionPolicy::TINY_LFU);
+  aggregator_ =
+      CreateCheckAggregator(kServiceName, kServiceConfigId, options,
+                            std::shared_ptr<MetricKindMap>(new MetricKindMap));
+  ASSERT_TRUE((bool)(aggregator_));
+
+  // request1 is cached and checked 5 times.
+  CheckResponse response;
+  EXPECT_OK(aggregator_->CacheResponse(request1_, pass_response1_));
+  for (int i = 0; i < 5; ++i) {
+    EXPECT_OK(aggregator_->Check(request1_, &response));
+  }
+
+  // request2 is seen 3 times: 2 checks missing the cache and its response.
+  for (int i = 0; i < 2; ++i) {
+    EXPECT_ERROR_CODE(StatusCode::kNotFound,
+                      aggregator_->Check(request2_, &response));
+  }
+  EXPECT_OK(aggregator_->CacheResponse(request2_, pass_response2_));
+
+  // request3 pushes request2 out of the admission window. It is less
+  // frequent than request1, so it is evicted.
+  CheckRequest request3 = request2_;
+  request3.mutable_operation()->set_operation_name("check-quota-3");
+  EXPECT_OK(aggregator_->CacheResponse(request3, pass_response2_));
+  EXPECT_OK(aggregator_->Check(request1_, &response));
+  EXPECT_TRUE(MessageDifferencer::Equals(response, pass_response1_));
+  EXPECT_ERROR_CODE(StatusCode::kNotFound,
+                    aggregator_->Check(request2_, &response));
+}
+
+TEST_F(CheckAggregatorImplTest, TestTinyLfuAdmitsFrequentRequest) {
+  CheckAggregationOptions options(2 /*entries*/, kFlushIntervalMs,
+                                  kExpirationMs, 1 /*shards*/,
+                                  CacheAdmissionPolicy::TINY_LFU);
+  aggregator_ =
+      CreateCheckAggregator(kServiceName, kServiceConfigId, options,
+                            std::shared_ptr<MetricKindMap>(new MetricKindMap));
+  ASSERT_TRUE((bool)(aggregator_));
+
+  // request1 is cached but never checked.
+  CheckResponse response;
+  EXPECT_OK(aggregator_->CacheResponse(request1_, pass_response1_));
+
+  // request2 is seen 3 times: 2 checks missing the cache and its response.
+  for (int i = 0; i < 2; ++i) {
+    EXPECT_ERROR_CODE(StatusCode::kNotFound,
+                      aggregator_->Check(request2_, &response));
+  }
+  EXPECT_OK(aggregator_->CacheResponse(request2_, pass_response2_));
+
+  // request3 pushes request2 out of the admission window. It is more
+  // frequent than request1, so it replaces it.
+  CheckRequest request3 = request2_;
+  request3.mutable_operation()->set_operation_name("check-quota-3");
+  EXPECT_OK(aggregator_->CacheResponse(request3, pass_response2_));
+  EXPECT_OK(aggregator_->Check(request2_, &response));
+  EXPECT_TRUE(MessageDifferencer::Equals(response, pass_response2_));
+  EXPECT_ERROR_CODE(StatusCode::kNotFound,
+                    aggregator_->Check(request1_, &response));
+}
+
+TEST_F(CheckAggregatorImplTest, TestConcurrentCachedChecks) {
+  CheckAggregationOptions options(10 /*entries*/, 10000 /*flush_interval_ms*/,
+                                  20000 /*expiration_ms*/);
+  aggregator_ =
+      CreateCheckAggregator(kServiceName, kServiceConfigId, options,
+                            std::shared_ptr<MetricKindMap>(new MetricKindMap));
+  ASSERT_TRUE((bool)(aggregator_));
+  aggregator_->SetFlushCallback(std::bind(
+      &CheckAggregatorImplTest::FlushCallback, this, std::placeholders::_1));
+  EXPECT_OK(aggregator_->CacheResponse(request1_, pass_response1_));
+
+  // The cached response is read by all the threads at once, each check is
+  // aggregated.
+  const int kThreads = 4;
+  const int kChecks = 1000;
+  std::vector<Thread> threads;
+  for (int i = 0; i < kThreads; ++i) {
+    threads.emplace_back([this]() {
+      CheckResponse response;
+      for (int j = 0; j < kChecks; ++j) {
+        EXPECT_OK(aggregator_->Check(request1_, &response));
+      }
+      EXPECT_TRUE(MessageDifferencer::Equals(response, pass_response1_));
+    });
+  }
+  for (auto& thread : threads) {
+    thread.join();
+  }
+
+  EXPECT_OK(aggregator_->FlushAll());
+  ASSERT_EQ(flushed_.size(), 1);
+  EXPECT_EQ(flushed_[0]
+                .operation()
+                .metric_value_sets(0)
+                .metric_values(0)
+                .int64_value(),
+            kThreads * kChecks * 1000);
+}
+
 TEST_F(CheckAggregatorImplTest, TestRefresh) {
   CheckResponse response;
   EXPECT_ERROR_CODE(StatusCode::kNotFound, aggregator_->Check(request1_, &response));
@@ -273,6 +465,167 @@ TEST_F(CheckAggregatorImplTest, TestRefresh) {
   EXPECT_TRUE(MessageDifferencer::Equals(flushed_[0], request1_));
 }
 
+TEST_F(CheckAggregatorImplTest, TestStaleWhileRevalidate) {
+  CheckAggregationOptions options(
+      1 /*entries*/, kFlushIntervalMs, kExpirationMs, 1 /*shards*/,
+      CacheAdmissionPolicy::LRU, 0 /*max_bytes*/,
+      100 /*stale_while_revalidate_ms*/);
+  aggregator_ =
+      CreateCheckAggregator(kServiceName, kServiceConfigId, options,
+                            std::shared_ptr<MetricKindMap>(new MetricKindMap));
+  ASSERT_TRUE((bool)(aggregator_));
+  std::vector<std::pair<Signature, CheckRequest>> refreshed;
+  aggregator_->SetRefreshCallback(
+      [&refreshed](const Signature& signature, const CheckRequest& request) {
+        refreshed.push_back(std::make_pair(signature, request));
+      });
+
+  CheckResponse response;
+  EXPECT_OK(aggregator_->CacheResponse(request1_, pass_response1_));
+  EXPECT_OK(aggregator_->Check(request1_, &response));
+
+  // sleep 0.12 second.
+  usleep(120000);
+
+  // The first one uses the cached response and refreshes it in background
+  // with the aggregated requests.
+  EXPECT_OK(aggregator_->Check(request1_, &response));
+  EXPECT_TRUE(MessageDifferencer::Equals(response, pass_response1_));
+  ASSERT_EQ(refreshed.size(), 1);
+  EXPECT_EQ(refreshed[0].first, GenerateCheckRequestSignature(request1_));
+  CheckRequest expected = request1_;
+  expected.mutable_operation()
+      ->mutable_metric_value_sets(0)
+      ->mutable_metric_values(0)
+      ->set_int64_value(2000);
+  EXPECT_TRUE(MessageDifferencer::Equals(refreshed[0].second, expected));
+
+  // Second one use cached response.
+  EXPECT_OK(aggregator_->Check(request1_, &response));
+  EXPECT_EQ(refreshed.size(), 1);
+
+  // sleep 0.12 second, the response is older than the stale window.
+  usleep(120000);
+  EXPECT_ERROR_CODE(StatusCode::kNotFound,
+                    aggregator_->Check(request1_, &response));
+  EXPECT_EQ(refreshed.size(), 1);
+
+  // The refreshed response replaces the cached one.
+  EXPECT_OK(aggregator_->CacheResponse(refreshed[0].first, pass_response2_));
+  EXPECT_OK(aggregator_->Check(request1_, &response));
+  EXPECT_TRUE(MessageDifferencer::Equals(response, pass_response2_));
+  EXPECT_EQ(flushed_.size(), 0);
+}
+
+TEST_F(CheckAggregatorImplTest, TestAggregateRequest) {
+  CheckAggregationOptions options(
+      2 /*entries*/, kFlushIntervalMs, kExpirationMs, 1 /*shards*/,
+      CacheAdmissionPolicy::LRU, 0 /*max_bytes*/,
+      100 /*stale_while_revalidate_ms*/);
+  aggregator_ =
+      CreateCheckAggregator(kServiceName, kServiceConfigId, options,
+                            std::shared_ptr<MetricKindMap>(new MetricKindMap));
+  ASSERT_TRUE((bool)(aggregator_));
+  std::vector<std::pair<Signature, CheckRequest>> refreshed;
+  aggregator_->SetRefreshCallback(
+      [&refreshed](const Signature& signature, const CheckRequest& request) {
+        refreshed.push_back(std::make_pair(signature, request));
+      });
+
+  Signature signature1 = GenerateCheckRequestSignature(request1_);
+  Signature signature2 = GenerateCheckRequestSignature(request2_);
+  EXPECT_ERROR_CODE(StatusCode::kNotFound,
+                    aggregator_->AggregateRequest(signature1, request1_));
+  EXPECT_OK(aggregator_->CacheResponse(request1_, pass_response1_));
+  EXPECT_OK(aggregator_->CacheResponse(request2_, error_response2_));
+
+  // sleep 0.12 second, past the flush interval.
+  usleep(120000);
+
+  // Aggregating does not refresh the response, nor aggregates into the
+  // negative response.
+  EXPECT_OK(aggregator_->AggregateRequest(signature1, request1_));
+  EXPECT_EQ(refreshed.size(), 0);
+  EXPECT_ERROR_CODE(StatusCode::kNotFound,
+                    aggregator_->AggregateRequest(signature2, request2_));
+
+  // The next check still refreshes them, with the aggregated request.
+  CheckResponse response;
+  EXPECT_OK(aggregator_->Check(request1_, &response));
+  ASSERT_EQ(refreshed.size(), 1);
+  CheckRequest expected = request1_;
+  expected.mutable_operation()
+      ->mutable_metric_value_sets(0)
+      ->mutable_metric_values(0)
+      ->set_int64_value(2000);
+  EXPECT_TRUE(MessageDifferencer::Equals(refreshed[0].second, expected));
+  EXPECT_ERROR_CODE(StatusCode::kNotFound,
+                    aggregator_->Check(request2_, &response));
+}
+
+TEST_F(CheckAggregatorImplTest, TestFlushAggregatedTokens) {
+  CheckAggregationOptions options(
+      1 /*entries*/, kFlushIntervalMs, kExpirationMs, 1 /*shards*/,
+      CacheAdmissionPolicy::LRU, 0 /*max_bytes*/,
+      0 /*stale_while_revalidate_ms*/, 2500 /*flush_cache_entry_tokens*/);
+  aggregator_ =
+      CreateCheckAggregator(kServiceName, kServiceConfigId, options,
+                            std::shared_ptr<MetricKindMap>(new MetricKindMap));
+  ASSERT_TRUE((bool)(aggregator_));
+  aggregator_->SetFlushCallback(std::bind(
+      &CheckAggregatorImplTest::FlushCallback, this, std::placeholders::_1));
+
+  CheckResponse response;
+  EXPECT_OK(aggregator_->CacheResponse(request1_, pass_response1_));
+  for (int i = 0; i < 5; ++i) {
+    EXPECT_OK(aggregator_->Check(request1_, &response));
+    EXPECT_TRUE(MessageDifferencer::Equals(response, pass_response1_));
+  }
+
+  // Each request asks for 1000 tokens: the third one flushes 3000 tokens,
+  // the last two stay aggregated.
+  ASSERT_EQ(flushed_.size(), 1);
+  CheckRequest expected = request1_;
+  expected.mutable_operation()
+      ->mutable_metric_value_sets(0)
+      ->mutable_metric_values(0)
+      ->set_int64_value(3000);
+  EXPECT_TRUE(MessageDifferencer::Equals(flushed_[0], expected));
+
+  EXPECT_OK(aggregator_->FlushAll());
+  ASSERT_EQ(flushed_.size(), 2);
+  expected.mutable_operation()
+      ->mutable_metric_value_sets(0)
+      ->mutable_metric_values(0)
+      ->set_int64_value(2000);
+  EXPECT_TRUE(MessageDifferencer::Equals(flushed_[1], expected));
+}
+
+TEST_F(CheckAggregatorImplTest, TestFlushAggregatedOperations) {
+  CheckAggregationOptions options(
+      1 /*entries*/, kFlushIntervalMs, kExpirationMs, 1 /*shards*/,
+      CacheAdmissionPolicy::LRU, 0 /*max_bytes*/,
+      0 /*stale_while_revalidate_ms*/, 0 /*flush_cache_entry_tokens*/,
+      2 /*flush_cache_entry_operations*/);
+  aggregator_ =
+      CreateCheckAggregator(kServiceName, kServiceConfigId, options,
+                            std::shared_ptr<MetricKindMap>(new MetricKindMap));
+  ASSERT_TRUE((bool)(aggregator_));
+  aggregator_->SetFlushCallback(std::bind(
+      &CheckAggregatorImplTest::FlushCallback, this, std::placeholders::_1));
+
+  CheckResponse response;
+  EXPECT_OK(aggregator_->CacheResponse(request1_, pass_response1_));
+  for (int i = 0; i < 5; ++i) {
+    EXPECT_OK(aggregator_->Check(request1_, &response));
+  }
+  EXPECT_EQ(flushed_.size(), 2);
+
+  EXPECT_OK(aggregator_->FlushAll());
+  EXPECT_EQ(flushed_.size(), 3);
+  EXPECT_TRUE(MessageDifferencer::Equals(flushed_[2], request1_));
+}
+
 TEST_F(CheckAggregatorImplTest, TestCacheExpired) {
   CheckResponse response;
   EXPECT_ERROR_CODE(StatusCode::kNotFound, aggregator_->Check(request1_, &response));
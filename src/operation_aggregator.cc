@@ -21,9 +21,12 @@ limitations under the License.
 
 #include "google/protobuf/stubs/logging.h"
 
+#include <algorithm>
+
 using std::string;
 using ::google::protobuf::Timestamp;
 using google::api::MetricDescriptor;
+using google::api::servicecontrol::v1::LogEntry;
 using google::api::servicecontrol::v1::MetricValue;
 using google::api::servicecontrol::v1::MetricValueSet;
 using google::api::servicecontrol::v1::Operation;
@@ -33,95 +36,156 @@ namespace service_control_client {
 
 namespace {
 
-// Each logEntry is about 0.5 KB. LogEntries can only be appended.
-// Not to append too many logEntries in one operation in order to
-// limit the final report size.
-const int kMaxLogEntries = 100;
-
 // Returns whether timestamp a is before b or not.
 bool TimestampBefore(const Timestamp& a, const Timestamp& b) {
   return a.seconds() < b.seconds() ||
          (a.seconds() == b.seconds() && a.nanos() < b.nanos());
 }
 
-// Merges two metric values, with metric kind being Cumulative or
-// Gauge.
-//
-// New value will override old value, based on the end time.
-void MergeCumulativeOrGaugeMetricValue(const MetricValue& from,
-                                       MetricValue* to) {
-  if (TimestampBefore(from.end_time(), to->end_time())) return;
+}  //  namespace
 
-  *to = from;
+OperationAggregator::AggregatedValue::AggregatedValue(
+    uint32_t metric, MetricDescriptor::MetricKind kind,
+    const MetricValue& value)
+    : value_(value),
+      metric_(metric),
+      delta_(kind == MetricDescriptor::DELTA),
+      int64_sum_(value.int64_value()),
+      double_sum_(value.double_value()),
+      start_{value.has_start_time(), value.start_time().seconds(),
+             value.start_time().nanos()},
+      end_{value.has_end_time(), value.end_time().seconds(),
+           value.end_time().nanos()} {
+  if (delta_ && value.has_distribution_value()) {
+    distribution_.reset(
+        new DistributionAccumulator(value.distribution_value()));
+    // Keeps the value case, for the checks of Merge().
+    value_.mutable_distribution_value()->Clear();
+  }
 }
 
-// Merges two metric values, with metric kind being Delta.
-//
-// Time [from_start, from_end] and [to_start, to_end] will be merged to time
-// [min(from_start, to_start), max(from_end, to_end)]. It is OK to have gap or
-// overlap between the two time spans.
+void OperationAggregator::AggregatedValue::MergeTime(const Timestamp& from,
+                                                     bool later, Time* t) {
+  if (t->set) {
+    bool before = from.seconds() < t->seconds ||
+                  (from.seconds() == t->seconds && from.nanos() < t->nanos);
+    bool after = from.seconds() > t->seconds ||
+                 (from.seconds() == t->seconds && from.nanos() > t->nanos);
+    if (later ? !after : !before) return;
+  }
+  t->set = true;
+  t->seconds = from.seconds();
+  t->nanos = from.nanos();
+}
+
+// For DELTA metrics, time [from_start, from_end] and [to_start, to_end] will
+// be merged to time [min(from_start, to_start), max(from_end, to_end)]. It is
+// OK to have gap or overlap between the two time spans. For
+// INT64/DOUBLE/DISTRIBUTION, values will be added together, except no change
+// when the bucket options does not match.
 //
-// For INT64/DOUBLE/MONEY/DISTRIBUTION, values will be added together,
-// except no change when the bucket options does not match.
-void MergeDeltaMetricValue(const MetricValue& from, MetricValue* to) {
-  if (to->value_case() != from.value_case()) {
+// For CUMULATIVE and GAUGE metrics, the new value will override the old
+// value, based on the end time.
+void OperationAggregator::AggregatedValue::Merge(const MetricValue& from) {
+  if (!delta_) {
+    if (TimestampBefore(from.end_time(), value_.end_time())) return;
+    value_ = from;
+    return;
+  }
+
+  if (value_.value_case() != from.value_case()) {
+    MetricValue to;
+    CopyTo(&to);
     GOOGLE_LOG(WARNING) << "Metric values are not compatible: "
-                        << from.DebugString() << ", " << to->DebugString();
+                        << from.DebugString() << ", " << to.DebugString();
     return;
   }
 
   if (from.has_start_time()) {
-    if (!to->has_start_time() ||
-        TimestampBefore(from.start_time(), to->start_time())) {
-      *(to->mutable_start_time()) = from.start_time();
-    }
+    MergeTime(from.start_time(), false, &start_);
   }
-
   if (from.has_end_time()) {
-    if (!to->has_end_time() ||
-        TimestampBefore(to->end_time(), from.end_time())) {
-      *(to->mutable_end_time()) = from.end_time();
-    }
+    MergeTime(from.end_time(), true, &end_);
   }
 
-  switch (to->value_case()) {
+  switch (value_.value_case()) {
     case MetricValue::kInt64Value:
-      to->set_int64_value(to->int64_value() + from.int64_value());
+      int64_sum_ += from.int64_value();
       break;
     case MetricValue::kDoubleValue:
-      to->set_double_value(to->double_value() + from.double_value());
+      double_sum_ += from.double_value();
       break;
     case MetricValue::kDistributionValue:
-      (void)DistributionHelper::Merge(from.distribution_value(),
-                                to->mutable_distribution_value());
+      (void)distribution_->Merge(from.distribution_value());
       break;
-    default:
-      GOOGLE_LOG(WARNING) << "Unknown metric kind for: " << to->DebugString();
+    default: {
+      MetricValue to;
+      CopyTo(&to);
+      GOOGLE_LOG(WARNING) << "Unknown metric kind for: " << to.DebugString();
       break;
+    }
   }
 }
 
-// Merges one metric value into another.
-void MergeMetricValue(MetricDescriptor::MetricKind metric_kind,
-                      const MetricValue& from, MetricValue* to) {
-  if (metric_kind == MetricDescriptor::DELTA) {
-    MergeDeltaMetricValue(from, to);
-  } else {
-    MergeCumulativeOrGaugeMetricValue(from, to);
+void OperationAggregator::AggregatedValue::SetNativeFields(
+    MetricValue* to) const {
+  if (!delta_) return;
+
+  if (start_.set) {
+    to->mutable_start_time()->set_seconds(start_.seconds);
+    to->mutable_start_time()->set_nanos(start_.nanos);
+  }
+  if (end_.set) {
+    to->mutable_end_time()->set_seconds(end_.seconds);
+    to->mutable_end_time()->set_nanos(end_.nanos);
+  }
+  if (to->value_case() == MetricValue::kInt64Value) {
+    to->set_int64_value(int64_sum_);
+  } else if (to->value_case() == MetricValue::kDoubleValue) {
+    to->set_double_value(double_sum_);
+  } else if (distribution_) {
+    distribution_->CopyTo(to->mutable_distribution_value());
   }
 }
 
-}  //  namespace
+void OperationAggregator::AggregatedValue::CopyTo(MetricValue* to) const {
+  *to = value_;
+  SetNativeFields(to);
+}
+
+void OperationAggregator::AggregatedValue::MoveTo(MetricValue* to) {
+  to->Swap(&value_);
+  SetNativeFields(to);
+}
 
 OperationAggregator::OperationAggregator(
     const Operation& operation,
     const std::unordered_map<string, MetricDescriptor::MetricKind>*
-        metric_kinds)
-    : operation_(operation), metric_kinds_(metric_kinds) {
+        metric_kinds,
+    LogEntryPolicy log_entry_policy, int max_log_entries)
+    : operation_(operation),
+      metric_kinds_(metric_kinds),
+      log_entry_policy_(log_entry_policy),
+      max_log_entries_(std::max(1, max_log_entries)),
+      log_entries_seen_(operation.log_entries_size()),
+      ring_buffer_start_(0),
+      dropped_log_entries_(0),
+      space_used_(sizeof(OperationAggregator)),
+      merged_operations_(1),
+      delta_int64_sum_(0) {
   MergeMetricValueSets(operation);
 
   // Clear the metric value sets in operation_.
   operation_.clear_metric_value_sets();
+  if (log_entry_policy_ != LogEntryPolicy::FLUSH) {
+    // The log entries are added one by one, following the policy.
+    operation_.clear_log_entries();
+    log_entries_seen_ = 0;
+  }
+  space_used_ += operation_.SpaceUsedLong() - sizeof(operation_);
+  if (log_entry_policy_ != LogEntryPolicy::FLUSH) {
+    MergeLogEntries(operation);
+  }
 }
 
 void OperationAggregator::MergeOperation(const Operation& operation) {
@@ -141,52 +205,196 @@ void OperationAggregator::MergeOperation(const Operation& operation) {
 
   MergeMetricValueSets(operation);
   MergeLogEntries(operation);
+  ++merged_operations_;
 }
 
 bool OperationAggregator::TooBig() const {
-  return operation_.log_entries_size() >= kMaxLogEntries;
+  // Each logEntry is about 0.5 KB. Not to append too many logEntries in one
+  // operation in order to limit the final report size.
+  return log_entry_policy_ == LogEntryPolicy::FLUSH &&
+         operation_.log_entries_size() >= max_log_entries_;
 }
 
 Operation OperationAggregator::ToOperationProto() const {
   Operation op(operation_);
 
-  for (const auto& metric_value_set : metric_value_sets_) {
-    MetricValueSet* set = op.add_metric_value_sets();
-    set->set_metric_name(metric_value_set.first);
-
-    for (const auto& metric_value : metric_value_set.second) {
-      *(set->add_metric_values()) = metric_value.second;
-    }
+  // The metric value sets are listed in the order of metrics_, so set i of
+  // op is the set of metrics_[i].
+  for (const Metric& metric : metrics_) {
+    op.add_metric_value_sets()->set_metric_name(metric.name);
+  }
+  for (const AggregatedValue& value : values_) {
+    value.CopyTo(op.mutable_metric_value_sets(value.metric())
+                     ->add_metric_values());
   }
+  FinishLogEntries(op.mutable_log_entries());
 
   return op;
 }
 
+void OperationAggregator::MoveToOperationProto(Operation* operation) {
+  operation->Swap(&operation_);
+  FinishLogEntries(operation->mutable_log_entries());
+  log_entries_seen_ = 0;
+  ring_buffer_start_ = 0;
+  log_entry_indexes_.clear();
+  log_entry_counts_.clear();
+  dropped_log_entries_ = 0;
+
+  int first_set = operation->metric_value_sets_size();
+  for (Metric& metric : metrics_) {
+    operation->add_metric_value_sets()->mutable_metric_name()->swap(
+        metric.name);
+  }
+  for (AggregatedValue& value : values_) {
+    value.MoveTo(operation->mutable_metric_value_sets(first_set +
+                                                      value.metric())
+                     ->add_metric_values());
+  }
+  metrics_.clear();
+  metric_indexes_.clear();
+  values_.clear();
+  values_index_.clear();
+  space_used_ = sizeof(OperationAggregator);
+}
+
 void OperationAggregator::MergeLogEntries(const Operation& operation) {
   for (const auto& entry : operation.log_entries()) {
-    *(operation_.add_log_entries()) = entry;
+    AddLogEntry(entry);
   }
 }
 
-void OperationAggregator::MergeMetricValueSets(const Operation& operation) {
-  for (const auto& metric_value_set : operation.metric_value_sets()) {
-    // Intentionally use the side effect of [] to add missing keys.
-    std::unordered_map<string, MetricValue>& metric_values =
-        metric_value_sets_[metric_value_set.metric_name()];
-
-    MetricDescriptor::MetricKind metric_kind = MetricDescriptor::DELTA;
-    if (metric_kinds_) {
-      metric_kind =
-          FindWithDefault(*metric_kinds_, metric_value_set.metric_name(),
-                          MetricDescriptor::DELTA);
+void OperationAggregator::AddLogEntry(const LogEntry& entry) {
+  ++log_entries_seen_;
+  int size = operation_.log_entries_size();
+  switch (log_entry_policy_) {
+    case LogEntryPolicy::FLUSH:
+      break;
+    case LogEntryPolicy::RING_BUFFER:
+      if (size >= max_log_entries_) {
+        ReplaceLogEntry(ring_buffer_start_, entry);
+        ring_buffer_start_ = (ring_buffer_start_ + 1) % size;
+        return;
+      }
+      break;
+    case LogEntryPolicy::SAMPLE:
+      if (size >= max_log_entries_) {
+        // Keeps each of the log entries seen with the same probability.
+        int64_t index = std::uniform_int_distribution<int64_t>(
+            0, log_entries_seen_ - 1)(sample_random_);
+        if (index < size) {
+          ReplaceLogEntry(index, entry);
+        } else {
+          DropLogEntry(entry);
+        }
+        return;
+      }
+      break;
+    case LogEntryPolicy::DEDUP: {
+      Signature signature = GenerateLogEntrySignature(entry);
+      auto it = log_entry_indexes_.find(signature);
+      if (it != log_entry_indexes_.end()) {
+        ++log_entry_counts_[it->second];
+        return;
+      }
+      if (size >= max_log_entries_) {
+        DropLogEntry(entry);
+        return;
+      }
+      log_entry_indexes_[signature] = size;
+      log_entry_counts_.push_back(1);
+      space_used_ += sizeof(signature) + sizeof(int) + sizeof(int64_t);
+      break;
+    }
+  }
+  *(operation_.add_log_entries()) = entry;
+  space_used_ += entry.SpaceUsedLong();
+}
+
+void OperationAggregator::ReplaceLogEntry(int index, const LogEntry& entry) {
+  LogEntry* replaced = operation_.mutable_log_entries(index);
+  DropLogEntry(*replaced);
+  space_used_ -= replaced->SpaceUsedLong();
+  *replaced = entry;
+  space_used_ += replaced->SpaceUsedLong();
+}
+
+void OperationAggregator::DropLogEntry(const LogEntry& entry) {
+  if (dropped_log_entries_ == 0) {
+    space_used_ += entry.name().size();
+  }
+  ++dropped_log_entries_;
+  dropped_log_entry_.set_name(entry.name());
+  dropped_log_entry_.set_severity(entry.severity());
+  *(dropped_log_entry_.mutable_timestamp()) = entry.timestamp();
+}
+
+void OperationAggregator::FinishLogEntries(
+    ::google::protobuf::RepeatedPtrField<LogEntry>* log_entries) const {
+  // Lists the ring buffer from its oldest log entry.
+  std::rotate(log_entries->pointer_begin(),
+              log_entries->pointer_begin() + ring_buffer_start_,
+              log_entries->pointer_end());
+
+  for (size_t i = 0; i < log_entry_counts_.size(); ++i) {
+    if (log_entry_counts_[i] > 1) {
+      (*log_entries->Mutable(i)->mutable_labels())[kLogEntryCountLabel] =
+          std::to_string(log_entry_counts_[i]);
     }
+  }
+
+  if (dropped_log_entries_ > 0) {
+    LogEntry* summary = log_entries->Add();
+    *summary = dropped_log_entry_;
+    summary->set_text_payload(std::to_string(dropped_log_entries_) +
+                              " log entries were dropped by the report "
+                              "aggregation.");
+  }
+}
+
+uint32_t OperationAggregator::InternMetric(const string& name, int hint) {
+  if (static_cast<size_t>(hint) < metrics_.size() &&
+      metrics_[hint].name == name) {
+    return hint;
+  }
+  auto it = metric_indexes_.find(name);
+  if (it != metric_indexes_.end()) {
+    return it->second;
+  }
+
+  MetricDescriptor::MetricKind metric_kind = MetricDescriptor::DELTA;
+  if (metric_kinds_) {
+    metric_kind =
+        FindWithDefault(*metric_kinds_, name, MetricDescriptor::DELTA);
+  }
+  uint32_t index = metrics_.size();
+  metrics_.push_back({name, metric_kind});
+  metric_indexes_.emplace(name, index);
+  space_used_ += sizeof(Metric) + name.size();
+  return index;
+}
+
+void OperationAggregator::MergeMetricValueSets(const Operation& operation) {
+  for (int i = 0; i < operation.metric_value_sets_size(); ++i) {
+    const MetricValueSet& metric_value_set = operation.metric_value_sets(i);
+    uint32_t metric = InternMetric(metric_value_set.metric_name(), i);
+    MetricDescriptor::MetricKind metric_kind = metrics_[metric].kind;
+
     for (const auto& metric_value : metric_value_set.metric_values()) {
-      string signature = GenerateReportMetricValueSignature(metric_value);
-      MetricValue* existing = FindOrNull(metric_values, signature);
-      if (existing == nullptr) {
-        metric_values.emplace(signature, metric_value);
+      if (metric_kind == MetricDescriptor::DELTA &&
+          metric_value.value_case() == MetricValue::kInt64Value) {
+        delta_int64_sum_ += metric_value.int64_value();
+      }
+      MetricValueKey key{metric,
+                         GenerateReportMetricValueSignature(metric_value)};
+      auto it = values_index_.find(key);
+      if (it == values_index_.end()) {
+        values_index_[key] = values_.size();
+        values_.emplace_back(metric, metric_kind, metric_value);
+        space_used_ += sizeof(MetricValueKey) + sizeof(AggregatedValue) +
+                       metric_value.SpaceUsedLong() - sizeof(MetricValue);
       } else {
-        MergeMetricValue(metric_kind, metric_value, existing);
+        values_[it->second].Merge(metric_value);
       }
     }
   }
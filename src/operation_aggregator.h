@@ -18,11 +18,21 @@ limitations under the License.
 #ifndef GOOGLE_SERVICE_CONTROL_CLIENT_OPERATION_AGGREGATOR_H_
 #define GOOGLE_SERVICE_CONTROL_CLIENT_OPERATION_AGGREGATOR_H_
 
+#include <stdint.h>
+#include <memory>
+#include <random>
+#include <string>
 #include <unordered_map>
+#include <vector>
 
 #include "google/api/metric.pb.h"
+#include "google/api/servicecontrol/v1/log_entry.pb.h"
 #include "google/api/servicecontrol/v1/metric_value.pb.h"
 #include "google/api/servicecontrol/v1/operation.pb.h"
+#include "include/aggregation_options.h"
+#include "src/signature.h"
+#include "utils/distribution_helper.h"
+#include "utils/flat_hash_map.h"
 #include "utils/google_macros.h"
 
 namespace google {
@@ -32,12 +42,15 @@ namespace service_control_client {
 class OperationAggregator {
  public:
   // Constructor. Does not take ownership of metric_kinds, which must outlive
-  // this instance.
+  // this instance. log_entry_policy decides what happens once max_log_entries
+  // log entries are aggregated.
   OperationAggregator(
       const ::google::api::servicecontrol::v1::Operation& operation,
       const std::unordered_map<std::string,
                                ::google::api::MetricDescriptor::MetricKind>*
-          metric_kinds);
+          metric_kinds,
+      LogEntryPolicy log_entry_policy = LogEntryPolicy::FLUSH,
+      int max_log_entries = kDefaultMaxLogEntries);
 
   // Merges the given operation with this operation, assuming the given
   // operation has the same operation signature.
@@ -47,10 +60,106 @@ class OperationAggregator {
   // Transforms to Operation proto message.
   ::google::api::servicecontrol::v1::Operation ToOperationProto() const;
 
-  // Check if the operation is too big.
+  // Same as ToOperationProto(), but moves the aggregated operation into the
+  // given message instead of copying it. This instance is left empty, it
+  // should be deleted afterwards.
+  void MoveToOperationProto(
+      ::google::api::servicecontrol::v1::Operation* operation);
+
+  // Check if the operation is too big. Only with LogEntryPolicy::FLUSH, when
+  // it holds max_log_entries log entries.
   bool TooBig() const;
 
+  // Returns an estimate of the memory used by this instance in bytes. It is
+  // updated as operations are merged, without walking the messages again.
+  size_t SpaceUsed() const { return space_used_; }
+
+  // Returns the number of operations merged into this instance, including
+  // the initial one.
+  int64_t merged_operations() const { return merged_operations_; }
+
+  // Returns the sum of the int64 values of the DELTA metrics merged into
+  // this instance, such as the tokens requested by check requests.
+  int64_t delta_int64_sum() const { return delta_int64_sum_; }
+
  private:
+  // A metric value aggregated in values_. Its int64 or double sum, its
+  // distribution and its time span are kept in native fields while values
+  // are merged, and only written to the MetricValue message by CopyTo() and
+  // MoveTo().
+  class AggregatedValue {
+   public:
+    AggregatedValue(
+        uint32_t metric, ::google::api::MetricDescriptor::MetricKind kind,
+        const ::google::api::servicecontrol::v1::MetricValue& value);
+
+    // Merges the given value, with the same metric and labels, into this one.
+    void Merge(const ::google::api::servicecontrol::v1::MetricValue& from);
+
+    // Sets to to the aggregated value.
+    void CopyTo(::google::api::servicecontrol::v1::MetricValue* to) const;
+    // Same as CopyTo(), but moves the message into to instead of copying it.
+    void MoveTo(::google::api::servicecontrol::v1::MetricValue* to);
+
+    // Index of the metric in metrics_.
+    uint32_t metric() const { return metric_; }
+
+   private:
+    // A start or end time.
+    struct Time {
+      bool set;
+      int64_t seconds;
+      int32_t nanos;
+    };
+
+    // Sets t to the given timestamp if it is before t, or after t if later
+    // is true, or if t is unset.
+    static void MergeTime(const ::google::protobuf::Timestamp& from,
+                          bool later, Time* t);
+
+    // Writes the native fields into to.
+    void SetNativeFields(
+        ::google::api::servicecontrol::v1::MetricValue* to) const;
+
+    // The first merged value. If delta_ is true, its int64, double or
+    // distribution value and its times are stale, see int64_sum_,
+    // double_sum_, distribution_, start_ and end_.
+    ::google::api::servicecontrol::v1::MetricValue value_;
+    uint32_t metric_;
+    // Whether the metric is a DELTA metric, whose values are added together.
+    // The values of the other metrics replace each other.
+    bool delta_;
+    int64_t int64_sum_;
+    double double_sum_;
+    // Only set for DELTA distribution values.
+    std::unique_ptr<DistributionAccumulator> distribution_;
+    Time start_;
+    Time end_;
+  };
+
+  // Key of values_index_: a metric and the signature of the labels of the
+  // value.
+  struct MetricValueKey {
+    uint32_t metric;
+    Signature labels;
+
+    bool operator==(const MetricValueKey& other) const {
+      return metric == other.metric && labels == other.labels;
+    }
+  };
+
+  struct MetricValueKeyHash {
+    size_t operator()(const MetricValueKey& key) const {
+      return key.labels.hash() ^ key.metric;
+    }
+  };
+
+  // An interned metric name, with its metric kind.
+  struct Metric {
+    std::string name;
+    ::google::api::MetricDescriptor::MetricKind kind;
+  };
+
   // Merges the metric value sets in the given operation into this operation.
   void MergeMetricValueSets(
       const ::google::api::servicecontrol::v1::Operation& operation);
@@ -59,23 +168,78 @@ class OperationAggregator {
   void MergeLogEntries(
       const ::google::api::servicecontrol::v1::Operation& operation);
 
+  // Adds one log entry to operation_, following log_entry_policy_.
+  void AddLogEntry(const ::google::api::servicecontrol::v1::LogEntry& entry);
+
+  // Replaces the log entry at the given index of operation_, which is
+  // dropped.
+  void ReplaceLogEntry(
+      int index, const ::google::api::servicecontrol::v1::LogEntry& entry);
+
+  // Counts the given log entry in the summary of the dropped log entries.
+  void DropLogEntry(const ::google::api::servicecontrol::v1::LogEntry& entry);
+
+  // Applies log_entry_policy_ to the log entries copied or moved out of
+  // operation_: puts them in order, sets their counts and appends the summary
+  // of the dropped log entries.
+  void FinishLogEntries(
+      ::google::protobuf::RepeatedPtrField<
+          ::google::api::servicecontrol::v1::LogEntry>* log_entries) const;
+
+  // Returns the index in metrics_ of the metric with the given name, adding
+  // it if missing. hint is the position of the metric in the operation
+  // merged, operations usually list their metrics in the same order.
+  uint32_t InternMetric(const std::string& name, int hint);
+
   // Used to store everything but metric value sets.
   ::google::api::servicecontrol::v1::Operation operation_;
 
-  // Aggregated metric values in the operation.
-  // Key is metric_name.
-  // Value is a map of metric value signature to aggregated metric value.
-  std::unordered_map<
-      std::string,
-      std::unordered_map<std::string,
-                         ::google::api::servicecontrol::v1::MetricValue>>
-      metric_value_sets_;
+  // The metrics of the aggregated values, in the order they were added.
+  std::vector<Metric> metrics_;
+  // Index of the metrics in metrics_, by name.
+  std::unordered_map<std::string, uint32_t> metric_indexes_;
+
+  // The aggregated metric values, in the order they were added.
+  std::vector<AggregatedValue> values_;
+  // Index of the aggregated values in values_.
+  FlatHashMap<MetricValueKey, uint32_t, MetricValueKeyHash> values_index_;
 
   // Metric kinds. Key is the metric name and value is the metric kind.
   // Defaults to DELTA if not specified.
   const std::unordered_map<
       std::string, ::google::api::MetricDescriptor::MetricKind>* metric_kinds_;
 
+  // See LogEntryPolicy.
+  const LogEntryPolicy log_entry_policy_;
+  const int max_log_entries_;
+
+  // Number of log entries merged into this instance, kept or not.
+  int64_t log_entries_seen_;
+
+  // With RING_BUFFER, the index of the oldest log entry in operation_, which
+  // is replaced next.
+  int ring_buffer_start_;
+
+  // With SAMPLE, picks the log entries replaced.
+  std::minstd_rand sample_random_;
+
+  // With DEDUP, the index in operation_ of the distinct log entries, and the
+  // number of log entries merged into each of them.
+  FlatHashMap<Signature, int> log_entry_indexes_;
+  std::vector<int64_t> log_entry_counts_;
+
+  // The name, severity and timestamp of the latest dropped log entry, and the
+  // number of dropped log entries.
+  ::google::api::servicecontrol::v1::LogEntry dropped_log_entry_;
+  int64_t dropped_log_entries_;
+
+  // Estimated memory used by this instance, see SpaceUsed().
+  size_t space_used_;
+
+  // See merged_operations() and delta_int64_sum().
+  int64_t merged_operations_;
+  int64_t delta_int64_sum_;
+
   GOOGLE_DISALLOW_EVIL_CONSTRUCTORS(OperationAggregator);
 };
 
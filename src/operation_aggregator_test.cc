@@ -26,6 +26,7 @@ using std::string;
 using ::google::api::MetricDescriptor;
 using ::google::api::servicecontrol::v1::Distribution;
 using ::google::api::servicecontrol::v1::MetricValue;
+using ::google::api::servicecontrol::v1::MetricValueSet;
 using ::google::api::servicecontrol::v1::Operation;
 using ::google::type::Money;
 using ::google::protobuf::TextFormat;
@@ -407,6 +408,14 @@ TEST_F(OperationAggregatorTest, Delta_MergeOperation2AndOperation1) {
       MessageDifferencer::Equals(iop.ToOperationProto(), delta_merged12_));
 }
 
+TEST_F(OperationAggregatorTest, Delta_MoveToOperationProto) {
+  OperationAggregator iop(operation1_, &delta_metric_kind_);
+  iop.MergeOperation(operation2_);
+  Operation operation;
+  iop.MoveToOperationProto(&operation);
+  EXPECT_TRUE(MessageDifferencer::Equals(operation, delta_merged12_));
+}
+
 TEST_F(OperationAggregatorTest,
        DefaultMetricKind_MergeOperation1AndOperation2) {
   std::unordered_map<string, MetricDescriptor::MetricKind> empty_map;
@@ -416,6 +425,150 @@ TEST_F(OperationAggregatorTest,
       MessageDifferencer::Equals(iop.ToOperationProto(), delta_merged12_));
 }
 
+TEST_F(OperationAggregatorTest, SpaceUsedGrowsWithLogEntries) {
+  OperationAggregator iop(operation1_, &delta_metric_kind_);
+  size_t space = iop.SpaceUsed();
+  EXPECT_GT(space, sizeof(OperationAggregator));
+
+  // Merging the same metric values keeps their size, log entries are added.
+  size_t log_entries_space = 0;
+  for (const auto& entry : operation1_.log_entries()) {
+    log_entries_space += entry.SpaceUsedLong();
+  }
+  ASSERT_GT(log_entries_space, 0);
+  iop.MergeOperation(operation1_);
+  EXPECT_EQ(iop.SpaceUsed(), space + log_entries_space);
+}
+
+TEST_F(OperationAggregatorTest, CountsMergedOperationsAndDeltas) {
+  OperationAggregator iop(operation1_, &delta_metric_kind_);
+  EXPECT_EQ(iop.merged_operations(), 1);
+  EXPECT_EQ(iop.delta_int64_sum(), 1000);
+  iop.MergeOperation(operation2_);
+  EXPECT_EQ(iop.merged_operations(), 2);
+  EXPECT_EQ(iop.delta_int64_sum(), 3000);
+
+  // Cumulative values are not deltas.
+  OperationAggregator cumulative(operation1_, &cumulative_metric_kind_);
+  cumulative.MergeOperation(operation2_);
+  EXPECT_EQ(cumulative.merged_operations(), 2);
+  EXPECT_EQ(cumulative.delta_int64_sum(), 0);
+}
+
+TEST_F(OperationAggregatorTest, FlushLogEntries) {
+  OperationAggregator iop(operation1_, &delta_metric_kind_,
+                          LogEntryPolicy::FLUSH, 2);
+  EXPECT_FALSE(iop.TooBig());
+  iop.MergeOperation(operation2_);
+  EXPECT_TRUE(iop.TooBig());
+}
+
+TEST_F(OperationAggregatorTest, RingBufferLogEntries) {
+  OperationAggregator iop(operation1_, &delta_metric_kind_,
+                          LogEntryPolicy::RING_BUFFER, 2);
+  for (int i = 0; i < 3; ++i) {
+    operation2_.mutable_log_entries(0)->mutable_timestamp()->set_seconds(i);
+    iop.MergeOperation(operation2_);
+  }
+  EXPECT_FALSE(iop.TooBig());
+
+  // The latest 2 log entries, oldest first, and the summary of the 2 others.
+  Operation operation = iop.ToOperationProto();
+  ASSERT_EQ(operation.log_entries_size(), 3);
+  EXPECT_EQ(operation.log_entries(0).timestamp().seconds(), 1);
+  EXPECT_EQ(operation.log_entries(1).timestamp().seconds(), 2);
+  const auto& summary = operation.log_entries(2);
+  EXPECT_EQ(summary.name(), "system_event");
+  EXPECT_EQ(summary.timestamp().seconds(), 0);
+  EXPECT_EQ(summary.text_payload(),
+            "2 log entries were dropped by the report aggregation.");
+  EXPECT_EQ(
+      operation.metric_value_sets(0).metric_values(0).int64_value(), 7000);
+}
+
+TEST_F(OperationAggregatorTest, SampleLogEntries) {
+  OperationAggregator iop(operation1_, &delta_metric_kind_,
+                          LogEntryPolicy::SAMPLE, 10);
+  size_t space = 0;
+  for (int i = 0; i < 1000; ++i) {
+    iop.MergeOperation(operation2_);
+    if (i == 100) space = iop.SpaceUsed();
+  }
+  EXPECT_FALSE(iop.TooBig());
+  // Replacing log entries keeps the same size.
+  EXPECT_LE(iop.SpaceUsed(), space + 1000);
+
+  Operation operation;
+  iop.MoveToOperationProto(&operation);
+  ASSERT_EQ(operation.log_entries_size(), 11);
+  EXPECT_EQ(operation.log_entries(10).text_payload(),
+            "991 log entries were dropped by the report aggregation.");
+}
+
+TEST_F(OperationAggregatorTest, DedupLogEntries) {
+  OperationAggregator iop(operation1_, &delta_metric_kind_,
+                          LogEntryPolicy::DEDUP, 2);
+  // Differs only by timestamp from the log entry of operation1_.
+  Operation operation3 = operation1_;
+  operation3.mutable_log_entries(0)->mutable_timestamp()->set_seconds(800);
+  iop.MergeOperation(operation3);
+  iop.MergeOperation(operation2_);
+  iop.MergeOperation(operation2_);
+  operation3.mutable_log_entries(0)->set_text_payload("other");
+  iop.MergeOperation(operation3);
+  EXPECT_FALSE(iop.TooBig());
+
+  Operation operation;
+  iop.MoveToOperationProto(&operation);
+  ASSERT_EQ(operation.log_entries_size(), 3);
+  EXPECT_EQ(operation.log_entries(0).timestamp().seconds(), 700);
+  EXPECT_EQ(operation.log_entries(0).labels().at(kLogEntryCountLabel), "2");
+  EXPECT_EQ(operation.log_entries(1).text_payload(),
+            "Sample text log message 1");
+  EXPECT_EQ(operation.log_entries(1).labels().at(kLogEntryCountLabel), "2");
+  EXPECT_EQ(operation.log_entries(2).text_payload(),
+            "1 log entries were dropped by the report aggregation.");
+}
+
+TEST_F(OperationAggregatorTest, KeepsMetricValuesInInsertionOrder) {
+  const char kOtherMetric[] = "library.googleapis.com/rpc/client/bytes";
+  auto add_value = [](const string& method, int64_t value,
+                      MetricValueSet* set) {
+    MetricValue* metric_value = set->add_metric_values();
+    (*metric_value->mutable_labels())["method"] = method;
+    metric_value->set_int64_value(value);
+  };
+  // operation2_ lists the metrics in the reverse order of operation1_.
+  add_value("get", 10, operation1_.mutable_metric_value_sets(0));
+  MetricValueSet* other = operation1_.add_metric_value_sets();
+  other->set_metric_name(kOtherMetric);
+  add_value("list", 20, other);
+  *(operation2_.add_metric_value_sets()) = *other;
+  operation2_.mutable_metric_value_sets()->SwapElements(0, 1);
+  add_value("get", 30, operation2_.mutable_metric_value_sets(1));
+
+  OperationAggregator iop(operation1_, &delta_metric_kind_);
+  iop.MergeOperation(operation2_);
+  iop.MergeOperation(operation2_);
+  Operation operation;
+  iop.MoveToOperationProto(&operation);
+
+  ASSERT_EQ(operation.metric_value_sets_size(), 2);
+  const auto& set0 = operation.metric_value_sets(0);
+  EXPECT_EQ(set0.metric_name(), kMetric);
+  ASSERT_EQ(set0.metric_values_size(), 2);
+  EXPECT_EQ(set0.metric_values(0).labels().at("method"), "list");
+  EXPECT_EQ(set0.metric_values(0).int64_value(), 5000);
+  EXPECT_EQ(set0.metric_values(0).start_time().seconds(), 100);
+  EXPECT_EQ(set0.metric_values(0).end_time().seconds(), 400);
+  EXPECT_EQ(set0.metric_values(1).labels().at("method"), "get");
+  EXPECT_EQ(set0.metric_values(1).int64_value(), 70);
+  const auto& set1 = operation.metric_value_sets(1);
+  EXPECT_EQ(set1.metric_name(), kOtherMetric);
+  ASSERT_EQ(set1.metric_values_size(), 1);
+  EXPECT_EQ(set1.metric_values(0).int64_value(), 60);
+}
+
 TEST_F(OperationAggregatorTest, Delta_InconsistentMetricValue) {
   OperationAggregator iop(operation1_, &delta_metric_kind_);
   MetricValue* value =
@@ -13,6 +13,7 @@ See the License for the specific language governing permissions and
 limitations under the License.
 ==============================================================================*/
 
+#include <algorithm>
 #include <iostream>
 
 #include "src/quota_aggregator_impl.h"
@@ -74,10 +75,25 @@ QuotaAggregatorImpl::QuotaAggregatorImpl(const std::string& service_name,
       options_(options),
       in_flush_all_(false) {
   if (options.num_entries > 0) {
-    cache_.reset(new QuotaCache(
-        options.num_entries, std::bind(&QuotaAggregatorImpl::OnCacheEntryDelete,
-                                       this, std::placeholders::_1)));
-    cache_->SetAgeBasedEviction(options.refresh_interval_ms / 1000.0);
+    int num_shards =
+        std::min(std::max(1, options.num_shards), options.num_entries);
+    int shard_entries = (options.num_entries + num_shards - 1) / num_shards;
+    int64_t shard_bytes = (options.max_bytes + num_shards - 1) / num_shards;
+    for (int i = 0; i < num_shards; ++i) {
+      std::unique_ptr<CacheShard> shard(new CacheShard);
+      shard->cache.reset(new QuotaCache(
+          options.max_bytes > 0 ? shard_bytes : shard_entries,
+          std::bind(&QuotaAggregatorImpl::OnCacheEntryDelete, this,
+                    shard.get(), std::placeholders::_1)));
+      if (options.max_bytes > 0) {
+        shard->cache->SetMaxEntries(shard_entries);
+      }
+      if (options.admission_policy == CacheAdmissionPolicy::TINY_LFU) {
+        shard->cache->EnableTinyLfuAdmission();
+      }
+      shard->cache->SetAgeBasedEviction(options.refresh_interval_ms / 1000.0);
+      shards_.push_back(std::move(shard));
+    }
   }
 
   refresh_interval_in_cycle_ =
@@ -107,6 +123,19 @@ void QuotaAggregatorImpl::SetFlushCallback(FlushCallback callback) {
 ::google::protobuf::util::Status QuotaAggregatorImpl::Quota(
     const ::google::api::servicecontrol::v1::AllocateQuotaRequest& request,
     ::google::api::servicecontrol::v1::AllocateQuotaResponse* response) {
+  std::shared_ptr<const AllocateQuotaResponse> cached_response;
+  Status status = Quota(request, &cached_response);
+  if (status.ok()) {
+    // Copies the response out of the shard lock.
+    *response = *cached_response;
+  }
+  return status;
+}
+
+// Same as above, returns the cached response without copying it.
+::google::protobuf::util::Status QuotaAggregatorImpl::Quota(
+    const ::google::api::servicecontrol::v1::AllocateQuotaRequest& request,
+    std::shared_ptr<const AllocateQuotaResponse>* response) {
   if (request.service_name() != service_name_) {
     return Status(StatusCode::kInvalidArgument,
                   (string("Invalid service name: ") + request.service_name() +
@@ -118,45 +147,50 @@ void QuotaAggregatorImpl::SetFlushCallback(FlushCallback callback) {
                   "allocate operation field is required.");
   }
 
-  if (!cache_) {
+  if (shards_.empty()) {
     // By returning NO_FOUND, caller will send request to server.
     return Status(StatusCode::kNotFound, "");
   }
 
+  Signature request_signature = GenerateAllocateQuotaRequestSignature(request);
+  CacheShard* shard = GetShard(request_signature);
+
   AllocateQuotaCacheRemovedItemsHandler::StackBuffer stack_buffer(this);
-  MutexLock lock(cache_mutex_);
+  MutexLock lock(shard->mutex);
   AllocateQuotaCacheRemovedItemsHandler::StackBuffer::Swapper swapper(
-      this, &stack_buffer);
-
-  string request_signature = GenerateAllocateQuotaRequestSignature(request);
+      &shard->stack_buffer, &stack_buffer);
 
-  QuotaCache::ScopedLookup lookup(cache_.get(), request_signature);
+  QuotaCache::ScopedLookup lookup(shard->cache.get(), request_signature);
   if (!lookup.Found()) {
     // To avoid sending concurrent allocateQuota from concurrent requests.
     // insert a temporary positive response to the cache. Requests from other
     // requests will be aggregated to this temporary element until the
     // response for the actual request arrives.
     ::google::api::servicecontrol::v1::AllocateQuotaResponse temp_response;
-    CacheElem* cache_elem = new CacheElem(request, temp_response,
-                                          SimpleCycleTimer::Now());
+    CacheElem* cache_elem = shard->cache->value_pool().New(
+        request, temp_response, SimpleCycleTimer::Now());
     cache_elem->set_signature(request_signature);
     cache_elem->set_in_flight(true);
-    cache_->Insert(request_signature, cache_elem, 1);
+    InsertLocked(shard, cache_elem);
 
     // Triggers refresh
-    AddRemovedItem(request);
+    AddRemovedItem(request, shard->stack_buffer);
 
     // return positive response
-    *response = cache_elem->quota_response();
+    *response = cache_elem->shared_quota_response();
     return ::google::protobuf::util::OkStatus();
   }
 
   // Aggregate tokens if the cached response is positive
   if (lookup.value()->is_positive_response()) {
     lookup.value()->Aggregate(request);
+    if (options_.max_bytes > 0) {
+      shard->cache->UpdateSize(request_signature, lookup.value(),
+                               CacheUnits(*lookup.value()));
+    }
   }
 
-  *response = lookup.value()->quota_response();
+  *response = lookup.value()->shared_quota_response();
   return ::google::protobuf::util::OkStatus();
 }
 
@@ -164,21 +198,26 @@ void QuotaAggregatorImpl::SetFlushCallback(FlushCallback callback) {
 ::google::protobuf::util::Status QuotaAggregatorImpl::CacheResponse(
     const ::google::api::servicecontrol::v1::AllocateQuotaRequest& request,
     const ::google::api::servicecontrol::v1::AllocateQuotaResponse& response) {
-  if (!cache_) {
+  if (shards_.empty()) {
     return ::google::protobuf::util::OkStatus();
   }
 
-  string request_signature = GenerateAllocateQuotaRequestSignature(request);
+  Signature request_signature = GenerateAllocateQuotaRequestSignature(request);
+  CacheShard* shard = GetShard(request_signature);
 
   AllocateQuotaCacheRemovedItemsHandler::StackBuffer stack_buffer(this);
-  MutexLock lock(cache_mutex_);
+  MutexLock lock(shard->mutex);
   AllocateQuotaCacheRemovedItemsHandler::StackBuffer::Swapper swapper(
-      this, &stack_buffer);
+      &shard->stack_buffer, &stack_buffer);
 
-  QuotaCache::ScopedLookup lookup(cache_.get(), request_signature);
+  QuotaCache::ScopedLookup lookup(shard->cache.get(), request_signature);
   if (lookup.Found()) {
     lookup.value()->set_in_flight(false);
     lookup.value()->set_quota_response(response);
+    if (options_.max_bytes > 0) {
+      shard->cache->UpdateSize(request_signature, lookup.value(),
+                               CacheUnits(*lookup.value()));
+    }
   }
 
   return ::google::protobuf::util::OkStatus();
@@ -187,7 +226,7 @@ void QuotaAggregatorImpl::SetFlushCallback(FlushCallback callback) {
 // When the next Flush() should be called.
 // Returns in ms from now, or -1 for never
 int QuotaAggregatorImpl::GetNextFlushInterval() {
-  if (!cache_) return -1;
+  if (shards_.empty()) return -1;
   return options_.refresh_interval_ms;
 }
 
@@ -197,16 +236,31 @@ bool QuotaAggregatorImpl::ShouldDrop(const CacheElem& elem) const {
   return age >= expiration_interval_in_cycle_;
 }
 
+// The cache evicts the elements older than the refresh interval, see
+// OnCacheEntryDelete(). Younger ones are only evicted to make room.
+bool QuotaAggregatorImpl::IsRefreshDue(const CacheElem& elem) const {
+  if (refresh_interval_in_cycle_ < 0) return false;
+  int64_t age = SimpleCycleTimer::Now() - elem.insert_time();
+  return age >= refresh_interval_in_cycle_;
+}
+
+void QuotaAggregatorImpl::InsertLocked(CacheShard* shard, CacheElem* elem) {
+  elem->set_insert_time(SimpleCycleTimer::Now());
+  shard->cache->Insert(elem->signature(), elem, CacheUnits(*elem));
+}
+
 // Invalidates expired allocate quota responses.
 // Called at time specified by GetNextFlushInterval().
+// The shards are refreshed one at a time, so Quota() calls only wait for the
+// sweep of their own shard. The refresh requests of a shard are sent after
+// its lock is released.
 ::google::protobuf::util::Status QuotaAggregatorImpl::Flush() {
-  AllocateQuotaCacheRemovedItemsHandler::StackBuffer stack_buffer(this);
-  MutexLock lock(cache_mutex_);
-  AllocateQuotaCacheRemovedItemsHandler::StackBuffer::Swapper swapper(
-      this, &stack_buffer);
-
-  if (cache_) {
-    cache_->RemoveExpiredEntries();
+  for (const auto& shard : shards_) {
+    AllocateQuotaCacheRemovedItemsHandler::StackBuffer stack_buffer(this);
+    MutexLock lock(shard->mutex);
+    AllocateQuotaCacheRemovedItemsHandler::StackBuffer::Swapper swapper(
+        &shard->stack_buffer, &stack_buffer);
+    shard->cache->RemoveExpiredEntries();
   }
 
   return OkStatus();
@@ -215,21 +269,20 @@ bool QuotaAggregatorImpl::ShouldDrop(const CacheElem& elem) const {
 // Flushes out all cached check responses; clears all cache items.
 // Usually called at destructor.
 ::google::protobuf::util::Status QuotaAggregatorImpl::FlushAll() {
-  AllocateQuotaCacheRemovedItemsHandler::StackBuffer stack_buffer(this);
-  MutexLock lock(cache_mutex_);
-  AllocateQuotaCacheRemovedItemsHandler::StackBuffer::Swapper swapper(
-      this, &stack_buffer);
-
   in_flush_all_ = true;
 
-  if (cache_) {
-    cache_->RemoveAll();
+  for (const auto& shard : shards_) {
+    AllocateQuotaCacheRemovedItemsHandler::StackBuffer stack_buffer(this);
+    MutexLock lock(shard->mutex);
+    AllocateQuotaCacheRemovedItemsHandler::StackBuffer::Swapper swapper(
+        &shard->stack_buffer, &stack_buffer);
+    shard->cache->RemoveAll();
   }
 
   return OkStatus();
 }
 
-// OnCacheEntryDelete will be called behind the cache_mutex_
+// OnCacheEntryDelete will be called behind the shard mutex
 // no need to consider locking at this point
 //
 // Each cached item is removed after refresh_interval and
@@ -243,17 +296,32 @@ bool QuotaAggregatorImpl::ShouldDrop(const CacheElem& elem) const {
 //   the function cache->RemoveExpiredEntries() is called.
 // * Flush() function calls cache->RemoveExpiredEntries() and it is called
 //   periodically by service_control_impl.cc at refresh_interval.
+// * Items evicted because the cache is full, before refresh_interval, are
+//   not added back: their aggregated cost is sent and they are deleted.
 //
-void QuotaAggregatorImpl::OnCacheEntryDelete(CacheElem* elem) {
+void QuotaAggregatorImpl::OnCacheEntryDelete(CacheShard* shard,
+                                             CacheElem* elem) {
   if (in_flush_all_ || ShouldDrop(*elem)) {
-    delete elem;
+    shard->cache->value_pool().Delete(elem);
+    return;
+  }
+
+  // An element evicted to make room for others is dropped, after sending its
+  // aggregated cost. Adding it back would evict another element, and so on.
+  if (!IsRefreshDue(*elem)) {
+    if (elem->is_aggregated()) {
+      AddRemovedItem(elem->ReturnAllocateQuotaRequestAndClear(
+                         service_name_, service_config_id_),
+                     shard->stack_buffer);
+    }
+    shard->cache->value_pool().Delete(elem);
     return;
   }
 
   if (elem->in_flight()) {
     // This item is still calling the server, add it back to the cache
     // to wait for the response.
-    cache_->Insert(elem->signature(), elem, 1);
+    InsertLocked(shard, elem);
     return;
   }
 
@@ -271,10 +339,10 @@ void QuotaAggregatorImpl::OnCacheEntryDelete(CacheElem* elem) {
     }
     // Insert the element back to the cache
     // This is important for negative items to reject new requests.
-    cache_->Insert(elem->signature(), elem, 1);
+    InsertLocked(shard, elem);
     // AddRemovedItem function name is misleading, it actually calls
     // transport function to send the request to server.
-    AddRemovedItem(request);
+    AddRemovedItem(std::move(request), shard->stack_buffer);
     return;
   }
 
@@ -282,7 +350,7 @@ void QuotaAggregatorImpl::OnCacheEntryDelete(CacheElem* elem) {
   // the cache to reduce quota allocation calls. Even through removing them will
   // reduce cache size, but it will increase cache misses and quota calls since
   // each cache miss will cause a quota call.
-  cache_->Insert(elem->signature(), elem, 1);
+  InsertLocked(shard, elem);
 }
 
 std::unique_ptr<QuotaAggregator> CreateAllocateQuotaAggregator(
@@ -16,9 +16,12 @@ limitations under the License.
 #ifndef GOOGLE_SERVICE_CONTROL_CLIENT_QUOTA_AGGREGATOR_IMPL_H_
 #define GOOGLE_SERVICE_CONTROL_CLIENT_QUOTA_AGGREGATOR_IMPL_H_
 
+#include <atomic>
+#include <memory>
 #include <string>
 #include <unordered_map>
 #include <utility>
+#include <vector>
 
 #include "google/protobuf/text_format.h"
 
@@ -29,8 +32,10 @@ limitations under the License.
 #include "src/aggregator_interface.h"
 #include "src/cache_removed_items_handler.h"
 #include "src/quota_operation_aggregator.h"
+#include "src/signature.h"
 #include "utils/simple_lru_cache.h"
 #include "utils/simple_lru_cache_inl.h"
+#include "utils/slab_allocator.h"
 #include "utils/thread.h"
 
 namespace google {
@@ -68,6 +73,13 @@ class QuotaAggregatorImpl : public QuotaAggregator,
       const ::google::api::servicecontrol::v1::AllocateQuotaRequest& request,
       ::google::api::servicecontrol::v1::AllocateQuotaResponse* response);
 
+  // Same as above, returns the cached response without copying it.
+  ::google::protobuf::util::Status Quota(
+      const ::google::api::servicecontrol::v1::AllocateQuotaRequest& request,
+      std::shared_ptr<
+          const ::google::api::servicecontrol::v1::AllocateQuotaResponse>*
+          response);
+
   // Caches a response from a remote Service Controller AllocateQuota call.
   ::google::protobuf::util::Status CacheResponse(
       const ::google::api::servicecontrol::v1::AllocateQuotaRequest& request,
@@ -82,8 +94,13 @@ class QuotaAggregatorImpl : public QuotaAggregator,
                   response, const int64_t time)
         : operation_aggregator_(nullptr),
           quota_request_(request),
-          quota_response_(response),
+          quota_response_(std::make_shared<
+              ::google::api::servicecontrol::v1::AllocateQuotaResponse>(
+              response)),
+          quota_request_space_(request.SpaceUsedLong()),
+          quota_response_space_(response.SpaceUsedLong()),
           last_refresh_time_(time),
+          insert_time_(time),
           in_flight_(false) {}
 
     // Aggregates the given request to this cache entry.
@@ -96,13 +113,22 @@ class QuotaAggregatorImpl : public QuotaAggregator,
                                        const std::string& service_config_id);
 
     // Change the negative response to the positive response for refreshing
-    void ClearAllocationErrors() { quota_response_.clear_allocate_errors(); }
+    void ClearAllocationErrors() {
+      ::google::api::servicecontrol::v1::AllocateQuotaResponse response =
+          *quota_response_;
+      response.clear_allocate_errors();
+      set_quota_response(response);
+    }
 
-    // Setter for quota_response_.
+    // Setter for quota_response_. Replaces the shared response, the ones
+    // already returned by Quota() are not modified.
     inline void set_quota_response(
         const ::google::api::servicecontrol::v1::AllocateQuotaResponse&
             quota_response) {
-      quota_response_ = quota_response;
+      quota_response_ = std::make_shared<
+          ::google::api::servicecontrol::v1::AllocateQuotaResponse>(
+          quota_response);
+      quota_response_space_ = quota_response_->SpaceUsedLong();
 
       if(quota_response.allocate_errors_size() > 0) {
         operation_aggregator_ = NULL;
@@ -112,17 +138,34 @@ class QuotaAggregatorImpl : public QuotaAggregator,
     // Getter for quota_response_.
     inline const ::google::api::servicecontrol::v1::AllocateQuotaResponse&
     quota_response() const {
+      return *quota_response_;
+    }
+
+    // Getter for the shared quota_response_.
+    inline const std::shared_ptr<
+        const ::google::api::servicecontrol::v1::AllocateQuotaResponse>&
+    shared_quota_response() const {
       return quota_response_;
     }
 
+    // Returns an estimate of the memory used by this entry in bytes.
+    size_t SpaceUsed() const {
+      size_t space = sizeof(CacheElem) + quota_request_space_ +
+                     quota_response_space_ - sizeof(quota_request_);
+      if (operation_aggregator_ != nullptr) {
+        space += operation_aggregator_->SpaceUsed();
+      }
+      return space;
+    }
+
     // Return true if aggregated
     inline bool is_aggregated() const {
       return operation_aggregator_ != nullptr;
     }
 
     // Getter and Setter of signature_
-    inline std::string signature() const { return signature_; }
-    inline void set_signature(std::string v) { signature_ = v; }
+    inline const Signature& signature() const { return signature_; }
+    inline void set_signature(const Signature& v) { signature_ = v; }
 
     // Getter and Setter of in_flight_
     inline bool in_flight() const { return in_flight_; }
@@ -139,6 +182,10 @@ class QuotaAggregatorImpl : public QuotaAggregator,
     // Getter for last check time.
     inline const int64_t last_refresh_time() const { return last_refresh_time_; }
 
+    // Getter and Setter of insert_time_
+    inline int64_t insert_time() const { return insert_time_; }
+    inline void set_insert_time(int64_t v) { insert_time_ = v; }
+
    private:
     // Internal operation.
     std::unique_ptr<QuotaOperationAggregator> operation_aggregator_;
@@ -146,15 +193,25 @@ class QuotaAggregatorImpl : public QuotaAggregator,
     // The AllocateQuotaRequest for the initial allocate quota request.
     ::google::api::servicecontrol::v1::AllocateQuotaRequest quota_request_;
 
-    // The AllocateQuotaResponse for the last request.
-    ::google::api::servicecontrol::v1::AllocateQuotaResponse quota_response_;
+    // The AllocateQuotaResponse for the last request. It is shared with the
+    // callers of Quota() and never modified.
+    std::shared_ptr<
+        const ::google::api::servicecontrol::v1::AllocateQuotaResponse>
+        quota_response_;
+
+    // The SpaceUsedLong() of quota_request_ and quota_response_.
+    size_t quota_request_space_;
+    size_t quota_response_space_;
 
     // maintain the signature to move unnecessary signature generation
-    std::string signature_;
+    Signature signature_;
 
     // the last refresh time of the cached element
     int64_t last_refresh_time_;
 
+    // when the element was last inserted to the cache
+    int64_t insert_time_;
+
     // the element is waiting for the response
     bool in_flight_;
   };
@@ -163,12 +220,35 @@ class QuotaAggregatorImpl : public QuotaAggregator,
 
   // Key is the signature of the check request. Value is the CacheElem.
   // It is a LRU cache with MaxIdelTime as response_expiration_time.
-  using QuotaCache =
-      SimpleLRUCacheWithDeleter<std::string, CacheElem, CacheDeleter>;
+  // Entries and CacheElems are allocated from the slabs of the cache.
+  using QuotaCache = SimpleFlatLRUCacheWithDeleter<
+      Signature, CacheElem, CacheDeleter, internal::SimpleLRUHash<Signature>,
+      std::equal_to<Signature>, SlabAllocator>;
+
+  // A shard of the cache. Requests are split over the shards by signature,
+  // so requests of different shards do not contend on the same mutex.
+  struct CacheShard {
+    CacheShard() : stack_buffer(nullptr) {}
+
+    // Mutex guarding the access of cache and stack_buffer.
+    Mutex mutex;
+
+    // Each entry costs CacheUnits().
+    std::unique_ptr<QuotaCache> cache;
+
+    // Where the items removed from cache are buffered. It should only be set
+    // and reset by StackBuffer::Swapper.
+    AllocateQuotaCacheRemovedItemsHandler::StackBuffer* stack_buffer;
+  };
+
+  // Returns the shard of the given signature. The cache must be enabled.
+  CacheShard* GetShard(const Signature& signature) {
+    return shards_[signature.shard_hash() % shards_.size()].get();
+  }
 
   // Methods from: QuotaAggregator interface
 
-  void OnCacheEntryDelete(CacheElem* elem);
+  void OnCacheEntryDelete(CacheShard* shard, CacheElem* elem);
 
   // When the next Flush() should be called.
   // Returns in ms from now, or -1 for never
@@ -184,6 +264,19 @@ class QuotaAggregatorImpl : public QuotaAggregator,
 
   bool ShouldDrop(const CacheElem& elem) const;
 
+  // Returns true if the element was removed from the cache because it is
+  // older than the refresh interval, false if it was evicted to make room.
+  bool IsRefreshDue(const CacheElem& elem) const;
+
+  // Inserts the element to the cache of the shard, behind its mutex.
+  void InsertLocked(CacheShard* shard, CacheElem* elem);
+
+  // Returns the cost units of a cache entry: its estimated bytes if the
+  // cache is bounded in bytes, 1 otherwise.
+  size_t CacheUnits(const CacheElem& elem) const {
+    return options_.max_bytes > 0 ? elem.SpaceUsed() : 1;
+  }
+
  private:
   // The service name for this cache.
   const std::string service_name_;
@@ -193,10 +286,8 @@ class QuotaAggregatorImpl : public QuotaAggregator,
   // The check aggregation options.
   QuotaAggregationOptions options_;
 
-  // Mutex guarding the access of cache_;
-  Mutex cache_mutex_;
-
-  std::unique_ptr<QuotaCache> cache_;
+  // The cache shards. Empty if the cache is disabled.
+  std::vector<std::unique_ptr<CacheShard>> shards_;
 
   // flush interval in cycles.
   int64_t refresh_interval_in_cycle_;
@@ -204,7 +295,8 @@ class QuotaAggregatorImpl : public QuotaAggregator,
   // expire interval in cycle
   int64_t expiration_interval_in_cycle_;
 
-  bool in_flush_all_;
+  // Set by FlushAll(), read by OnCacheEntryDelete() under a shard lock.
+  std::atomic<bool> in_flush_all_;
 
   GOOGLE_DISALLOW_EVIL_CONSTRUCTORS(QuotaAggregatorImpl);
 };
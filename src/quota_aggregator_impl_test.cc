@@ -245,6 +245,26 @@ TEST_F(QuotaAggregatorImplTest, TestRequestAndCache) {
   EXPECT_TRUE(MessageDifferencer::Equals(response, pass_response1_));
 }
 
+TEST_F(QuotaAggregatorImplTest, TestSharedResponses) {
+  std::shared_ptr<const AllocateQuotaResponse> response;
+  EXPECT_OK(aggregator_->Quota(request1_, &response));
+  EXPECT_TRUE(MessageDifferencer::Equals(*response, empty_response_));
+
+  EXPECT_OK(aggregator_->CacheResponse(request1_, pass_response1_));
+
+  // Hits return the same cached response.
+  std::shared_ptr<const AllocateQuotaResponse> response1;
+  std::shared_ptr<const AllocateQuotaResponse> response2;
+  EXPECT_OK(aggregator_->Quota(request1_, &response1));
+  EXPECT_OK(aggregator_->Quota(request1_, &response2));
+  EXPECT_EQ(response1, response2);
+  EXPECT_TRUE(MessageDifferencer::Equals(*response1, pass_response1_));
+
+  // The temporary response returned before is not modified.
+  EXPECT_NE(response, response1);
+  EXPECT_TRUE(MessageDifferencer::Equals(*response, empty_response_));
+}
+
 TEST_F(QuotaAggregatorImplTest, TestCacheElementStayByAggregate) {
   AllocateQuotaResponse response;
 
@@ -352,6 +372,100 @@ TEST_F(QuotaAggregatorImplTest, TestFlushAggregatedRecord) {
   EXPECT_EQ(flushed_.size(), 2);
 }
 
+TEST_F(QuotaAggregatorImplTest, TestShardedCacheRefresh) {
+  QuotaAggregationOptions options(10, kFlushIntervalMs, kExpirationMs,
+                                  4 /*shards*/);
+  aggregator_ =
+      CreateAllocateQuotaAggregator(kServiceName, kServiceConfigId, options);
+  ASSERT_TRUE((bool)(aggregator_));
+  aggregator_->SetFlushCallback(std::bind(
+      &QuotaAggregatorImplTest::FlushCallback, this, std::placeholders::_1));
+
+  AllocateQuotaResponse response;
+  EXPECT_OK(aggregator_->Quota(request1_, &response));
+  EXPECT_OK(aggregator_->Quota(request2_, &response));
+  EXPECT_EQ(flushed_.size(), 2);
+  EXPECT_OK(aggregator_->CacheResponse(request1_, pass_response1_));
+  EXPECT_OK(aggregator_->CacheResponse(request2_, pass_response2_));
+
+  // Aggregated in the cache.
+  EXPECT_OK(aggregator_->Quota(request1_, &response));
+  EXPECT_TRUE(MessageDifferencer::Equals(response, pass_response1_));
+  EXPECT_OK(aggregator_->Quota(request2_, &response));
+  EXPECT_TRUE(MessageDifferencer::Equals(response, pass_response2_));
+  EXPECT_EQ(flushed_.size(), 2);
+
+  // The refresh sweeps all the shards.
+  std::this_thread::sleep_for(std::chrono::milliseconds(kFlushIntervalMs + 10));
+  EXPECT_OK(aggregator_->Flush());
+  EXPECT_EQ(flushed_.size(), 4);
+}
+
+TEST_F(QuotaAggregatorImplTest, TestTinyLfuRefresh) {
+  QuotaAggregationOptions options(10, kFlushIntervalMs, kExpirationMs,
+                                  1 /*shards*/,
+                                  CacheAdmissionPolicy::TINY_LFU);
+  aggregator_ =
+      CreateAllocateQuotaAggregator(kServiceName, kServiceConfigId, options);
+  ASSERT_TRUE((bool)(aggregator_));
+  aggregator_->SetFlushCallback(std::bind(
+      &QuotaAggregatorImplTest::FlushCallback, this, std::placeholders::_1));
+
+  AllocateQuotaResponse response;
+  EXPECT_OK(aggregator_->Quota(request1_, &response));
+  EXPECT_OK(aggregator_->Quota(request2_, &response));
+  EXPECT_EQ(flushed_.size(), 2);
+  EXPECT_OK(aggregator_->CacheResponse(request1_, pass_response1_));
+  EXPECT_OK(aggregator_->CacheResponse(request2_, pass_response2_));
+
+  EXPECT_OK(aggregator_->Quota(request1_, &response));
+  EXPECT_TRUE(MessageDifferencer::Equals(response, pass_response1_));
+  EXPECT_OK(aggregator_->Quota(request2_, &response));
+  EXPECT_TRUE(MessageDifferencer::Equals(response, pass_response2_));
+  EXPECT_EQ(flushed_.size(), 2);
+
+  // The entries of the admission window are refreshed too.
+  std::this_thread::sleep_for(std::chrono::milliseconds(kFlushIntervalMs + 10));
+  EXPECT_OK(aggregator_->Flush());
+  EXPECT_EQ(flushed_.size(), 4);
+}
+
+TEST_F(QuotaAggregatorImplTest, TestMaxBytesEviction) {
+  QuotaAggregationOptions options(1000, kFlushIntervalMs, kExpirationMs,
+                                  1 /*shards*/, CacheAdmissionPolicy::LRU,
+                                  4096 /*max_bytes*/);
+  aggregator_ =
+      CreateAllocateQuotaAggregator(kServiceName, kServiceConfigId, options);
+  ASSERT_TRUE((bool)(aggregator_));
+  aggregator_->SetFlushCallback(std::bind(
+      &QuotaAggregatorImplTest::FlushCallback, this, std::placeholders::_1));
+
+  // Many more consumers than the bytes hold, each with an aggregated cost.
+  const int kConsumers = 20;
+  std::vector<AllocateQuotaRequest> requests(kConsumers, request1_);
+  AllocateQuotaResponse response;
+  for (int i = 0; i < kConsumers; ++i) {
+    requests[i].mutable_allocate_operation()->set_consumer_id(
+        "consumer-" + std::to_string(i));
+    EXPECT_OK(aggregator_->Quota(requests[i], &response));
+    EXPECT_OK(aggregator_->CacheResponse(requests[i], pass_response1_));
+    EXPECT_OK(aggregator_->Quota(requests[i], &response));
+    EXPECT_TRUE(MessageDifferencer::Equals(response, pass_response1_));
+  }
+
+  // The evicted entries are dropped, their aggregated cost is sent.
+  EXPECT_GT(flushed_.size(), kConsumers);
+  for (size_t i = kConsumers; i < flushed_.size(); ++i) {
+    EXPECT_EQ(flushed_[i].allocate_operation().quota_mode(),
+              QuotaOperation::BEST_EFFORT);
+  }
+
+  // The first consumer is no longer cached: a new request is sent.
+  EXPECT_OK(aggregator_->Quota(requests[0], &response));
+  EXPECT_TRUE(MessageDifferencer::Equals(response, empty_response_));
+  EXPECT_TRUE(MessageDifferencer::Equals(flushed_.back(), requests[0]));
+}
+
 TEST_F(QuotaAggregatorImplTest, TestFlushedBeforeRefreshTimeout) {
   AllocateQuotaResponse response;
 
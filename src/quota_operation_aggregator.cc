@@ -79,7 +79,8 @@ void MergeDeltaMetricValue(const MetricValue& from, MetricValue* to) {
 
 QuotaOperationAggregator::QuotaOperationAggregator(
     const ::google::api::servicecontrol::v1::QuotaOperation& operation)
-    : operation_(operation) {
+    : operation_(operation), space_used_(sizeof(QuotaOperationAggregator)) {
+  space_used_ += operation_.SpaceUsedLong() - sizeof(operation_);
   MergeOperation(operation);
 }
 
@@ -89,10 +90,15 @@ void QuotaOperationAggregator::MergeOperation(const QuotaOperation& operation) {
 
     auto found = metric_value_sets_.find(metric_value_set.metric_name());
     if (found == metric_value_sets_.end()) {
-      metric_value_sets_[metric_value_set.metric_name()] =
-          metric_value_set.metric_values(0);
+      const MetricValue& value = metric_value_set.metric_values(0);
+      metric_value_sets_[metric_value_set.metric_name()] = value;
+      space_used_ += sizeof(string) + metric_value_set.metric_name().size() +
+                     value.SpaceUsedLong();
     } else {
+      // Merging may add the start or end time of the value.
+      space_used_ -= found->second.SpaceUsedLong();
       MergeDeltaMetricValue(metric_value_set.metric_values(0), &found->second);
+      space_used_ += found->second.SpaceUsedLong();
     }
   }
 }
@@ -45,6 +45,10 @@ class QuotaOperationAggregator {
   // Transforms to Operation proto message.
   ::google::api::servicecontrol::v1::QuotaOperation ToOperationProto() const;
 
+  // Returns an estimate of the memory used by this instance in bytes. It is
+  // updated as operations are merged, without walking the messages again.
+  size_t SpaceUsed() const { return space_used_; }
+
  private:
   // Merges the metric value sets in the given operation into this operation.
   bool MergeMetricValueSets(
@@ -59,6 +63,9 @@ class QuotaOperationAggregator {
   std::unordered_map<std::string,
                      ::google::api::servicecontrol::v1::MetricValue>
       metric_value_sets_;
+
+  // Estimated memory used by this instance, see SpaceUsed().
+  size_t space_used_;
 };
 
 }  // namespace service_control_client
@@ -124,5 +124,21 @@ TEST_F(QuotaOperationAggregatorImplTest, TestMergeOperation) {
   ASSERT_EQ(quota_metrics, expected_costs);
 }
 
+TEST_F(QuotaOperationAggregatorImplTest, TestSpaceUsed) {
+  QuotaOperationAggregator aggregator(operation1_);
+  size_t initial_space = aggregator.SpaceUsed();
+  EXPECT_GT(initial_space, sizeof(QuotaOperationAggregator));
+
+  // Merging into existing metrics does not grow the estimate.
+  aggregator.MergeOperation(operation2_);
+  EXPECT_EQ(aggregator.SpaceUsed(), initial_space);
+
+  // A new metric is charged.
+  QuotaOperation operation3 = operation2_;
+  operation3.mutable_quota_metrics(0)->set_metric_name("metric_third");
+  aggregator.MergeOperation(operation3);
+  EXPECT_GT(aggregator.SpaceUsed(), initial_space);
+}
+
 }  // namespace service_control_client
 }  // namespace google
@@ -16,6 +16,8 @@ limitations under the License.
 #include "src/report_aggregator_impl.h"
 #include "src/signature.h"
 
+#include <algorithm>
+
 #include "google/protobuf/stubs/logging.h"
 
 using std::string;
@@ -57,11 +59,21 @@ ReportAggregatorImpl::ReportAggregatorImpl(
       options_(options),
       metric_kinds_(metric_kinds) {
   if (options.num_entries > 0) {
-    cache_.reset(
-        new ReportCache(options.num_entries,
-                        std::bind(&ReportAggregatorImpl::OnCacheEntryDelete,
-                                  this, std::placeholders::_1)));
-    cache_->SetAgeBasedEviction(options.flush_interval_ms / 1000.0);
+    int num_shards = std::min(options.num_shards, options.num_entries);
+    int shard_entries = (options.num_entries + num_shards - 1) / num_shards;
+    int64_t shard_bytes = (options.max_bytes + num_shards - 1) / num_shards;
+    for (int i = 0; i < num_shards; ++i) {
+      std::unique_ptr<CacheShard> shard(new CacheShard);
+      shard->cache.reset(new ReportCache(
+          options.max_bytes > 0 ? shard_bytes : shard_entries,
+          std::bind(&ReportAggregatorImpl::OnCacheEntryDelete, this,
+                    shard.get(), std::placeholders::_1)));
+      if (options.max_bytes > 0) {
+        shard->cache->SetMaxEntries(shard_entries);
+      }
+      shard->cache->SetAgeBasedEviction(options.flush_interval_ms / 1000.0);
+      shards_.push_back(std::move(shard));
+    }
   }
 }
 
@@ -86,82 +98,96 @@ Status ReportAggregatorImpl::Report(
                   (string("Invalid service name: ") + request.service_name() +
                    string(" Expecting: ") + service_name_));
   }
-  if (HasHighImportantOperation(request) || !cache_) {
+  if (HasHighImportantOperation(request) || shards_.empty()) {
     // By returning NO_FOUND, caller will send request to server.
     return Status(StatusCode::kNotFound, "");
   }
 
+  // Starts to cache and aggregate low important operations. Each operation
+  // only locks the shard of its signature, the signature is calculated
+  // before taking the lock. The operations removed from the cache are merged
+  // in one buffer, sent once all the shard locks are released.
   ReportCacheRemovedItemsHandler::StackBuffer stack_buffer(this);
-  MutexLock lock(cache_mutex_);
-  ReportCacheRemovedItemsHandler::StackBuffer::Swapper swapper(this,
-                                                               &stack_buffer);
-
-  // Starts to cache and aggregate low important operations.
   for (const auto& operation : request.operations()) {
-    string signature = GenerateReportOperationSignature(operation);
+    Signature signature = GenerateReportOperationSignature(operation);
+    CacheShard* shard = GetShard(signature);
+
+    MutexLock lock(shard->mutex);
+    ReportCacheRemovedItemsHandler::StackBuffer::Swapper swapper(
+        &shard->stack_buffer, &stack_buffer);
 
     bool too_big = false;
     {
-      ReportCache::ScopedLookup lookup(cache_.get(), signature);
+      ReportCache::ScopedLookup lookup(shard->cache.get(), signature);
       if (lookup.Found()) {
         lookup.value()->MergeOperation(operation);
         too_big = lookup.value()->TooBig();
+        if (options_.max_bytes > 0) {
+          // Evicts other operations if the cache grows over max_bytes.
+          shard->cache->UpdateSize(signature, lookup.value(),
+                                   CacheUnits(*lookup.value()));
+        }
       } else {
-        OperationAggregator* iop =
-            new OperationAggregator(operation, metric_kinds_.get());
-        cache_->Insert(signature, iop, 1);
+        OperationAggregator* iop = shard->cache->value_pool().New(
+            operation, metric_kinds_.get(), options_.log_entry_policy,
+            options_.max_log_entries);
+        shard->cache->Insert(signature, iop, CacheUnits(*iop));
       }
     }
     // If the merged operation is too big, remove it from the cache
     // to flush it out. Make sure to do that outside of lookup scope.
     if (too_big) {
-      cache_->Remove(signature);
+      shard->cache->Remove(signature);
     }
   }
   return OkStatus();
 }
 
-void ReportAggregatorImpl::OnCacheEntryDelete(OperationAggregator* iop) {
+void ReportAggregatorImpl::OnCacheEntryDelete(CacheShard* shard,
+                                              OperationAggregator* iop) {
   // iop or cache is under projected.  This function is only called when
   // cache::Insert() or cache::Removed() is called and these operations
-  // are already protected by cache_mutex.
+  // are already protected by the shard mutex.
   ReportRequest request;
   request.set_service_name(service_name_);
   request.set_service_config_id(service_config_id_);
-  // TODO(qiwzhang): Remove this copy
-  *(request.add_operations()) = iop->ToOperationProto();
-  delete iop;
+  iop->MoveToOperationProto(request.add_operations());
+  shard->cache->value_pool().Delete(iop);
 
-  AddRemovedItem(request);
+  AddRemovedItem(std::move(request), shard->stack_buffer);
 }
 
-bool ReportAggregatorImpl::MergeItem(const ReportRequest& new_item,
+bool ReportAggregatorImpl::MergeItem(ReportRequest* new_item,
                                      ReportRequest* old_item) {
-  if (old_item->service_name() != new_item.service_name() ||
-      old_item->operations().size() + new_item.operations().size() >
+  if (old_item->service_name() != new_item->service_name() ||
+      old_item->operations().size() + new_item->operations().size() >
           kMaxOperationsToSend) {
     return false;
   }
-  old_item->MergeFrom(new_item);
+  for (auto& operation : *new_item->mutable_operations()) {
+    old_item->add_operations()->Swap(&operation);
+  }
   return true;
 }
 
 // When the next Flush() should be called.
 // Return in ms from now, or -1 for never
 int ReportAggregatorImpl::GetNextFlushInterval() {
-  if (!cache_) return -1;
+  if (shards_.empty()) return -1;
   return options_.flush_interval_ms;
 }
 
 // Flush aggregated requests whom are longer than flush_interval.
 // Called at time specified by GetNextFlushInterval().
+// The shards are flushed one at a time, the flush callback is called for the
+// items of a shard after its lock is released.
 Status ReportAggregatorImpl::Flush() {
-  ReportCacheRemovedItemsHandler::StackBuffer stack_buffer(this);
-  MutexLock lock(cache_mutex_);
-  ReportCacheRemovedItemsHandler::StackBuffer::Swapper swapper(this,
-                                                               &stack_buffer);
-  if (cache_) {
-    cache_->RemoveExpiredEntries();
+  for (const auto& shard : shards_) {
+    ReportCacheRemovedItemsHandler::StackBuffer stack_buffer(this);
+    MutexLock lock(shard->mutex);
+    ReportCacheRemovedItemsHandler::StackBuffer::Swapper swapper(
+        &shard->stack_buffer, &stack_buffer);
+    shard->cache->RemoveExpiredEntries();
   }
   return OkStatus();
 }
@@ -169,12 +195,12 @@ Status ReportAggregatorImpl::Flush() {
 // Flush out aggregated report requests, clear all cache items.
 // Usually called at destructor.
 Status ReportAggregatorImpl::FlushAll() {
-  ReportCacheRemovedItemsHandler::StackBuffer stack_buffer(this);
-  MutexLock lock(cache_mutex_);
-  ReportCacheRemovedItemsHandler::StackBuffer::Swapper swapper(this,
-                                                               &stack_buffer);
-  if (cache_) {
-    cache_->RemoveAll();
+  for (const auto& shard : shards_) {
+    ReportCacheRemovedItemsHandler::StackBuffer stack_buffer(this);
+    MutexLock lock(shard->mutex);
+    ReportCacheRemovedItemsHandler::StackBuffer::Swapper swapper(
+        &shard->stack_buffer, &stack_buffer);
+    shard->cache->RemoveAll();
   }
   return OkStatus();
 }
@@ -21,6 +21,7 @@ limitations under the License.
 #include <string>
 #include <unordered_map>
 #include <utility>
+#include <vector>
 
 #include "google/api/metric.pb.h"
 #include "google/api/servicecontrol/v1/operation.pb.h"
@@ -28,8 +29,10 @@ limitations under the License.
 #include "src/aggregator_interface.h"
 #include "src/cache_removed_items_handler.h"
 #include "src/operation_aggregator.h"
+#include "src/signature.h"
 #include "utils/simple_lru_cache.h"
 #include "utils/simple_lru_cache_inl.h"
+#include "utils/slab_allocator.h"
 #include "utils/thread.h"
 
 namespace google {
@@ -77,18 +80,49 @@ class ReportAggregatorImpl : public ReportAggregator,
  private:
   using CacheDeleter = std::function<void(OperationAggregator*)>;
   // Key is the signature of the operation. Value is the
-  // OperationAggregator.
-  using ReportCache =
-      SimpleLRUCacheWithDeleter<std::string, OperationAggregator, CacheDeleter>;
+  // OperationAggregator. Entries and OperationAggregators are allocated
+  // from the slabs of the cache.
+  using ReportCache = SimpleFlatLRUCacheWithDeleter<
+      Signature, OperationAggregator, CacheDeleter,
+      internal::SimpleLRUHash<Signature>, std::equal_to<Signature>,
+      SlabAllocator>;
+
+  // Returns the cost units of a cache entry: its estimated bytes if the
+  // cache is bounded in bytes, 1 otherwise.
+  size_t CacheUnits(const OperationAggregator& iop) const {
+    return options_.max_bytes > 0 ? iop.SpaceUsed() : 1;
+  }
+
+  // A shard of the cache. Operations are split over the shards by signature,
+  // so operations of different shards do not contend on the same mutex.
+  struct CacheShard {
+    CacheShard() : stack_buffer(nullptr) {}
+
+    // Mutex guarding the access of cache and stack_buffer.
+    Mutex mutex;
+
+    // The cache that maps from operation signature to an operation.
+    // Each entry costs CacheUnits().
+    std::unique_ptr<ReportCache> cache;
+
+    // Where the items removed from cache are buffered. It should only be set
+    // and reset by StackBuffer::Swapper.
+    ReportCacheRemovedItemsHandler::StackBuffer* stack_buffer;
+  };
+
+  // Returns the shard of the given signature. The cache must be enabled.
+  CacheShard* GetShard(const Signature& signature) {
+    return shards_[signature.shard_hash() % shards_.size()].get();
+  }
 
   // Callback function passed to Cache, called when a cache item is removed.
   // Takes ownership of the iop.
-  void OnCacheEntryDelete(OperationAggregator* iop);
+  void OnCacheEntryDelete(CacheShard* shard, OperationAggregator* iop);
 
-  // Tries to merge two report requests.
-  bool MergeItem(
-      const ::google::api::servicecontrol::v1::ReportRequest& new_item,
-      ::google::api::servicecontrol::v1::ReportRequest* old_item);
+  // Tries to merge two report requests. The operations of new_item are
+  // moved into old_item.
+  bool MergeItem(::google::api::servicecontrol::v1::ReportRequest* new_item,
+                 ::google::api::servicecontrol::v1::ReportRequest* old_item);
 
   // The service name.
   const std::string service_name_;
@@ -101,14 +135,8 @@ class ReportAggregatorImpl : public ReportAggregator,
   // Defaults to DELTA if not specified. Not owned.
   std::shared_ptr<MetricKindMap> metric_kinds_;
 
-  // Mutex guarding the access of cache_;
-  Mutex cache_mutex_;
-
-  // The cache that maps from operation signature to an operation.
-  // We don't calculate fine grained cost for cache entries, assign each
-  // entry 1 cost unit.
-  // Guarded by mutex_, except when compare against nullptr.
-  std::unique_ptr<ReportCache> cache_;
+  // The cache shards. Empty if the cache is disabled.
+  std::vector<std::unique_ptr<CacheShard>> shards_;
 
   GOOGLE_DISALLOW_EVIL_CONSTRUCTORS(ReportAggregatorImpl);
 };
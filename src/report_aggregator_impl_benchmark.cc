@@ -0,0 +1,275 @@
+/* Copyright 2021 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Benchmarks for ReportAggregatorImpl.
+//
+// Run with:
+//   bazel run -c opt :report_aggregator_impl_benchmark
+//
+// Requests are shaped by four arguments, BM_ReportAggregateThreads also
+// takes the number of cache shards:
+//   signatures:    distinct operation signatures, i.e. cache entries.
+//   metric_sets:   metric value sets per operation.
+//   labels:        labels per operation.
+//   distribution:  1 if the metric values are distributions, 0 for int64.
+//   shards:        cache shards.
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "src/report_aggregator_impl.h"
+#include "test/benchmark_util.h"
+#include "utils/distribution_helper.h"
+
+using ::google::api::servicecontrol::v1::Distribution;
+using ::google::api::servicecontrol::v1::MetricValue;
+using ::google::api::servicecontrol::v1::MetricValueSet;
+using ::google::api::servicecontrol::v1::Operation;
+using ::google::api::servicecontrol::v1::ReportRequest;
+using ::google::service_control_client::benchmark_util::OperationProfiler;
+using ::google::service_control_client::benchmark_util::PeakRssBytes;
+using ::google::service_control_client::benchmark_util::
+    ThreadAllocationStats;
+using ::google::service_control_client::benchmark_util::WallNanos;
+
+namespace google {
+namespace service_control_client {
+namespace {
+
+const char kServiceName[] = "library.googleapis.com";
+const char kServiceConfigId[] = "2016-09-19r0";
+
+// Entries are never flushed by age within a benchmark run.
+const int kLongFlushIntervalMs = 3600 * 1000;
+
+struct RequestShape {
+  int signatures;
+  int metric_sets;
+  int labels;
+  bool distribution;
+};
+
+RequestShape GetRequestShape(const ::benchmark::State& state) {
+  RequestShape shape;
+  shape.signatures = static_cast<int>(state.range(0));
+  shape.metric_sets = static_cast<int>(state.range(1));
+  shape.labels = static_cast<int>(state.range(2));
+  shape.distribution = state.range(3) != 0;
+  return shape;
+}
+
+// Builds a LOW importance report request with one operation. The index
+// selects the consumer, so requests with different indexes have different
+// signatures.
+ReportRequest CreateReportRequest(int index, const RequestShape& shape) {
+  ReportRequest request;
+  request.set_service_name(kServiceName);
+  request.set_service_config_id(kServiceConfigId);
+
+  Operation* operation = request.add_operations();
+  operation->set_operation_id("operation-" + std::to_string(index));
+  operation->set_operation_name("google.example.library.v1.Method" +
+                                std::to_string(index % 16));
+  operation->set_consumer_id("project:consumer-" + std::to_string(index));
+  operation->mutable_start_time()->set_seconds(1000);
+  operation->mutable_end_time()->set_seconds(1001);
+  operation->set_importance(Operation::LOW);
+
+  for (int i = 0; i < shape.labels; ++i) {
+    (*operation->mutable_labels())["/label_" + std::to_string(i)] =
+        "value-" + std::to_string((index + i) % 7);
+  }
+
+  for (int i = 0; i < shape.metric_sets; ++i) {
+    MetricValueSet* metric_value_set = operation->add_metric_value_sets();
+    metric_value_set->set_metric_name("library.googleapis.com/metric_" +
+                                      std::to_string(i));
+    MetricValue* metric_value = metric_value_set->add_metric_values();
+    if (shape.distribution) {
+      Distribution* distribution = metric_value->mutable_distribution_value();
+      (void)DistributionHelper::InitExponential(8, 2.0, 1.0, distribution);
+      (void)DistributionHelper::AddSample(index % 200, distribution);
+    } else {
+      metric_value->set_int64_value(1);
+    }
+  }
+  return request;
+}
+
+std::vector<ReportRequest> CreateReportRequests(const RequestShape& shape) {
+  std::vector<ReportRequest> requests;
+  requests.reserve(shape.signatures);
+  for (int i = 0; i < shape.signatures; ++i) {
+    requests.push_back(CreateReportRequest(i, shape));
+  }
+  return requests;
+}
+
+std::unique_ptr<ReportAggregator> CreateAggregator(int num_entries,
+                                                   int num_shards = 1) {
+  ReportAggregationOptions options(num_entries, kLongFlushIntervalMs,
+                                   num_shards);
+  std::unique_ptr<ReportAggregator> aggregator = CreateReportAggregator(
+      kServiceName, kServiceConfigId, options,
+      std::shared_ptr<MetricKindMap>(new MetricKindMap));
+  // Flushed requests are dropped.
+  aggregator->SetFlushCallback([](const ReportRequest& request) {});
+  return aggregator;
+}
+
+// Streams requests into a cache holding one entry per signature, so every
+// Report() merges into an existing OperationAggregator.
+//
+// Counters:
+//   bytes/entry:   heap bytes held by the cache per entry after inserting
+//                  the first request of each signature.
+//   peak_rss_mb:   peak resident set size of the process so far.
+//   flush_all_ms:  duration of the final FlushAll(), see BM_ReportFlushAll.
+void BM_ReportAggregate(::benchmark::State& state) {
+  RequestShape shape = GetRequestShape(state);
+  std::vector<ReportRequest> requests = CreateReportRequests(shape);
+  std::unique_ptr<ReportAggregator> aggregator =
+      CreateAggregator(shape.signatures * 2);
+
+  int64_t live_bytes = ThreadAllocationStats().live_bytes;
+  for (const auto& request : requests) {
+    (void)aggregator->Report(request);
+  }
+  int64_t entry_bytes = ThreadAllocationStats().live_bytes - live_bytes;
+
+  size_t index = 0;
+  OperationProfiler profiler;
+  for (auto _ : state) {
+    ::benchmark::DoNotOptimize(
+        aggregator->Report(requests[index % requests.size()]));
+    ++index;
+  }
+  profiler.Finish(state);
+
+  int64_t flush_start = WallNanos();
+  (void)aggregator->FlushAll();
+  int64_t flush_nanos = WallNanos() - flush_start;
+
+  state.SetItemsProcessed(state.iterations());
+  state.counters["bytes/entry"] =
+      static_cast<double>(entry_bytes) / shape.signatures;
+  state.counters["peak_rss_mb"] = PeakRssBytes() / (1024.0 * 1024.0);
+  state.counters["flush_all_ms"] = flush_nanos / 1e6;
+}
+
+// Measures FlushAll() on a cache holding one entry per signature. It holds
+// the shard lock while it converts every entry to a ReportRequest and merges
+// the requests, then runs the flush callback (a no-op here) after releasing
+// the lock, so its duration is an upper bound of the lock hold time.
+// Flush() goes through the same per-entry path for the expired entries, so
+// this is also the hold time of a Flush() where all the entries expired.
+void BM_ReportFlushAll(::benchmark::State& state) {
+  RequestShape shape = GetRequestShape(state);
+  std::vector<ReportRequest> requests = CreateReportRequests(shape);
+  std::unique_ptr<ReportAggregator> aggregator =
+      CreateAggregator(shape.signatures * 2);
+
+  for (auto _ : state) {
+    for (const auto& request : requests) {
+      (void)aggregator->Report(request);
+    }
+    int64_t start = WallNanos();
+    (void)aggregator->FlushAll();
+    state.SetIterationTime((WallNanos() - start) / 1e9);
+  }
+  state.counters["entries/s"] = ::benchmark::Counter(
+      static_cast<double>(state.iterations()) * shape.signatures,
+      ::benchmark::Counter::kIsRate);
+}
+
+// State shared by all the threads of one BM_ReportAggregateThreads run. It is
+// created by thread 0 before the timing loop and destroyed by thread 0 after
+// it. Google Benchmark synchronizes the threads at the start and at the end
+// of the timing loop, so the other threads may only use it inside the loop.
+struct SharedState {
+  std::unique_ptr<ReportAggregator> aggregator;
+  std::vector<ReportRequest> requests;
+};
+SharedState* shared_state = nullptr;
+
+// Like BM_ReportAggregate, with several threads reporting into one cache.
+void BM_ReportAggregateThreads(::benchmark::State& state) {
+  if (state.thread_index() == 0) {
+    RequestShape shape = GetRequestShape(state);
+    shared_state = new SharedState;
+    shared_state->requests = CreateReportRequests(shape);
+    shared_state->aggregator =
+        CreateAggregator(shape.signatures * 2, state.range(4));
+    for (const auto& request : shared_state->requests) {
+      (void)shared_state->aggregator->Report(request);
+    }
+  }
+
+  ReportAggregator* aggregator = nullptr;
+  const std::vector<ReportRequest>* requests = nullptr;
+  size_t index = 0;
+  OperationProfiler profiler;
+  for (auto _ : state) {
+    // The shared state is ready once every thread passed the start barrier
+    // of the loop.
+    if (aggregator == nullptr) {
+      aggregator = shared_state->aggregator.get();
+      requests = &shared_state->requests;
+      // Threads start at different signatures so they do not walk the cache
+      // in lock step.
+      index = state.thread_index() * (requests->size() / 8 + 1);
+    }
+    ::benchmark::DoNotOptimize(
+        aggregator->Report((*requests)[index % requests->size()]));
+    ++index;
+  }
+  profiler.Finish(state);
+  state.SetItemsProcessed(state.iterations());
+
+  if (state.thread_index() == 0) {
+    delete shared_state;
+    shared_state = nullptr;
+  }
+}
+
+int MaxThreads() {
+  int cores = static_cast<int>(std::thread::hardware_concurrency());
+  return cores > 1 ? cores : 1;
+}
+
+void ReportArguments(::benchmark::internal::Benchmark* benchmark) {
+  benchmark->ArgNames({"signatures", "metric_sets", "labels", "distribution"});
+  benchmark->ArgsProduct({{100, 10000, 100000}, {1, 8}, {0, 16}, {0, 1}});
+}
+
+BENCHMARK(BM_ReportAggregate)->Apply(ReportArguments);
+BENCHMARK(BM_ReportAggregateThreads)
+    ->ArgNames({"signatures", "metric_sets", "labels", "distribution",
+                "shards"})
+    ->ArgsProduct({{10000}, {1}, {0}, {0}, {1, 16}})
+    ->ThreadRange(1, MaxThreads())
+    ->UseRealTime();
+BENCHMARK(BM_ReportFlushAll)
+    ->Apply(ReportArguments)
+    ->UseManualTime()
+    ->Unit(::benchmark::kMillisecond);
+
+}  // namespace
+}  // namespace service_control_client
+}  // namespace google
+
+BENCHMARK_MAIN();
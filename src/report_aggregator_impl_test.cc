@@ -241,6 +241,37 @@ TEST_F(ReportAggregatorImplTest, TestFlushOutMaxLogEntry) {
   EXPECT_EQ(flushed_[0].operations(0).log_entries_size(), 100);
 }
 
+TEST_F(ReportAggregatorImplTest, TestRingBufferLogEntries) {
+  ReportAggregationOptions options(
+      1 /*entries*/, 1000 /*flush_interval_ms*/, 1 /*shards*/, 0 /*max_bytes*/,
+      LogEntryPolicy::RING_BUFFER, 10 /*max_log_entries*/);
+  aggregator_ =
+      CreateReportAggregator(kServiceName, kServiceConfigId, options,
+                             std::shared_ptr<MetricKindMap>(new MetricKindMap));
+  ASSERT_TRUE((bool)(aggregator_));
+  aggregator_->SetFlushCallback(std::bind(
+      &ReportAggregatorImplTest::FlushCallback, this, std::placeholders::_1));
+
+  // The operation keeps aggregating past max_log_entries.
+  for (int i = 0; i < 200; ++i) {
+    EXPECT_OK(aggregator_->Report(request1_));
+  }
+  EXPECT_EQ(flushed_.size(), 0);
+
+  EXPECT_OK(aggregator_->FlushAll());
+  ASSERT_EQ(flushed_.size(), 1);
+  // The latest 10 log entries, and the summary of the dropped ones.
+  const Operation& operation = flushed_[0].operations(0);
+  ASSERT_EQ(operation.log_entries_size(), 11);
+  EXPECT_EQ(operation.log_entries(10).text_payload(),
+            "190 log entries were dropped by the report aggregation.");
+  EXPECT_EQ(operation.metric_value_sets(0).metric_values(0).int64_value(),
+            200 * request1_.operations(0)
+                      .metric_value_sets(0)
+                      .metric_values(0)
+                      .int64_value());
+}
+
 TEST_F(ReportAggregatorImplTest, TestAddOperation12) {
   EXPECT_OK(aggregator_->Report(request1_));
   // Item cached, not flushed out
@@ -273,6 +304,78 @@ TEST_F(ReportAggregatorImplTest, TestCacheCapacity) {
   EXPECT_TRUE(MessageDifferencer::Equals(flushed_[1], request2_));
 }
 
+TEST_F(ReportAggregatorImplTest, TestMergeEvictionsOfOneReport) {
+  // Three different operations in one request, the cache holds one.
+  ReportRequest request = request1_;
+  request.clear_operations();
+  for (int i = 0; i < 3; ++i) {
+    Operation* operation = request.add_operations();
+    *operation = request1_.operations(0);
+    AddLabel("key1", "value" + std::to_string(i), operation);
+  }
+  EXPECT_OK(aggregator_->Report(request));
+
+  // The two evicted operations are flushed out in one request.
+  ASSERT_EQ(flushed_.size(), 1);
+  EXPECT_EQ(flushed_[0].operations_size(), 2);
+}
+
+TEST_F(ReportAggregatorImplTest, TestCacheMaxBytes) {
+  // Room for request1 only, the number of entries does not limit.
+  OperationAggregator iop(request1_.operations(0), nullptr);
+  ReportAggregationOptions options(100 /*entries*/, 1000 /*flush_interval_ms*/,
+                                   1 /*shards*/, iop.SpaceUsed() * 3 / 2);
+  aggregator_ =
+      CreateReportAggregator(kServiceName, kServiceConfigId, options,
+                             std::shared_ptr<MetricKindMap>(new MetricKindMap));
+  ASSERT_TRUE((bool)(aggregator_));
+  aggregator_->SetFlushCallback(std::bind(
+      &ReportAggregatorImplTest::FlushCallback, this, std::placeholders::_1));
+
+  EXPECT_OK(aggregator_->Report(request1_));
+  EXPECT_EQ(flushed_.size(), 0);
+
+  // request2 does not fit in with request1, which is flushed out.
+  AddLabel("key1", "value1", request2_.mutable_operations(0));
+  EXPECT_OK(aggregator_->Report(request2_));
+  EXPECT_EQ(flushed_.size(), 1);
+  EXPECT_TRUE(MessageDifferencer::Equals(flushed_[0], request1_));
+
+  // Merging log entries makes request2 bigger than the cache, it is flushed
+  // out before reaching the 100 log entries of TestFlushOutMaxLogEntry.
+  for (int i = 0; i < 100 && flushed_.size() < 2; ++i) {
+    EXPECT_OK(aggregator_->Report(request2_));
+  }
+  ASSERT_EQ(flushed_.size(), 2);
+  EXPECT_LT(flushed_[1].operations(0).log_entries_size(), 100);
+}
+
+TEST_F(ReportAggregatorImplTest, TestShardedCache) {
+  ReportAggregationOptions options(4 /*entries*/, 1000 /*flush_interval_ms*/,
+                                   2 /*shards*/);
+  aggregator_ =
+      CreateReportAggregator(kServiceName, kServiceConfigId, options,
+                             std::shared_ptr<MetricKindMap>(new MetricKindMap));
+  ASSERT_TRUE((bool)(aggregator_));
+  aggregator_->SetFlushCallback(std::bind(
+      &ReportAggregatorImplTest::FlushCallback, this, std::placeholders::_1));
+
+  EXPECT_OK(aggregator_->Report(request1_));
+  AddLabel("key1", "value1", request2_.mutable_operations(0));
+  EXPECT_OK(aggregator_->Report(request2_));
+  // Both items are cached, each shard holds up to 2 items.
+  EXPECT_EQ(flushed_.size(), 0);
+
+  // FlushAll flushes the items of all the shards. Items of the same shard
+  // may be merged into one request.
+  EXPECT_OK(aggregator_->FlushAll());
+  int flushed_operations = 0;
+  for (const auto& request : flushed_) {
+    flushed_operations += request.operations_size();
+  }
+  EXPECT_EQ(flushed_operations, 2);
+}
+
 TEST_F(ReportAggregatorImplTest, TestCacheExpiration) {
   EXPECT_OK(aggregator_->Report(request1_));
   // Item cached, nothing flushed out
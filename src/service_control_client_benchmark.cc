@@ -0,0 +1,226 @@
+/* Copyright 2021 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Benchmarks for the CheckAggregatorImpl::Check() hot path.
+//
+// Run with:
+//   bazel run -c opt :service_control_client_benchmark
+//
+// Besides the timings, each benchmark reports allocs/op, bytes/op and
+// wait_ns/op, see test/benchmark_util.h.
+
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "src/check_aggregator_impl.h"
+#include "test/benchmark_util.h"
+
+using ::google::api::servicecontrol::v1::CheckRequest;
+using ::google::api::servicecontrol::v1::CheckResponse;
+using ::google::api::servicecontrol::v1::MetricValue;
+using ::google::api::servicecontrol::v1::MetricValueSet;
+using ::google::api::servicecontrol::v1::Operation;
+using ::google::service_control_client::benchmark_util::OperationProfiler;
+
+namespace google {
+namespace service_control_client {
+namespace {
+
+const char kServiceName[] = "library.googleapis.com";
+const char kServiceConfigId[] = "2016-09-19r0";
+
+// Number of distinct consumers the requests are spread over.
+const int kNumConsumers = 1024;
+
+// A cache hit never needs to refresh within the benchmark run.
+const int kLongFlushIntervalMs = 3600 * 1000;
+
+// Builds a check request similar to the ones sent by ESP: a few operation
+// labels and one quota metric.
+CheckRequest CreateCheckRequest(int consumer) {
+  CheckRequest request;
+  request.set_service_name(kServiceName);
+  request.set_service_config_id(kServiceConfigId);
+
+  Operation* operation = request.mutable_operation();
+  operation->set_operation_id("operation-" + std::to_string(consumer));
+  operation->set_operation_name("google.example.library.v1.GetShelf");
+  operation->set_consumer_id("project:consumer-" + std::to_string(consumer));
+  operation->mutable_start_time()->set_seconds(1000);
+  operation->mutable_start_time()->set_nanos(2000);
+  operation->set_importance(Operation::LOW);
+
+  auto* labels = operation->mutable_labels();
+  (*labels)["servicecontrol.googleapis.com/caller_ip"] = "10.0.0.1";
+  (*labels)["servicecontrol.googleapis.com/service_agent"] = "ESP/1.0";
+  (*labels)["servicecontrol.googleapis.com/user_agent"] = "ESP";
+  (*labels)["servicecontrol.googleapis.com/referer"] =
+      "https://www.example.com/";
+
+  MetricValueSet* metric_value_set = operation->add_metric_value_sets();
+  metric_value_set->set_metric_name(
+      "serviceruntime.googleapis.com/api/consumer/quota_used_count");
+  MetricValue* metric_value = metric_value_set->add_metric_values();
+  (*metric_value->mutable_labels())["/quota_group_name"] = "ReadGroup";
+  metric_value->set_int64_value(1);
+  return request;
+}
+
+std::vector<CheckRequest> CreateCheckRequests(int first_consumer) {
+  std::vector<CheckRequest> requests;
+  requests.reserve(kNumConsumers);
+  for (int i = 0; i < kNumConsumers; ++i) {
+    requests.push_back(CreateCheckRequest(first_consumer + i));
+  }
+  return requests;
+}
+
+CheckResponse CreateCheckResponse() {
+  CheckResponse response;
+  response.set_operation_id("operation-1");
+  response.set_service_config_id(kServiceConfigId);
+  return response;
+}
+
+// State shared by all the threads of one benchmark run. It is created by
+// thread 0 before the timing loop and destroyed by thread 0 after it.
+// Google Benchmark synchronizes the threads at the start and at the end of
+// the timing loop, so the other threads may only use it inside the loop.
+struct SharedState {
+  std::unique_ptr<CheckAggregator> aggregator;
+  std::vector<CheckRequest> requests;
+  CheckResponse response;
+};
+SharedState* shared_state = nullptr;
+
+void SetUpSharedState(int flush_interval_ms, bool use_cached_consumers,
+                      int num_shards) {
+  shared_state = new SharedState;
+  CheckAggregationOptions options(kNumConsumers * 2, flush_interval_ms,
+                                  kLongFlushIntervalMs, num_shards);
+  shared_state->aggregator = CreateCheckAggregator(
+      kServiceName, kServiceConfigId, options,
+      std::shared_ptr<MetricKindMap>(new MetricKindMap));
+  // Flushed requests are dropped.
+  shared_state->aggregator->SetFlushCallback(
+      [](const CheckRequest& request) {});
+
+  // Cached entries use consumers [0, kNumConsumers), misses use consumers
+  // that are never cached.
+  shared_state->requests =
+      CreateCheckRequests(use_cached_consumers ? 0 : kNumConsumers);
+  shared_state->response = CreateCheckResponse();
+  for (int i = 0; i < kNumConsumers; ++i) {
+    (void)shared_state->aggregator->CacheResponse(CreateCheckRequest(i),
+                                                  shared_state->response);
+  }
+}
+
+void TearDownSharedState() {
+  delete shared_state;
+  shared_state = nullptr;
+}
+
+// If refresh_on_miss is true, a NOT_FOUND status is followed by
+// CacheResponse() as ServiceControlClientImpl does once the check request
+// to the server completes.
+void RunCheckLoop(::benchmark::State& state, bool refresh_on_miss) {
+  CheckAggregator* aggregator = nullptr;
+  const std::vector<CheckRequest>* requests = nullptr;
+  // Threads start at different consumers so they do not walk the cache in
+  // lock step.
+  size_t index = state.thread_index() * (kNumConsumers / 8);
+  CheckResponse response;
+
+  OperationProfiler profiler;
+  for (auto _ : state) {
+    // The shared state is ready once every thread passed the start barrier
+    // of the loop.
+    if (aggregator == nullptr) {
+      aggregator = shared_state->aggregator.get();
+      requests = &shared_state->requests;
+    }
+    const CheckRequest& request = (*requests)[index % requests->size()];
+    Signature signature;
+    ::google::protobuf::util::Status status =
+        aggregator->Check(request, &response, &signature);
+    if (refresh_on_miss && !status.ok()) {
+      status = aggregator->CacheResponse(signature, shared_state->response);
+    }
+    ::benchmark::DoNotOptimize(status);
+    ++index;
+  }
+  profiler.Finish(state);
+  state.SetItemsProcessed(state.iterations());
+}
+
+// Every Check() finds a positive cached response and aggregates the request
+// into it.
+void BM_CheckCacheHit(::benchmark::State& state) {
+  if (state.thread_index() == 0) {
+    SetUpSharedState(kLongFlushIntervalMs, true, state.range(0));
+  }
+  RunCheckLoop(state, false);
+  if (state.thread_index() == 0) {
+    TearDownSharedState();
+  }
+}
+
+// Every Check() misses the cache and returns NOT_FOUND.
+void BM_CheckCacheMiss(::benchmark::State& state) {
+  if (state.thread_index() == 0) {
+    SetUpSharedState(kLongFlushIntervalMs, false, state.range(0));
+  }
+  RunCheckLoop(state, false);
+  if (state.thread_index() == 0) {
+    TearDownSharedState();
+  }
+}
+
+// Every Check() finds a cached response whose flush interval has passed, so
+// it aggregates the request and returns NOT_FOUND to refresh the entry. The
+// refreshed response is then cached again.
+void BM_CheckCacheHitWithFlush(::benchmark::State& state) {
+  if (state.thread_index() == 0) {
+    SetUpSharedState(0, true, state.range(0));
+  }
+  RunCheckLoop(state, true);
+  if (state.thread_index() == 0) {
+    TearDownSharedState();
+  }
+}
+
+int MaxThreads() {
+  int cores = static_cast<int>(std::thread::hardware_concurrency());
+  return cores > 1 ? cores : 1;
+}
+
+// Runs with a single cache lock and with a sharded cache.
+void CacheShards(::benchmark::internal::Benchmark* benchmark) {
+  benchmark->ArgName("shards")->Arg(1)->Arg(16);
+  benchmark->ThreadRange(1, MaxThreads())->UseRealTime();
+}
+
+BENCHMARK(BM_CheckCacheHit)->Apply(CacheShards);
+BENCHMARK(BM_CheckCacheMiss)->Apply(CacheShards);
+BENCHMARK(BM_CheckCacheHitWithFlush)->Apply(CacheShards);
+
+}  // namespace
+}  // namespace service_control_client
+}  // namespace google
+
+BENCHMARK_MAIN();
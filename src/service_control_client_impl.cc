@@ -27,6 +27,7 @@ using ::google::api::servicecontrol::v1::CheckResponse;
 using ::google::api::servicecontrol::v1::AllocateQuotaRequest;
 using ::google::api::servicecontrol::v1::AllocateQuotaResponse;
 using ::google::api::servicecontrol::v1::ReportRequest;
+using ::google::api::servicecontrol::v1::Operation;
 using ::google::api::servicecontrol::v1::ReportResponse;
 using ::google::protobuf::util::OkStatus;
 using ::google::protobuf::util::Status;
@@ -38,7 +39,9 @@ namespace service_control_client {
 ServiceControlClientImpl::ServiceControlClientImpl(
     const string& service_name, const std::string& service_config_id,
     ServiceControlClientOptions& options)
-    : service_name_(service_name) {
+    : service_name_(service_name),
+      check_cache_enabled_(options.check_options.num_entries > 0),
+      pending_checks_(new PendingChecks) {
   check_aggregator_ =
       CreateCheckAggregator(service_name, service_config_id,
                             options.check_options, options.metric_kinds);
@@ -57,6 +60,7 @@ ServiceControlClientImpl::ServiceControlClientImpl(
   total_called_checks_ = 0;
   send_checks_by_flush_ = 0;
   send_checks_in_flight_ = 0;
+  coalesced_checks_ = 0;
 
   total_called_quotas_ = 0;
   send_quotas_by_flush_ = 0;
@@ -71,6 +75,10 @@ ServiceControlClientImpl::ServiceControlClientImpl(
       std::bind(&ServiceControlClientImpl::CheckFlushCallback, this,
                 std::placeholders::_1));
 
+  check_aggregator_->SetRefreshCallback(
+      std::bind(&ServiceControlClientImpl::CheckRefreshCallback, this,
+                std::placeholders::_1, std::placeholders::_2));
+
   quota_aggregator_->SetFlushCallback(
       std::bind(&ServiceControlClientImpl::AllocateQuotaFlushCallback, this,
                 std::placeholders::_1));
@@ -128,6 +136,7 @@ ServiceControlClientImpl::~ServiceControlClientImpl() {
   // may call the flush callback. But since flush callback is disconnected,
   // we are OK.
   check_aggregator_->SetFlushCallback(NULL);
+  check_aggregator_->SetRefreshCallback(NULL);
   quota_aggregator_->SetFlushCallback(NULL);
   report_aggregator_->SetFlushCallback(NULL);
 }
@@ -173,6 +182,25 @@ void ServiceControlClientImpl::CheckFlushCallback(
   ++send_checks_by_flush_;
 }
 
+void ServiceControlClientImpl::CheckRefreshCallback(
+    const Signature& signature, const CheckRequest& check_request) {
+  CheckResponse* check_response = new CheckResponse;
+  std::shared_ptr<CheckAggregator> check_aggregator_copy = check_aggregator_;
+  check_transport_(check_request, check_response,
+                   [check_aggregator_copy, signature,
+                    check_response](Status status) {
+                     if (status.ok()) {
+                       (void)check_aggregator_copy->CacheResponse(
+                           signature, *check_response);
+                     } else {
+                       GOOGLE_LOG(ERROR) << "Failed in Check call: "
+                                         << status.message();
+                     }
+                     delete check_response;
+                   });
+  ++send_checks_by_flush_;
+}
+
 void ServiceControlClientImpl::ReportFlushCallback(
     const ReportRequest& report_request) {
   ReportResponse* report_response = new ReportResponse;
@@ -198,23 +226,48 @@ void ServiceControlClientImpl::Check(const CheckRequest& check_request,
     return;
   }
 
-  Status status = check_aggregator_->Check(check_request, check_response);
+  Signature signature;
+  Status status =
+      check_aggregator_->Check(check_request, check_response, &signature);
   if (status.code() == StatusCode::kNotFound) {
-    // Makes a copy of check_request so that on_done() callback can use
-    // it to call CacheResponse.
+    // The identical checks missing the cache until the response arrives wait
+    // for this call, they are completed from its response.
+    std::shared_ptr<PendingChecks> pending_checks;
+    if (check_cache_enabled_ &&
+        check_request.operation().importance() == Operation::LOW) {
+      MutexLock lock(pending_checks_->mutex);
+      auto it = pending_checks_->waiters.find(signature);
+      if (it != pending_checks_->waiters.end()) {
+        it->second.push_back(
+            PendingCheck{check_request, check_response, on_check_done});
+        ++coalesced_checks_;
+        return;
+      }
+      pending_checks_->waiters[signature];
+      pending_checks = pending_checks_;
+    }
+
+    // Makes a copy of check_request so that it outlives the transport call.
+    // The signature is kept to call CacheResponse without hashing the
+    // request again.
     CheckRequest* check_request_copy = new CheckRequest(check_request);
     std::shared_ptr<CheckAggregator> check_aggregator_copy = check_aggregator_;
     check_transport(*check_request_copy, check_response,
-                    [check_aggregator_copy, check_request_copy, check_response,
-                     on_check_done](Status status) {
+                    [check_aggregator_copy, pending_checks, check_request_copy,
+                     signature, check_response, on_check_done](Status status) {
                       if (status.ok()) {
                         (void)check_aggregator_copy->CacheResponse(
-                            *check_request_copy, *check_response);
+                            signature, *check_response);
                       } else {
                         GOOGLE_LOG(ERROR) << "Failed in Check call: "
                                           << status.message();
                       }
                       delete check_request_copy;
+                      if (pending_checks) {
+                        pending_checks->Complete(signature, status,
+                                                 *check_response,
+                                                 check_aggregator_copy.get());
+                      }
                       on_check_done(status);
                     });
     ++send_checks_in_flight_;
@@ -223,6 +276,28 @@ void ServiceControlClientImpl::Check(const CheckRequest& check_request,
   on_check_done(status);
 }
 
+void ServiceControlClientImpl::PendingChecks::Complete(
+    const Signature& signature, Status status, const CheckResponse& response,
+    CheckAggregator* check_aggregator) {
+  std::vector<PendingCheck> pending;
+  {
+    MutexLock lock(mutex);
+    auto it = waiters.find(signature);
+    if (it == waiters.end()) return;
+    pending.swap(it->second);
+    waiters.erase(it);
+  }
+
+  for (PendingCheck& check : pending) {
+    if (status.ok()) {
+      *check.response = response;
+      // Not aggregated if the response is negative or no longer cached.
+      (void)check_aggregator->AggregateRequest(signature, check.request);
+    }
+    check.on_done(status);
+  }
+}
+
 void ServiceControlClientImpl::Check(const CheckRequest& check_request,
                                      CheckResponse* check_response,
                                      DoneCallback on_check_done) {
@@ -377,6 +452,7 @@ Status ServiceControlClientImpl::GetStatistics(Statistics* stat) const {
   stat->total_called_checks = total_called_checks_;
   stat->send_checks_by_flush = send_checks_by_flush_;
   stat->send_checks_in_flight = send_checks_in_flight_;
+  stat->coalesced_checks = coalesced_checks_;
 
   stat->total_called_quotas = total_called_quotas_;
   stat->send_quotas_by_flush = send_quotas_by_flush_;
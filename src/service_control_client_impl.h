@@ -18,9 +18,13 @@ limitations under the License.
 
 #include "include/service_control_client.h"
 #include "src/quota_aggregator_impl.h"
+#include "src/signature.h"
 #include "utils/google_macros.h"
+#include "utils/thread.h"
 
 #include <atomic>
+#include <unordered_map>
+#include <vector>
 
 namespace google {
 namespace service_control_client {
@@ -101,6 +105,11 @@ class ServiceControlClientImpl : public ServiceControlClient {
   void CheckFlushCallback(
       const ::google::api::servicecontrol::v1::CheckRequest& check_request);
 
+  // A refresh callback for check.
+  void CheckRefreshCallback(
+      const Signature& signature,
+      const ::google::api::servicecontrol::v1::CheckRequest& check_request);
+
   // A flush callback for check.
   void AllocateQuotaFlushCallback(
       const ::google::api::servicecontrol::v1::AllocateQuotaRequest&
@@ -110,6 +119,30 @@ class ServiceControlClientImpl : public ServiceControlClient {
   void ReportFlushCallback(
       const ::google::api::servicecontrol::v1::ReportRequest& report_request);
 
+  // A Check() call waiting for the server call of an identical check.
+  struct PendingCheck {
+    ::google::api::servicecontrol::v1::CheckRequest request;
+    ::google::api::servicecontrol::v1::CheckResponse* response;
+    DoneCallback on_done;
+  };
+
+  // The Check() calls waiting for a server call, by signature of the check
+  // sent. Only the checks the cache serves are coalesced: when one of them
+  // misses the cache, the identical ones arriving before its response wait
+  // for it instead of calling the server too.
+  struct PendingChecks {
+    // Completes the checks waiting for the server call of the given
+    // signature with its response. Their requests are aggregated into the
+    // cached response, without the refresh a Check() call could start.
+    void Complete(
+        const Signature& signature, ::google::protobuf::util::Status status,
+        const ::google::api::servicecontrol::v1::CheckResponse& response,
+        CheckAggregator* check_aggregator);
+
+    Mutex mutex;
+    std::unordered_map<Signature, std::vector<PendingCheck>> waiters;
+  };
+
   // Gets next flush interval
   int GetNextFlushInterval();
 
@@ -139,6 +172,7 @@ class ServiceControlClientImpl : public ServiceControlClient {
   std::atomic_int_fast64_t total_called_checks_;
   std::atomic_int_fast64_t send_checks_by_flush_;
   std::atomic_int_fast64_t send_checks_in_flight_;
+  std::atomic_int_fast64_t coalesced_checks_;
 
   std::atomic_int_fast64_t total_called_reports_;
   std::atomic_int_fast64_t send_reports_by_flush_;
@@ -151,6 +185,11 @@ class ServiceControlClientImpl : public ServiceControlClient {
   // of check_aggregator_ to make sure it is not freed.
   std::shared_ptr<CheckAggregator> check_aggregator_;
 
+  // Whether the check cache is enabled, checks are only coalesced if so.
+  bool check_cache_enabled_;
+  // Shared with the transport callbacks, which may outlive this object.
+  std::shared_ptr<PendingChecks> pending_checks_;
+
   std::shared_ptr<QuotaAggregator> quota_aggregator_;
 
   // The report aggregator object. report_aggregator_ has to be shared_ptr since
@@ -803,6 +803,78 @@ TEST_F(ServiceControlClientImplTest,
   }
 }
 
+TEST_F(ServiceControlClientImplTest, TestCoalescedCheckWithStoredCallback) {
+  // Calls Client::Check three times with the same request before the response
+  // of the first one arrives. Only the first one calls Transport::Check(),
+  // the other ones are completed from its response.
+  EXPECT_CALL(mock_check_transport_, Check(_, _, _))
+      .WillOnce(Invoke(&mock_check_transport_,
+                       &MockCheckTransport::CheckWithStoredCallback));
+  mock_check_transport_.check_response_ = &pass_check_response1_;
+
+  const int kChecks = 3;
+  CheckResponse check_responses[kChecks];
+  Status done_statuses[kChecks];
+  for (int i = 0; i < kChecks; i++) {
+    done_statuses[i] = UnknownError("");
+    client_->Check(check_request1_, &check_responses[i],
+                   [&done_statuses, i](Status status) {
+                     done_statuses[i] = status;
+                   });
+  }
+  EXPECT_EQ(mock_check_transport_.on_done_vector_.size(), 1);
+  for (int i = 0; i < kChecks; i++) {
+    EXPECT_EQ(done_statuses[i], UnknownError(""));
+  }
+
+  mock_check_transport_.on_done_vector_[0](OkStatus());
+  for (int i = 0; i < kChecks; i++) {
+    EXPECT_EQ(done_statuses[i], OkStatus());
+    EXPECT_TRUE(
+        MessageDifferencer::Equals(check_responses[i], pass_check_response1_));
+  }
+  EXPECT_TRUE(Mock::VerifyAndClearExpectations(&mock_check_transport_));
+
+  Statistics stat;
+  EXPECT_OK(client_->GetStatistics(&stat));
+  EXPECT_EQ(stat.total_called_checks, kChecks);
+  EXPECT_EQ(stat.send_checks_in_flight, 1);
+  EXPECT_EQ(stat.coalesced_checks, kChecks - 1);
+
+  // The coalesced checks are aggregated in the cache. When client is
+  // destroyed, it will call Transport Check.
+  EXPECT_CALL(mock_check_transport_, Check(_, _, _))
+      .WillOnce(Invoke(&mock_check_transport_,
+                       &MockCheckTransport::CheckUsingThread));
+}
+
+TEST_F(ServiceControlClientImplTest, TestFailedCoalescedCheckWithStoredCallback) {
+  // The waiting checks fail with the status of the server call, and the
+  // next check calls the server again.
+  EXPECT_CALL(mock_check_transport_, Check(_, _, _))
+      .WillOnce(Invoke(&mock_check_transport_,
+                       &MockCheckTransport::CheckWithStoredCallback));
+
+  CheckResponse check_response1;
+  CheckResponse check_response2;
+  Status done_status1 = UnknownError("");
+  Status done_status2 = UnknownError("");
+  client_->Check(check_request1_, &check_response1,
+                 [&done_status1](Status status) { done_status1 = status; });
+  client_->Check(check_request1_, &check_response2,
+                 [&done_status2](Status status) { done_status2 = status; });
+  EXPECT_EQ(mock_check_transport_.on_done_vector_.size(), 1);
+
+  mock_check_transport_.on_done_vector_[0](
+      Status(StatusCode::kUnavailable, ""));
+  EXPECT_EQ(done_status1, Status(StatusCode::kUnavailable, ""));
+  EXPECT_EQ(done_status2, Status(StatusCode::kUnavailable, ""));
+  EXPECT_TRUE(Mock::VerifyAndClearExpectations(&mock_check_transport_));
+
+  InternalTestNonCachedCheckWithStoredCallback(check_request1_, OkStatus(),
+                                               &pass_check_response1_);
+}
+
 TEST_F(ServiceControlClientImplTest,
        TestNonCachedCheckWithStoredCallbackWithPerRequestTransport) {
   MockCheckTransport stack_mock_check_transport;
@@ -14,14 +14,18 @@ limitations under the License.
 ==============================================================================*/
 
 #include "src/signature.h"
-#include "utils/md5.h"
+#include "utils/hash128.h"
 
-#include <set>
-#include <map>
+#include "google/protobuf/io/coded_stream.h"
+#include "google/protobuf/io/zero_copy_stream_impl_lite.h"
+
+#include <stdio.h>
 
 using std::string;
 using google::api::servicecontrol::v1::CheckRequest;
+using google::api::servicecontrol::v1::LogEntry;
 using google::api::servicecontrol::v1::MetricValue;
+using google::api::servicecontrol::v1::MetricValueSet;
 using google::api::servicecontrol::v1::Operation;
 using google::api::servicecontrol::v1::AllocateQuotaRequest;
 using google::api::servicecontrol::v1::QuotaOperation;
@@ -32,47 +36,100 @@ namespace {
 const char kDelimiter[] = "\0";
 const int kDelimiterLength = 1;
 
+// An order independent combination of 128 bit hashes. Unordered collections
+// such as label maps are hashed by adding up the hashes of their items, so
+// no sorted copy of the collection is needed.
+class UnorderedHash {
+ public:
+  UnorderedHash() : low_(0), high_(0), count_(0) {}
+
+  // Adds the digest of the given hasher.
+  void Add(Hash128* item_hasher) {
+    uint64_t low, high;
+    item_hasher->Finalize(&low, &high);
+    low_ += low;
+    high_ += high;
+    ++count_;
+  }
+
+  // Updates the given hasher with the combined hash.
+  void UpdateHash(Hash128* hasher) const {
+    hasher->Update(count_);
+    hasher->Update(low_);
+    hasher->Update(high_);
+  }
+
+ private:
+  uint64_t low_;
+  uint64_t high_;
+  uint64_t count_;
+};
+
+// Returns the digest of the hasher as a signature, with the same byte order
+// as Hash128::Digest().
+Signature ToSignature(Hash128* hasher) {
+  uint64_t halves[2];
+  hasher->Finalize(&halves[0], &halves[1]);
+  Signature signature;
+  for (int i = 0; i < Signature::kLength; ++i) {
+    signature.bytes[i] = static_cast<uint8_t>(halves[i / 8] >> (8 * (i % 8)));
+  }
+  return signature;
+}
+
 // Updates the give hasher with the given labels.
 void UpdateHashLabels(const ::google::protobuf::Map<string, string>& labels,
-                      MD5* hasher) {
-  std::map<string, string> ordered_labels(labels.begin(), labels.end());
-  for (const auto& label : ordered_labels) {
+                      Hash128* hasher) {
+  UnorderedHash combined;
+  for (const auto& label : labels) {
     // Note we must use the Update(void const *data, int size) function here
-    // for the delimiter instead of Update(StringPiece data), because
-    // StringPiece would use strlen and gets zero length.
-    hasher->Update(kDelimiter, kDelimiterLength);
-    hasher->Update(label.first);
-    hasher->Update(kDelimiter, kDelimiterLength);
-    hasher->Update(label.second);
+    // for the delimiter instead of Update(const char*), because it would use
+    // strlen and gets zero length.
+    Hash128 label_hasher;
+    label_hasher.Update(label.first);
+    label_hasher.Update(kDelimiter, kDelimiterLength);
+    label_hasher.Update(label.second);
+    combined.Add(&label_hasher);
   }
+  combined.UpdateHash(hasher);
 }
 
 // Updates the give hasher with the given metric value.
-void UpdateHashMetricValue(const MetricValue& metric_value, MD5* hasher) {
+void UpdateHashMetricValue(const MetricValue& metric_value, Hash128* hasher) {
   UpdateHashLabels(metric_value.labels(), hasher);
 }
 }  // namespace
 
-string GenerateReportOperationSignature(const Operation& operation) {
-  MD5 hasher;
+std::string Signature::DebugString() const {
+  char buf[kLength * 2 + 1];
+  char* p = buf;
+  for (int i = 0; i < kLength; i++, p += 2) {
+    sprintf(p, "%02x", bytes[i]);
+  }
+  *p = 0;
+  return std::string(buf, kLength * 2);
+}
+
+Signature GenerateReportOperationSignature(const Operation& operation) {
+  Hash128 hasher;
   hasher.Update(operation.consumer_id());
   hasher.Update(kDelimiter, kDelimiterLength);
   hasher.Update(operation.operation_name());
 
   UpdateHashLabels(operation.labels(), &hasher);
 
-  return hasher.Digest();
+  return ToSignature(&hasher);
 }
 
-string GenerateReportMetricValueSignature(const MetricValue& metric_value) {
-  MD5 hasher;
+Signature GenerateReportMetricValueSignature(const MetricValue& metric_value) {
+  Hash128 hasher;
 
   UpdateHashMetricValue(metric_value, &hasher);
-  return hasher.Digest();
+  return ToSignature(&hasher);
 }
 
-string GenerateCheckRequestSignature(const CheckRequest& request) {
-  MD5 hasher;
+Signature GenerateCheckRequestSignature(const CheckRequest& request) {
+  Hash128 hasher;
 
   const Operation& operation = request.operation();
   hasher.Update(operation.operation_name());
@@ -83,49 +140,78 @@ string GenerateCheckRequestSignature(const CheckRequest& request) {
   hasher.Update(kDelimiter, kDelimiterLength);
   UpdateHashLabels(operation.labels(), &hasher);
 
-  // keep sorted order of metric_name
-  std::map<std::string, const ::google::protobuf::RepeatedPtrField<
-                            ::google::api::servicecontrol::v1::MetricValue>*>
-      metric_value_set_map;
-  for (const auto& metric_value_set : operation.metric_value_sets()) {
-    metric_value_set_map[metric_value_set.metric_name()] =
-        &metric_value_set.metric_values();
+  // The order of metric value sets does not matter, the order of the metric
+  // values within a set does.
+  UnorderedHash metric_value_sets;
+  for (const MetricValueSet& metric_value_set :
+       operation.metric_value_sets()) {
+    Hash128 set_hasher;
+    set_hasher.Update(metric_value_set.metric_name());
+    for (const auto& metric_value : metric_value_set.metric_values()) {
+      UpdateHashMetricValue(metric_value, &set_hasher);
+    }
+    metric_value_sets.Add(&set_hasher);
   }
+  metric_value_sets.UpdateHash(&hasher);
 
-  for(const auto& metric_value_set: metric_value_set_map) {
-    hasher.Update(kDelimiter, kDelimiterLength);
-    hasher.Update(metric_value_set.first);
+  return ToSignature(&hasher);
+}
 
-    for(const auto& metric_value: *metric_value_set.second) {
-      UpdateHashMetricValue(metric_value, &hasher);
+Signature GenerateLogEntrySignature(const LogEntry& log_entry) {
+  Hash128 hasher;
+  hasher.Update(log_entry.name());
+  hasher.Update(kDelimiter, kDelimiterLength);
+  hasher.Update(static_cast<uint64_t>(log_entry.severity()));
+
+  UpdateHashLabels(log_entry.labels(), &hasher);
+
+  hasher.Update(static_cast<uint64_t>(log_entry.payload_case()));
+  switch (log_entry.payload_case()) {
+    case LogEntry::kTextPayload:
+      hasher.Update(log_entry.text_payload());
+      break;
+    case LogEntry::kProtoPayload:
+      hasher.Update(log_entry.proto_payload().type_url());
+      hasher.Update(kDelimiter, kDelimiterLength);
+      hasher.Update(log_entry.proto_payload().value());
+      break;
+    case LogEntry::kStructPayload: {
+      // Map fields are serialized in a fixed order, so that equal payloads
+      // have equal bytes.
+      string bytes;
+      {
+        ::google::protobuf::io::StringOutputStream stream(&bytes);
+        ::google::protobuf::io::CodedOutputStream output(&stream);
+        output.SetSerializationDeterministic(true);
+        log_entry.struct_payload().SerializePartialToCodedStream(&output);
+      }
+      hasher.Update(bytes);
+      break;
     }
+    default:
+      break;
   }
-
-  hasher.Update(kDelimiter, kDelimiterLength);
-
-  return hasher.Digest();
+  return ToSignature(&hasher);
 }
 
-string GenerateAllocateQuotaRequestSignature(
+Signature GenerateAllocateQuotaRequestSignature(
     const AllocateQuotaRequest& request) {
-  MD5 hasher;
+  Hash128 hasher;
   const QuotaOperation& operation = request.allocate_operation();
   hasher.Update(operation.method_name());
 
   hasher.Update(kDelimiter, kDelimiterLength);
   hasher.Update(operation.consumer_id());
 
-  // order of metric_name can be changed. need to be sorted.
-  std::set<std::string> metric_names;
+  // order of metric_name can be changed.
+  UnorderedHash metric_names;
   for (const auto& metric_value_set : operation.quota_metrics()) {
-    metric_names.insert(metric_value_set.metric_name());
-  }
-
-  for (const auto& metric_name : metric_names) {
-    hasher.Update(kDelimiter, kDelimiterLength);
-    hasher.Update(metric_name);
+    Hash128 name_hasher;
+    name_hasher.Update(metric_value_set.metric_name());
+    metric_names.Add(&name_hasher);
   }
-  return hasher.Digest();
+  metric_names.UpdateHash(&hasher);
+  return ToSignature(&hasher);
 }
 
 }  // namespace service_control_client
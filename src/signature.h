@@ -19,6 +19,10 @@ limitations under the License.
 #ifndef GOOGLE_SERVICE_CONTROL_CLIENT_SIGNATURE_H_
 #define GOOGLE_SERVICE_CONTROL_CLIENT_SIGNATURE_H_
 
+#include <stdint.h>
+#include <string.h>
+#include <array>
+#include <functional>
 #include <string>
 #include "google/api/servicecontrol/v1/metric_value.pb.h"
 #include "google/api/servicecontrol/v1/operation.pb.h"
@@ -28,12 +32,46 @@ limitations under the License.
 namespace google {
 namespace service_control_client {
 
+// A 128 bit signature, the key of the aggregation caches. It is a fixed size
+// value, so it needs no allocation to be stored, hashed or compared.
+struct Signature {
+  static const int kLength = 16;
+
+  // Returns the hash of the signature for hash tables. The signature is
+  // already a uniformly distributed hash, its first 8 bytes are used as is.
+  size_t hash() const {
+    uint64_t h;
+    memcpy(&h, bytes.data(), sizeof(h));
+    return static_cast<size_t>(h);
+  }
+
+  // Returns another hash of the signature, independent of hash(). It is used
+  // to pick the shard of a sharded cache, so that the keys of one shard are
+  // still spread over all the buckets of its hash table.
+  uint64_t shard_hash() const {
+    uint64_t h;
+    memcpy(&h, bytes.data() + 8, sizeof(h));
+    return h;
+  }
+
+  bool operator==(const Signature& other) const {
+    return bytes == other.bytes;
+  }
+  bool operator!=(const Signature& other) const { return !(*this == other); }
+
+  // Converts the signature to a printable string.
+  // It is for debugging and unit-test only.
+  std::string DebugString() const;
+
+  std::array<uint8_t, kLength> bytes;
+};
+
 // Generates signature for an operation based on operation name and operation
 // labels. Should be used only for report requests.
 //
 // Operations having the same signature can be aggregated or batched. Assuming
 // all operations belong to the same service.
-std::string GenerateReportOperationSignature(
+Signature GenerateReportOperationSignature(
     const ::google::api::servicecontrol::v1::Operation& operation);
 
 // Generates signature for a metric value based on metric value labels, and
@@ -41,7 +79,7 @@ std::string GenerateReportOperationSignature(
 //
 // metric value with the same metric name and metric value signature can be
 // merged.
-std::string GenerateReportMetricValueSignature(
+Signature GenerateReportMetricValueSignature(
     const ::google::api::servicecontrol::v1::MetricValue& metric_value);
 
 // Generates signature for a check request. Operation name, consumer id,
@@ -51,13 +89,29 @@ std::string GenerateReportMetricValueSignature(
 //
 // Check request having the same signature can be aggregated. Assuming all
 // requests belong to the same service.
-std::string GenerateCheckRequestSignature(
+Signature GenerateCheckRequestSignature(
     const ::google::api::servicecontrol::v1::CheckRequest& request);
 
-std::string GenerateAllocateQuotaRequestSignature(
+// Generates signature for a log entry based on its name, severity, labels and
+// payload. Log entries differing only by timestamp and insert id have the same
+// signature. Should be used only for report requests.
+Signature GenerateLogEntrySignature(
+    const ::google::api::servicecontrol::v1::LogEntry& log_entry);
+
+Signature GenerateAllocateQuotaRequestSignature(
     const ::google::api::servicecontrol::v1::AllocateQuotaRequest& request);
 
 }  // namespace service_control_client
 }  // namespace google
 
+namespace std {
+template <>
+struct hash<::google::service_control_client::Signature> {
+  size_t operator()(
+      const ::google::service_control_client::Signature& signature) const {
+    return signature.hash();
+  }
+};
+}  // namespace std
+
 #endif  // GOOGLE_SERVICE_CONTROL_CLIENT_SIGNATURE_H_
@@ -0,0 +1,151 @@
+/* Copyright 2021 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Benchmarks for the signature functions, which run on every request.
+//
+// Run with:
+//   bazel run -c opt :signature_benchmark
+//
+// Each benchmark reports allocs/op and bytes/op, see test/benchmark_util.h.
+
+#include <string>
+
+#include "benchmark/benchmark.h"
+#include "src/signature.h"
+#include "test/benchmark_util.h"
+
+using ::google::api::servicecontrol::v1::AllocateQuotaRequest;
+using ::google::api::servicecontrol::v1::CheckRequest;
+using ::google::api::servicecontrol::v1::MetricValue;
+using ::google::api::servicecontrol::v1::MetricValueSet;
+using ::google::api::servicecontrol::v1::Operation;
+using ::google::api::servicecontrol::v1::QuotaOperation;
+using ::google::service_control_client::benchmark_util::OperationProfiler;
+
+namespace google {
+namespace service_control_client {
+namespace {
+
+void AddLabels(int num_labels,
+               ::google::protobuf::Map<std::string, std::string>* labels) {
+  for (int i = 0; i < num_labels; ++i) {
+    (*labels)["servicecontrol.googleapis.com/label_" + std::to_string(i)] =
+        "value-" + std::to_string(i);
+  }
+}
+
+// Builds an operation with num_labels operation labels and num_metric_sets
+// metric value sets, each with one value carrying two labels.
+Operation CreateOperation(int num_labels, int num_metric_sets) {
+  Operation operation;
+  operation.set_operation_id("operation-1");
+  operation.set_operation_name("google.example.library.v1.GetShelf");
+  operation.set_consumer_id("project:consumer-1");
+  AddLabels(num_labels, operation.mutable_labels());
+  // Metric sets are added in reverse name order, the signature sorts them.
+  for (int i = num_metric_sets - 1; i >= 0; --i) {
+    MetricValueSet* metric_value_set = operation.add_metric_value_sets();
+    metric_value_set->set_metric_name("library.googleapis.com/metric_" +
+                                      std::to_string(i));
+    MetricValue* metric_value = metric_value_set->add_metric_values();
+    AddLabels(2, metric_value->mutable_labels());
+    metric_value->set_int64_value(1);
+  }
+  return operation;
+}
+
+void BM_GenerateCheckRequestSignature(::benchmark::State& state) {
+  CheckRequest request;
+  *request.mutable_operation() =
+      CreateOperation(state.range(0), state.range(1));
+
+  OperationProfiler profiler;
+  for (auto _ : state) {
+    ::benchmark::DoNotOptimize(GenerateCheckRequestSignature(request));
+  }
+  profiler.Finish(state);
+}
+
+void BM_GenerateReportOperationSignature(::benchmark::State& state) {
+  Operation operation = CreateOperation(state.range(0), state.range(1));
+
+  OperationProfiler profiler;
+  for (auto _ : state) {
+    ::benchmark::DoNotOptimize(GenerateReportOperationSignature(operation));
+  }
+  profiler.Finish(state);
+}
+
+void BM_GenerateReportMetricValueSignature(::benchmark::State& state) {
+  MetricValue metric_value;
+  AddLabels(state.range(0), metric_value.mutable_labels());
+  metric_value.set_int64_value(1);
+
+  OperationProfiler profiler;
+  for (auto _ : state) {
+    ::benchmark::DoNotOptimize(
+        GenerateReportMetricValueSignature(metric_value));
+  }
+  profiler.Finish(state);
+}
+
+void BM_GenerateAllocateQuotaRequestSignature(::benchmark::State& state) {
+  AllocateQuotaRequest request;
+  QuotaOperation* operation = request.mutable_allocate_operation();
+  operation->set_operation_id("operation-1");
+  operation->set_method_name("google.example.library.v1.GetShelf");
+  operation->set_consumer_id("project:consumer-1");
+  AddLabels(state.range(0), operation->mutable_labels());
+  for (int i = state.range(1) - 1; i >= 0; --i) {
+    MetricValueSet* metric_value_set = operation->add_quota_metrics();
+    metric_value_set->set_metric_name("library.googleapis.com/metric_" +
+                                      std::to_string(i));
+    metric_value_set->add_metric_values()->set_int64_value(1);
+  }
+
+  OperationProfiler profiler;
+  for (auto _ : state) {
+    ::benchmark::DoNotOptimize(GenerateAllocateQuotaRequestSignature(request));
+  }
+  profiler.Finish(state);
+}
+
+void LabelsAndMetricSets(::benchmark::internal::Benchmark* benchmark) {
+  benchmark->ArgNames({"labels", "metric_sets"});
+  benchmark->ArgsProduct({{0, 1, 4, 16, 64}, {0, 1, 4, 16}});
+}
+
+BENCHMARK(BM_GenerateCheckRequestSignature)->Apply(LabelsAndMetricSets);
+// The report operation signature does not depend on the metric value sets.
+BENCHMARK(BM_GenerateReportOperationSignature)
+    ->ArgNames({"labels", "metric_sets"})
+    ->ArgsProduct({{0, 1, 4, 16, 64}, {1}});
+BENCHMARK(BM_GenerateReportMetricValueSignature)
+    ->ArgName("labels")
+    ->Arg(0)
+    ->Arg(1)
+    ->Arg(4)
+    ->Arg(16)
+    ->Arg(64);
+// Quota labels are not part of the quota signature, they are still set to
+// show that they cost nothing.
+BENCHMARK(BM_GenerateAllocateQuotaRequestSignature)
+    ->Apply(LabelsAndMetricSets);
+
+}  // namespace
+}  // namespace service_control_client
+}  // namespace google
+
+BENCHMARK_MAIN();
@@ -14,7 +14,6 @@ limitations under the License.
 ==============================================================================*/
 
 #include "src/signature.h"
-#include "utils/md5.h"
 
 #include "google/protobuf/text_format.h"
 #include "google/type/money.pb.h"
@@ -22,6 +21,7 @@ limitations under the License.
 
 using std::string;
 using ::google::api::servicecontrol::v1::CheckRequest;
+using ::google::api::servicecontrol::v1::LogEntry;
 using ::google::api::servicecontrol::v1::MetricValue;
 using ::google::api::servicecontrol::v1::Operation;
 using ::google::type::Money;
@@ -108,37 +108,91 @@ class SignatureUtilTest : public ::testing::Test {
 };
 
 TEST_F(SignatureUtilTest, OperationWithNoLabel) {
-  EXPECT_EQ("d056b16b88b914b40cd5a82470bc02a5",
-            MD5::DebugString(GenerateReportOperationSignature(operation_)));
+  EXPECT_EQ("b87e4fbd27f7bdbda121e682e651842d",
+            GenerateReportOperationSignature(operation_).DebugString());
 }
 
 TEST_F(SignatureUtilTest, OperationWithLabels) {
   AddOperationLabel(kRegionLabel, "us-central1", &operation_);
   AddOperationLabel(kResourceTypeLabel, "instance", &operation_);
 
-  EXPECT_EQ("93bc5c613fc4eabb2a40042f7f73f671",
-            MD5::DebugString(GenerateReportOperationSignature(operation_)));
+  EXPECT_EQ("d88297456fea0ca95dec35ca333e05d4",
+            GenerateReportOperationSignature(operation_).DebugString());
 }
 
 TEST_F(SignatureUtilTest, MetricValueWithNoLabel) {
   EXPECT_EQ(
-      "d41d8cd98f00b204e9800998ecf8427e",
-      MD5::DebugString(GenerateReportMetricValueSignature(metric_value_)));
+      "46328447a2022b04964f2f614c774125",
+      GenerateReportMetricValueSignature(metric_value_).DebugString());
 }
 
 TEST_F(SignatureUtilTest, MetricValueWithLabels) {
   AddMetricValueLabel(kCustomLabel, "disk", &metric_value_);
 
   EXPECT_EQ(
-      "3f6bc74c0a4be6b6eeaab1faac30a365",
-      MD5::DebugString(GenerateReportMetricValueSignature(metric_value_)));
+      "698bad5e426f86dded43d5ee95f22e40",
+      GenerateReportMetricValueSignature(metric_value_).DebugString());
+}
+
+TEST_F(SignatureUtilTest, LogEntryIgnoresTimestampAndInsertId) {
+  LogEntry entry;
+  entry.set_name("system_event");
+  entry.set_text_payload("message");
+  (*entry.mutable_labels())[kCustomLabel] = "disk";
+  LogEntry other = entry;
+  other.mutable_timestamp()->set_seconds(700);
+  other.set_insert_id("some-insert-id");
+  EXPECT_EQ(GenerateLogEntrySignature(entry), GenerateLogEntrySignature(other));
+
+  other.set_severity(::google::logging::type::ERROR);
+  EXPECT_NE(GenerateLogEntrySignature(entry), GenerateLogEntrySignature(other));
+  other = entry;
+  other.mutable_struct_payload();
+  EXPECT_NE(GenerateLogEntrySignature(entry), GenerateLogEntrySignature(other));
 }
 
 TEST_F(SignatureUtilTest, CheckRequest) {
   CheckRequest request;
   ASSERT_TRUE(TextFormat::ParseFromString(kCheckRequest, &request));
-  EXPECT_EQ("4deb431384f1dbb616b59e00db496347",
-            MD5::DebugString(GenerateCheckRequestSignature(request)));
+  EXPECT_EQ("84f961906246afb8fe49f65a94b92a87",
+            GenerateCheckRequestSignature(request).DebugString());
+}
+
+TEST_F(SignatureUtilTest, LabelOrderDoesNotMatter) {
+  Operation reversed = operation_;
+  AddOperationLabel(kRegionLabel, "us-central1", &operation_);
+  AddOperationLabel(kResourceTypeLabel, "instance", &operation_);
+  AddOperationLabel(kResourceTypeLabel, "instance", &reversed);
+  AddOperationLabel(kRegionLabel, "us-central1", &reversed);
+
+  EXPECT_EQ(GenerateReportOperationSignature(operation_),
+            GenerateReportOperationSignature(reversed));
+}
+
+TEST_F(SignatureUtilTest, LabelValuesAreBoundToKeys) {
+  Operation swapped = operation_;
+  AddOperationLabel(kRegionLabel, "us-central1", &operation_);
+  AddOperationLabel(kResourceTypeLabel, "instance", &operation_);
+  AddOperationLabel(kRegionLabel, "instance", &swapped);
+  AddOperationLabel(kResourceTypeLabel, "us-central1", &swapped);
+
+  EXPECT_NE(GenerateReportOperationSignature(operation_),
+            GenerateReportOperationSignature(swapped));
+}
+
+TEST_F(SignatureUtilTest, CheckRequestMetricValueSetOrderDoesNotMatter) {
+  CheckRequest request;
+  ASSERT_TRUE(TextFormat::ParseFromString(kCheckRequest, &request));
+  auto* metric_value_sets = request.mutable_operation()->add_metric_value_sets();
+  metric_value_sets->set_metric_name("chemisttest.googleapis.com/other");
+  Signature signature = GenerateCheckRequestSignature(request);
+
+  request.mutable_operation()->mutable_metric_value_sets()->SwapElements(0, 1);
+  EXPECT_EQ(signature, GenerateCheckRequestSignature(request));
+
+  request.mutable_operation()->mutable_metric_value_sets(0)->set_metric_name(
+      "chemisttest.googleapis.com/another");
+  EXPECT_NE(signature, GenerateCheckRequestSignature(request));
 }
 
 }  // namespace
@@ -0,0 +1,112 @@
+/* Copyright 2021 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "test/benchmark_util.h"
+
+#include <malloc.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include <new>
+
+namespace {
+
+// Plain thread_local integers need no dynamic initialization, so they are
+// safe to use from operator new.
+thread_local int64_t thread_allocations = 0;
+thread_local int64_t thread_allocated_bytes = 0;
+thread_local int64_t thread_freed_bytes = 0;
+
+void* CountedAllocate(size_t size) {
+  void* ptr = malloc(size == 0 ? 1 : size);
+  if (ptr == nullptr) {
+    throw std::bad_alloc();
+  }
+  ++thread_allocations;
+  thread_allocated_bytes += malloc_usable_size(ptr);
+  return ptr;
+}
+
+void CountedFree(void* ptr) {
+  if (ptr == nullptr) return;
+  thread_freed_bytes += malloc_usable_size(ptr);
+  free(ptr);
+}
+
+int64_t ClockNanos(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+}  // namespace
+
+void* operator new(size_t size) { return CountedAllocate(size); }
+void* operator new[](size_t size) { return CountedAllocate(size); }
+void operator delete(void* ptr) noexcept { CountedFree(ptr); }
+void operator delete[](void* ptr) noexcept { CountedFree(ptr); }
+void operator delete(void* ptr, size_t) noexcept { CountedFree(ptr); }
+void operator delete[](void* ptr, size_t) noexcept { CountedFree(ptr); }
+
+namespace google {
+namespace service_control_client {
+namespace benchmark_util {
+
+AllocationStats ThreadAllocationStats() {
+  AllocationStats stats;
+  stats.allocations = thread_allocations;
+  stats.allocated_bytes = thread_allocated_bytes;
+  stats.live_bytes = thread_allocated_bytes - thread_freed_bytes;
+  return stats;
+}
+
+int64_t ThreadCpuNanos() { return ClockNanos(CLOCK_THREAD_CPUTIME_ID); }
+
+int64_t WallNanos() { return ClockNanos(CLOCK_MONOTONIC); }
+
+int64_t PeakRssBytes() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  // ru_maxrss is in kilobytes on Linux.
+  return static_cast<int64_t>(usage.ru_maxrss) * 1024;
+}
+
+OperationProfiler::OperationProfiler()
+    : start_allocations_(ThreadAllocationStats()),
+      start_cpu_nanos_(ThreadCpuNanos()),
+      start_wall_nanos_(WallNanos()) {}
+
+void OperationProfiler::Finish(::benchmark::State& state) {
+  int64_t wall_nanos = WallNanos() - start_wall_nanos_;
+  int64_t cpu_nanos = ThreadCpuNanos() - start_cpu_nanos_;
+  AllocationStats allocations = ThreadAllocationStats();
+
+  // Counters are summed over threads, kAvgIterations then divides by the
+  // total number of iterations of all threads.
+  state.counters["allocs/op"] = ::benchmark::Counter(
+      allocations.allocations - start_allocations_.allocations,
+      ::benchmark::Counter::kAvgIterations);
+  state.counters["bytes/op"] = ::benchmark::Counter(
+      allocations.allocated_bytes - start_allocations_.allocated_bytes,
+      ::benchmark::Counter::kAvgIterations);
+  state.counters["wait_ns/op"] = ::benchmark::Counter(
+      wall_nanos > cpu_nanos ? wall_nanos - cpu_nanos : 0,
+      ::benchmark::Counter::kAvgIterations);
+}
+
+}  // namespace benchmark_util
+}  // namespace service_control_client
+}  // namespace google
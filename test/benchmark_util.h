@@ -0,0 +1,83 @@
+/* Copyright 2021 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Helpers shared by the benchmark binaries.
+//
+// Linking this library replaces the global operator new/delete with versions
+// that count allocations per thread, so benchmarks can report allocations per
+// operation next to the timings reported by Google Benchmark.
+
+#ifndef GOOGLE_SERVICE_CONTROL_CLIENT_TEST_BENCHMARK_UTIL_H_
+#define GOOGLE_SERVICE_CONTROL_CLIENT_TEST_BENCHMARK_UTIL_H_
+
+#include <stdint.h>
+
+#include "benchmark/benchmark.h"
+
+namespace google {
+namespace service_control_client {
+namespace benchmark_util {
+
+// Allocation counters of the calling thread since it started.
+struct AllocationStats {
+  // Number of calls to operator new.
+  int64_t allocations;
+  // Bytes returned by operator new, as reported by malloc_usable_size().
+  int64_t allocated_bytes;
+  // Bytes currently allocated and not yet freed by this thread. Memory freed
+  // by a different thread than the one allocating it is charged to the
+  // freeing thread, so this is only meaningful for single thread runs.
+  int64_t live_bytes;
+};
+
+// Returns the allocation counters of the calling thread.
+AllocationStats ThreadAllocationStats();
+
+// Returns the CPU time consumed by the calling thread in nanoseconds.
+int64_t ThreadCpuNanos();
+
+// Returns a monotonic wall clock time in nanoseconds.
+int64_t WallNanos();
+
+// Returns the peak resident set size of the process in bytes.
+int64_t PeakRssBytes();
+
+// Measures per-operation costs that Google Benchmark does not report.
+// Construct one on each benchmark thread right before the timing loop and
+// call Finish() right after it. Finish() adds these counters, averaged over
+// the iterations of all threads:
+//   allocs/op:     calls to operator new.
+//   bytes/op:      bytes allocated.
+//   wait_ns/op:    wall time minus thread CPU time. Threads blocked on a
+//                  mutex sleep in the kernel, so with no more threads than
+//                  cores this approximates the lock-wait time. With more
+//                  threads than cores it also includes preemption.
+class OperationProfiler {
+ public:
+  OperationProfiler();
+
+  void Finish(::benchmark::State& state);
+
+ private:
+  AllocationStats start_allocations_;
+  int64_t start_cpu_nanos_;
+  int64_t start_wall_nanos_;
+};
+
+}  // namespace benchmark_util
+}  // namespace service_control_client
+}  // namespace google
+
+#endif  // GOOGLE_SERVICE_CONTROL_CLIENT_TEST_BENCHMARK_UTIL_H_
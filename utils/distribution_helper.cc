@@ -20,6 +20,10 @@ limitations under the License.
 #include <iterator>
 #include <sstream>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 using ::google::api::servicecontrol::v1::Distribution;
 using ::google::protobuf::util::OkStatus;
 using ::google::protobuf::util::Status;
@@ -131,42 +135,55 @@ bool BucketsApproximatelyEqual(const Distribution& first,
   return true;
 }
 
-void UpdateExponentialBucketCount(double value, Distribution* distribution) {
-  const auto& exponential = distribution->exponential_buckets();
-  int bucket_index = 0;
+// Returns the index of the bucket of value, for exponential buckets starting
+// at scale. value must be >= scale. Shared by ExponentialBucketIndex() and
+// ExponentialBucketIndexes() so that both round the same way.
+inline int ExponentialBucketIndexAboveScale(double value, double scale,
+                                            double log2_growth_factor,
+                                            int num_finite_buckets) {
+  // Should be put into bucket 1 + index, starting from 0. index is clamped
+  // before the conversion, it may be infinite.
+  double index = std::min(log2(value / scale) / log2_growth_factor,
+                          static_cast<double>(num_finite_buckets));
+  return 1 + static_cast<int>(index);
+}
+
+// Returns the index of the bucket of value, for exponential buckets.
+int ExponentialBucketIndex(double value, const Distribution& distribution) {
+  const auto& exponential = distribution.exponential_buckets();
   if (value >= exponential.scale()) {
-    // Should be put into bucket bucket_index, starting from 0.
-    bucket_index = 1 + static_cast<int>(log2(value / exponential.scale()) /
-                                        log2(exponential.growth_factor()));
-    if (bucket_index > exponential.num_finite_buckets() + 1) {
-      bucket_index = exponential.num_finite_buckets() + 1;
-    }
+    return ExponentialBucketIndexAboveScale(
+        value, exponential.scale(), log2(exponential.growth_factor()),
+        exponential.num_finite_buckets());
   }
-  distribution->set_bucket_counts(
-      bucket_index, distribution->bucket_counts(bucket_index) + 1);
+  return 0;
+}
+
+// Returns the index of the bucket of value, for linear buckets from
+// lower_bound to upper_bound. Shared by LinearBucketIndex() and
+// LinearBucketIndexes() so that both round the same way.
+inline int LinearBucketIndexInBounds(double value, double lower_bound,
+                                     double upper_bound, double width,
+                                     int num_finite_buckets) {
+  // Values below the lower bound, including NaN, go to the underflow bucket.
+  if (!(value >= lower_bound)) return 0;
+  if (value >= upper_bound) return num_finite_buckets + 1;
+  return 1 + static_cast<int>((value - lower_bound) / width);
 }
 
-void UpdateLinearBucketCount(double value, Distribution* distribution) {
-  const auto& linear = distribution->linear_buckets();
+// Returns the index of the bucket of value, for linear buckets.
+int LinearBucketIndex(double value, const Distribution& distribution) {
+  const auto& linear = distribution.linear_buckets();
   double upper_bound =
       linear.offset() + linear.num_finite_buckets() * linear.width();
-  double lower_bound = linear.offset();
-
-  int bucket_index;
-  if (value < lower_bound || std::isnan(value)) {
-    bucket_index = 0;
-  } else if (value >= upper_bound) {
-    bucket_index = linear.num_finite_buckets() + 1;
-  } else {
-    bucket_index = 1 + static_cast<int>((value - lower_bound) / linear.width());
-  }
-
-  distribution->set_bucket_counts(
-      bucket_index, distribution->bucket_counts(bucket_index) + 1);
+  return LinearBucketIndexInBounds(value, linear.offset(), upper_bound,
+                                   linear.width(),
+                                   linear.num_finite_buckets());
 }
 
-void UpdateExplicitBucketCount(double value, Distribution* distribution) {
-  const auto& bounds = distribution->explicit_buckets().bounds();
+// Returns the index of the bucket of value, for explicit buckets.
+int ExplicitBucketIndex(double value, const Distribution& distribution) {
+  const auto& bounds = distribution.explicit_buckets().bounds();
   int bucket_index = 0;
   if (value >= bounds.Get(0)) {
     // -inf <  b0 <  b1 <  b2 <  b3 < +inf     (4 values in "bounds")
@@ -175,8 +192,98 @@ void UpdateExplicitBucketCount(double value, Distribution* distribution) {
     bucket_index = std::distance(
         bounds.begin(), std::upper_bound(bounds.begin(), bounds.end(), value));
   }
-  distribution->set_bucket_counts(
-      bucket_index, distribution->bucket_counts(bucket_index) + 1);
+  return bucket_index;
+}
+
+// Returns the index of the bucket of value, or -1 if the bucket option of
+// distribution is unknown.
+int BucketIndex(double value, const Distribution& distribution) {
+  switch (distribution.bucket_option_case()) {
+    case Distribution::kExponentialBuckets:
+      return ExponentialBucketIndex(value, distribution);
+    case Distribution::kLinearBuckets:
+      return LinearBucketIndex(value, distribution);
+    case Distribution::kExplicitBuckets:
+      return ExplicitBucketIndex(value, distribution);
+    default:
+      return -1;
+  }
+}
+
+// The number of samples whose bucket indexes are computed at once by
+// AddSamples().
+const size_t kBucketIndexBlockSize = 64;
+
+// Sets indexes to the bucket indexes of the n values, for exponential
+// buckets. Unlike ExponentialBucketIndex(), log2(growth_factor) is computed
+// once, so it takes one log2 per value.
+void ExponentialBucketIndexes(const double* values, size_t n,
+                              const Distribution& distribution, int* indexes) {
+  const auto& exponential = distribution.exponential_buckets();
+  const double scale = exponential.scale();
+  const double log2_growth_factor = log2(exponential.growth_factor());
+  const int num_finite_buckets = exponential.num_finite_buckets();
+  for (size_t i = 0; i < n; ++i) {
+    // Values below scale, including NaN, go to the underflow bucket.
+    indexes[i] = values[i] >= scale
+                     ? ExponentialBucketIndexAboveScale(
+                           values[i], scale, log2_growth_factor,
+                           num_finite_buckets)
+                     : 0;
+  }
+}
+
+// Sets indexes to the bucket indexes of the n values, for linear buckets.
+// The bounds are computed once, and the loop has no call, so it can be
+// vectorized.
+void LinearBucketIndexes(const double* values, size_t n,
+                         const Distribution& distribution, int* indexes) {
+  const auto& linear = distribution.linear_buckets();
+  const double lower_bound = linear.offset();
+  const double width = linear.width();
+  const int num_finite_buckets = linear.num_finite_buckets();
+  const double upper_bound = lower_bound + num_finite_buckets * width;
+  for (size_t i = 0; i < n; ++i) {
+    indexes[i] = LinearBucketIndexInBounds(values[i], lower_bound, upper_bound,
+                                           width, num_finite_buckets);
+  }
+}
+
+// Sets indexes to the bucket indexes of the n values, for explicit buckets.
+// Uses a binary search whose only branch is on the number of bounds left, the
+// comparison selects the next position without branching.
+void ExplicitBucketIndexes(const double* values, size_t n,
+                           const Distribution& distribution, int* indexes) {
+  const auto& bounds = distribution.explicit_buckets().bounds();
+  const double* first = bounds.data();
+  const size_t size = bounds.size();
+  for (size_t i = 0; i < n; ++i) {
+    // Finds the number of bounds <= values[i], like std::upper_bound.
+    const double* base = first;
+    size_t length = size;
+    while (length > 1) {
+      size_t half = length / 2;
+      base = base[half] <= values[i] ? base + half : base;
+      length -= half;
+    }
+    indexes[i] = (base - first) + (size > 0 && *base <= values[i]);
+  }
+}
+
+// Adds the n bucket counts in from to the ones in to.
+void AddBucketCounts(const int64_t* from, int n, int64_t* to) {
+  int i = 0;
+#ifdef __SSE2__
+  for (; i + 2 <= n; i += 2) {
+    __m128i sum = _mm_add_epi64(
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(from + i)),
+        _mm_loadu_si128(reinterpret_cast<const __m128i*>(to + i)));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(to + i), sum);
+  }
+#endif
+  for (; i < n; ++i) {
+    to[i] += from[i];
+  }
 }
 
 }  // namespace
@@ -248,24 +355,79 @@ Status DistributionHelper::InitExplicit(const std::vector<double>& bounds,
 }
 
 Status DistributionHelper::AddSample(double value, Distribution* distribution) {
+  int bucket_index = BucketIndex(value, *distribution);
+  if (bucket_index < 0) {
+    return Status(StatusCode::kInvalidArgument,
+                  StrCat("Unknown bucket option case: ",
+                         distribution->bucket_option_case()));
+  }
+  UpdateGeneralStatictics(value, distribution);
+  distribution->set_bucket_counts(
+      bucket_index, distribution->bucket_counts(bucket_index) + 1);
+  return OkStatus();
+}
+
+Status DistributionHelper::AddSamples(const double* values, size_t n,
+                                      Distribution* distribution) {
+  void (*bucket_indexes)(const double*, size_t, const Distribution&, int*);
+  int num_buckets;
   switch (distribution->bucket_option_case()) {
     case Distribution::kExponentialBuckets:
-      UpdateGeneralStatictics(value, distribution);
-      UpdateExponentialBucketCount(value, distribution);
+      bucket_indexes = ExponentialBucketIndexes;
+      num_buckets =
+          distribution->exponential_buckets().num_finite_buckets() + 2;
       break;
     case Distribution::kLinearBuckets:
-      UpdateGeneralStatictics(value, distribution);
-      UpdateLinearBucketCount(value, distribution);
+      bucket_indexes = LinearBucketIndexes;
+      num_buckets = distribution->linear_buckets().num_finite_buckets() + 2;
       break;
     case Distribution::kExplicitBuckets:
-      UpdateGeneralStatictics(value, distribution);
-      UpdateExplicitBucketCount(value, distribution);
+      bucket_indexes = ExplicitBucketIndexes;
+      num_buckets = distribution->explicit_buckets().bounds_size() + 1;
       break;
     default:
       return Status(StatusCode::kInvalidArgument,
                     StrCat("Unknown bucket option case: ",
                            distribution->bucket_option_case()));
   }
+  if (n == 0) return OkStatus();
+
+  if (distribution->bucket_counts_size() < num_buckets) {
+    distribution->mutable_bucket_counts()->Resize(num_buckets, 0);
+  }
+  int64_t* bucket_counts =
+      distribution->mutable_bucket_counts()->mutable_data();
+  int indexes[kBucketIndexBlockSize];
+  for (size_t start = 0; start < n; start += kBucketIndexBlockSize) {
+    size_t block_size = std::min(kBucketIndexBlockSize, n - start);
+    bucket_indexes(values + start, block_size, *distribution, indexes);
+    for (size_t i = 0; i < block_size; ++i) {
+      ++bucket_counts[indexes[i]];
+    }
+  }
+
+  // The mean first, then the deviations from it, for minimum round off error.
+  DistributionStatistics samples;
+  samples.count = n;
+  samples.minimum = values[0];
+  samples.maximum = values[0];
+  double sum = 0;
+  for (size_t i = 0; i < n; ++i) {
+    samples.minimum = std::min(values[i], samples.minimum);
+    samples.maximum = std::max(values[i], samples.maximum);
+    sum += values[i];
+  }
+  samples.mean = sum / n;
+  samples.sum_of_squared_deviation = 0;
+  for (size_t i = 0; i < n; ++i) {
+    samples.sum_of_squared_deviation +=
+        (values[i] - samples.mean) * (values[i] - samples.mean);
+  }
+
+  DistributionStatistics statistics =
+      DistributionStatistics::Of(*distribution);
+  statistics.Merge(samples);
+  statistics.CopyTo(distribution);
   return OkStatus();
 }
 
@@ -287,24 +449,130 @@ Status DistributionHelper::Merge(const Distribution& from, Distribution* to) {
     return OkStatus();
   }
 
-  int64_t count = to->count();
-  double mean = to->mean();
-  double sum_of_squared_deviation = to->sum_of_squared_deviation();
+  DistributionStatistics statistics = DistributionStatistics::Of(*to);
+  statistics.Merge(DistributionStatistics::Of(from));
+  statistics.CopyTo(to);
+  AddBucketCounts(from.bucket_counts().data(), from.bucket_counts_size(),
+                  to->mutable_bucket_counts()->mutable_data());
+  return OkStatus();
+}
+
+DistributionStatistics DistributionStatistics::Of(
+    const Distribution& distribution) {
+  DistributionStatistics statistics;
+  statistics.count = distribution.count();
+  statistics.mean = distribution.mean();
+  statistics.minimum = distribution.minimum();
+  statistics.maximum = distribution.maximum();
+  statistics.sum_of_squared_deviation =
+      distribution.sum_of_squared_deviation();
+  return statistics;
+}
+
+void DistributionStatistics::CopyTo(Distribution* to) const {
+  to->set_count(count);
+  to->set_mean(mean);
+  to->set_minimum(minimum);
+  to->set_maximum(maximum);
+  to->set_sum_of_squared_deviation(sum_of_squared_deviation);
+}
+
+void DistributionStatistics::Merge(const DistributionStatistics& from) {
+  if (from.count <= 0) return;
+  if (count <= 0) {
+    *this = from;
+    return;
+  }
+
+  int64_t to_count = count;
+  double to_mean = mean;
+
+  count += from.count;
+  minimum = std::min(from.minimum, minimum);
+  maximum = std::max(from.maximum, maximum);
+  mean = (to_count * to_mean + from.count * from.mean) / count;
+  sum_of_squared_deviation +=
+      from.sum_of_squared_deviation +
+      to_count * (mean - to_mean) * (mean - to_mean) +
+      from.count * (mean - from.mean) * (mean - from.mean);
+}
 
-  to->set_count(to->count() + from.count());
-  to->set_minimum(std::min(from.minimum(), to->minimum()));
-  to->set_maximum(std::max(from.maximum(), to->maximum()));
-  to->set_mean((count * mean + from.count() * from.mean()) / to->count());
-  to->set_sum_of_squared_deviation(
-      sum_of_squared_deviation + from.sum_of_squared_deviation() +
-      count * (to->mean() - mean) * (to->mean() - mean) +
-      from.count() * (to->mean() - from.mean()) * (to->mean() - from.mean()));
+DistributionAccumulator::DistributionAccumulator(
+    const Distribution& distribution)
+    : options_(distribution),
+      statistics_(DistributionStatistics::Of(distribution)),
+      bucket_counts_(distribution.bucket_counts().begin(),
+                     distribution.bucket_counts().end()) {
+  options_.clear_count();
+  options_.clear_mean();
+  options_.clear_minimum();
+  options_.clear_maximum();
+  options_.clear_sum_of_squared_deviation();
+  options_.clear_bucket_counts();
+}
 
-  for (int i = 0; i < from.bucket_counts_size(); i++) {
-    to->set_bucket_counts(i, to->bucket_counts(i) + from.bucket_counts(i));
+Status DistributionAccumulator::AddSample(double value) {
+  int bucket_index = BucketIndex(value, options_);
+  if (bucket_index < 0) {
+    return Status(StatusCode::kInvalidArgument,
+                  StrCat("Unknown bucket option case: ",
+                         options_.bucket_option_case()));
   }
+  // A distribution not set up by the Init functions may lack bucket counts.
+  if (static_cast<size_t>(bucket_index) >= bucket_counts_.size()) {
+    bucket_counts_.resize(bucket_index + 1, 0);
+  }
+  ++bucket_counts_[bucket_index];
+
+  // Welford's update, which is numerically stable.
+  if (statistics_.count <= 0) {
+    statistics_.count = 1;
+    statistics_.mean = statistics_.minimum = statistics_.maximum = value;
+    statistics_.sum_of_squared_deviation = 0;
+    return OkStatus();
+  }
+  ++statistics_.count;
+  double delta = value - statistics_.mean;
+  statistics_.mean += delta / statistics_.count;
+  statistics_.sum_of_squared_deviation += delta * (value - statistics_.mean);
+  statistics_.minimum = std::min(value, statistics_.minimum);
+  statistics_.maximum = std::max(value, statistics_.maximum);
   return OkStatus();
 }
 
+Status DistributionAccumulator::Merge(const Distribution& from) {
+  if (!BucketsApproximatelyEqual(from, options_)) {
+    Distribution to;
+    CopyTo(&to);
+    return Status(StatusCode::kInvalidArgument,
+                  std::string("Bucket options don't match. From: ") +
+                      from.DebugString() + " to: " + to.DebugString());
+  }
+
+  if (static_cast<size_t>(from.bucket_counts_size()) != bucket_counts_.size()) {
+    return Status(StatusCode::kInvalidArgument, "Bucket counts size don't match.");
+  }
+
+  if (from.count() <= 0) return OkStatus();
+  if (statistics_.count <= 0) {
+    *this = DistributionAccumulator(from);
+    return OkStatus();
+  }
+
+  statistics_.Merge(DistributionStatistics::Of(from));
+  AddBucketCounts(from.bucket_counts().data(), from.bucket_counts_size(),
+                  bucket_counts_.data());
+  return OkStatus();
+}
+
+void DistributionAccumulator::CopyTo(Distribution* to) const {
+  *to = options_;
+  statistics_.CopyTo(to);
+  to->mutable_bucket_counts()->Reserve(bucket_counts_.size());
+  for (int64_t bucket_count : bucket_counts_) {
+    to->add_bucket_counts(bucket_count);
+  }
+}
+
 }  // namespace service_control_client
 }  // namespace google
@@ -16,6 +16,10 @@ limitations under the License.
 #ifndef GOOGLE_SERVICE_CONTROL_CLIENT_UTILS_DISTRIBUTION_HELPER_H_
 #define GOOGLE_SERVICE_CONTROL_CLIENT_UTILS_DISTRIBUTION_HELPER_H_
 
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
 #include "google/api/servicecontrol/v1/distribution.pb.h"
 #include "google/protobuf/stubs/status.h"
 
@@ -47,6 +51,13 @@ class DistributionHelper final {
       double value,
       ::google::api::servicecontrol::v1::Distribution* distribution);
 
+  // Adds the n given samples to the given distribution. Same as calling
+  // AddSample() for each sample, but faster for many samples: bucket indexes
+  // are computed in blocks and the statistics are updated once.
+  static ::google::protobuf::util::Status AddSamples(
+      const double* values, size_t n,
+      ::google::api::servicecontrol::v1::Distribution* distribution);
+
   // Merges the "from" distribution to "to" distribution.
   // No change if the bucket options does not match.
   static ::google::protobuf::util::Status Merge(
@@ -54,6 +65,56 @@ class DistributionHelper final {
       ::google::api::servicecontrol::v1::Distribution* to);
 };
 
+// The statistics of a distribution other than its bucket counts.
+struct DistributionStatistics {
+  // Returns the statistics of the given distribution.
+  static DistributionStatistics Of(
+      const ::google::api::servicecontrol::v1::Distribution& distribution);
+
+  // Sets the statistics of the given distribution.
+  void CopyTo(::google::api::servicecontrol::v1::Distribution* to) const;
+
+  // Merges the statistics of other samples into these ones.
+  void Merge(const DistributionStatistics& from);
+
+  int64_t count;
+  double mean;
+  double minimum;
+  double maximum;
+  double sum_of_squared_deviation;
+};
+
+// Accumulates samples and distributions with the same bucket options as a
+// given Distribution, in plain fields instead of the proto message. Used to
+// aggregate many distributions, which are written back to a Distribution
+// message only once, by CopyTo().
+// Thread compatible.
+class DistributionAccumulator final {
+ public:
+  // Starts from the given distribution, including its bucket options.
+  explicit DistributionAccumulator(
+      const ::google::api::servicecontrol::v1::Distribution& distribution);
+
+  // Same as DistributionHelper::AddSample().
+  ::google::protobuf::util::Status AddSample(double value);
+
+  // Same as DistributionHelper::Merge(), from is merged into this instance.
+  ::google::protobuf::util::Status Merge(
+      const ::google::api::servicecontrol::v1::Distribution& from);
+
+  // Sets the given distribution to the accumulated one.
+  void CopyTo(::google::api::servicecontrol::v1::Distribution* to) const;
+
+  int64_t count() const { return statistics_.count; }
+
+ private:
+  // The bucket options, with no statistics nor bucket counts.
+  ::google::api::servicecontrol::v1::Distribution options_;
+
+  DistributionStatistics statistics_;
+  std::vector<int64_t> bucket_counts_;
+};
+
 }  // namespace service_control_client
 }  // namespace google
 
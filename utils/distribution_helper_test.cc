@@ -15,7 +15,9 @@ limitations under the License.
 
 #include "distribution_helper.h"
 
+#include <cmath>
 #include <limits>
+#include <vector>
 
 #include "gmock/gmock.h"
 #include "google/protobuf/text_format.h"
@@ -881,6 +883,166 @@ TEST_F(DistributionHelperTest, Merge_ZeroCount) {
   EXPECT_TRUE(MessageDifferencer::ApproximatelyEquals(to, distribution));
 }
 
+TEST_F(DistributionHelperTest, AddSamples_MultipleValues) {
+  Distribution expected;
+  int total_values = sizeof(kMultipleValuesExponential) / sizeof(double);
+
+  ASSERT_TRUE(TextFormat::ParseFromString(
+      kMultipleValuesExponentialDistribution, &expected));
+  EXPECT_TRUE(helper_
+                  .AddSamples(kMultipleValuesExponential, total_values,
+                              &exponential_distribution_)
+                  .ok());
+  EXPECT_TRUE(MessageDifferencer::ApproximatelyEquals(exponential_distribution_,
+                                                      expected));
+
+  ASSERT_TRUE(TextFormat::ParseFromString(kMultipleValuesLinearDistribution,
+                                          &expected));
+  EXPECT_TRUE(helper_
+                  .AddSamples(kMultipleValuesLinear,
+                              sizeof(kMultipleValuesLinear) / sizeof(double),
+                              &linear_distribution_)
+                  .ok());
+  EXPECT_TRUE(
+      MessageDifferencer::ApproximatelyEquals(linear_distribution_, expected));
+
+  ASSERT_TRUE(TextFormat::ParseFromString(kMultipleValuesExplicitDistribution,
+                                          &expected));
+  EXPECT_TRUE(helper_
+                  .AddSamples(kMultipleValuesExplicit,
+                              sizeof(kMultipleValuesExplicit) / sizeof(double),
+                              &explicit_distribution_)
+                  .ok());
+  EXPECT_TRUE(MessageDifferencer::ApproximatelyEquals(explicit_distribution_,
+                                                      expected));
+}
+
+TEST_F(DistributionHelperTest, AddSamples_SameAsAddSample) {
+  // More samples than a block of bucket indexes, added to a distribution
+  // which already has some.
+  std::vector<double> values;
+  for (int i = 0; i < 1000; ++i) {
+    values.push_back((i % 37) * 0.25 - 1);
+  }
+  for (Distribution* distribution :
+       {&exponential_distribution_, &linear_distribution_,
+        &explicit_distribution_}) {
+    (void)helper_.AddSample(2, distribution);
+    Distribution expected = *distribution;
+    for (double value : values) {
+      (void)helper_.AddSample(value, &expected);
+    }
+    EXPECT_TRUE(
+        helper_.AddSamples(values.data(), values.size(), distribution).ok());
+
+    // The statistics are computed in another order, they are only equal up to
+    // the round off errors.
+    EXPECT_EQ(distribution->count(), expected.count());
+    EXPECT_NEAR(distribution->mean(), expected.mean(), 1e-9);
+    EXPECT_NEAR(distribution->sum_of_squared_deviation(),
+                expected.sum_of_squared_deviation(), 1e-9);
+    distribution->clear_mean();
+    distribution->clear_sum_of_squared_deviation();
+    expected.clear_mean();
+    expected.clear_sum_of_squared_deviation();
+    EXPECT_TRUE(MessageDifferencer::Equals(*distribution, expected));
+  }
+}
+
+TEST_F(DistributionHelperTest, AddSamples_BucketBoundaries) {
+  // Samples on the bucket bounds, where the round off decides the bucket,
+  // land in the same buckets as with AddSample().
+  auto expect_same_buckets = [this](const std::vector<double>& values,
+                                    const Distribution& empty) {
+    Distribution expected = empty;
+    for (double value : values) {
+      (void)helper_.AddSample(value, &expected);
+    }
+    Distribution distribution = empty;
+    EXPECT_TRUE(
+        helper_.AddSamples(values.data(), values.size(), &distribution).ok());
+    ASSERT_EQ(distribution.bucket_counts_size(),
+              expected.bucket_counts_size());
+    for (int i = 0; i < expected.bucket_counts_size(); ++i) {
+      EXPECT_EQ(distribution.bucket_counts(i), expected.bucket_counts(i))
+          << "bucket " << i << " of " << empty.ShortDebugString();
+    }
+  };
+
+  for (double growth_factor : {1.1, 1.2, 1.5, 2.0, 3.0, 4.0, 5.0, 7.0, 10.0}) {
+    for (double scale : {0.001, 0.3, 1.0, 7.0}) {
+      Distribution empty;
+      ASSERT_TRUE(
+          helper_.InitExponential(40, growth_factor, scale, &empty).ok());
+      std::vector<double> values;
+      for (int k = 0; k < 40; ++k) {
+        values.push_back(scale * std::pow(growth_factor, k));
+      }
+      expect_same_buckets(values, empty);
+    }
+  }
+
+  for (double width : {0.1, 0.3, 1.7}) {
+    for (double offset : {-1.0, 0.2, 3.0}) {
+      Distribution empty;
+      ASSERT_TRUE(helper_.InitLinear(40, width, offset, &empty).ok());
+      std::vector<double> values;
+      for (int k = 0; k <= 41; ++k) {
+        values.push_back(offset + k * width);
+      }
+      expect_same_buckets(values, empty);
+    }
+  }
+}
+
+TEST_F(DistributionHelperTest, AddSamples_UnknownDistribution) {
+  Distribution distribution;
+  const double values[] = {1, 2};
+  EXPECT_FALSE(helper_.AddSamples(values, 2, &distribution).ok());
+}
+
+TEST_F(DistributionHelperTest, Accumulator_AddSamples) {
+  Distribution expected;
+  ASSERT_TRUE(TextFormat::ParseFromString(
+      kMultipleValuesExponentialDistribution, &expected));
+  DistributionAccumulator accumulator(exponential_distribution_);
+  for (double value : kMultipleValuesExponential) {
+    EXPECT_TRUE(accumulator.AddSample(value).ok());
+  }
+  Distribution distribution;
+  accumulator.CopyTo(&distribution);
+  EXPECT_TRUE(MessageDifferencer::ApproximatelyEquals(distribution, expected));
+}
+
+TEST_F(DistributionHelperTest, Accumulator_MergeDistributions) {
+  Distribution expected;
+  ASSERT_TRUE(TextFormat::ParseFromString(
+      kMultipleValuesExponentialDistribution, &expected));
+
+  // Merges one distribution per value, into an empty accumulator.
+  DistributionAccumulator accumulator(exponential_distribution_);
+  for (double value : kMultipleValuesExponential) {
+    Distribution distribution = other_exponential_distribution_;
+    (void)helper_.AddSample(value, &distribution);
+    EXPECT_TRUE(accumulator.Merge(distribution).ok());
+  }
+  EXPECT_EQ(accumulator.count(), expected.count());
+  Distribution distribution;
+  accumulator.CopyTo(&distribution);
+  EXPECT_TRUE(MessageDifferencer::ApproximatelyEquals(distribution, expected));
+}
+
+TEST_F(DistributionHelperTest, Accumulator_MergeBucketNotMatch) {
+  (void)helper_.AddSample(1, &linear_distribution_);
+  DistributionAccumulator accumulator(linear_distribution_);
+  (void)helper_.AddSample(1, &exponential_distribution_);
+  EXPECT_FALSE(accumulator.Merge(exponential_distribution_).ok());
+
+  Distribution distribution;
+  accumulator.CopyTo(&distribution);
+  EXPECT_TRUE(MessageDifferencer::Equals(distribution, linear_distribution_));
+}
+
 }  // namespace
 }  // namespace service_control_client
 }  // namespace google
@@ -0,0 +1,429 @@
+/* Copyright 2021 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// An open addressing hash map in the style of the Swiss table.
+//
+// . The key/value pairs are stored inline in one slot array. Each slot has
+//   one control byte in a separate array: kEmpty, kDeleted, or the low 7
+//   bits of the hash of the key in the slot.
+//
+// . Slots are probed in groups of 16. A lookup compares the control bytes
+//   of a whole group with the 7 hash bits at once (with SSE2 when it is
+//   available), so most lookups read one control cache line and one slot.
+//
+// . Only the subset of the std::unordered_map interface used by
+//   SimpleLRUCacheBase is provided. As with std::unordered_map, inserting
+//   may invalidate all the iterators; erasing only invalidates the
+//   iterators to the erased element.
+
+#ifndef GOOGLE_SERVICE_CONTROL_CLIENT_UTILS_FLAT_HASH_MAP_H_
+#define GOOGLE_SERVICE_CONTROL_CLIENT_UTILS_FLAT_HASH_MAP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <cassert>
+#include <functional>
+#include <iterator>
+#include <new>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "google_macros.h"
+
+namespace google {
+namespace service_control_client {
+
+namespace flat_hash_map_internal {
+
+typedef int8_t ctrl_t;
+
+// Control byte values. A full slot holds the low 7 bits of its hash, which
+// are never negative.
+const ctrl_t kEmpty = -128;
+const ctrl_t kDeleted = -2;
+
+const size_t kGroupWidth = 16;
+
+// Returns the index of the lowest set bit, mask must not be 0.
+inline int LowestBit(uint32_t mask) { return __builtin_ctz(mask); }
+
+// The control bytes of one group. The Match functions return a bitmask with
+// bit i set if slot i of the group matches.
+class Group {
+ public:
+#ifdef __SSE2__
+  explicit Group(const ctrl_t* pos)
+      : ctrl_(_mm_loadu_si128(reinterpret_cast<const __m128i*>(pos))) {}
+
+  uint32_t Match(ctrl_t h2) const {
+    return static_cast<uint32_t>(
+        _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(h2), ctrl_)));
+  }
+
+  uint32_t MatchEmpty() const { return Match(kEmpty); }
+
+  // Empty and deleted control bytes are the only negative ones.
+  uint32_t MatchEmptyOrDeleted() const {
+    return static_cast<uint32_t>(_mm_movemask_epi8(ctrl_));
+  }
+
+ private:
+  __m128i ctrl_;
+#else
+  explicit Group(const ctrl_t* pos) { memcpy(ctrl_, pos, kGroupWidth); }
+
+  uint32_t Match(ctrl_t h2) const {
+    uint32_t mask = 0;
+    for (size_t i = 0; i < kGroupWidth; ++i) {
+      if (ctrl_[i] == h2) mask |= 1u << i;
+    }
+    return mask;
+  }
+
+  uint32_t MatchEmpty() const { return Match(kEmpty); }
+
+  uint32_t MatchEmptyOrDeleted() const {
+    uint32_t mask = 0;
+    for (size_t i = 0; i < kGroupWidth; ++i) {
+      if (ctrl_[i] < 0) mask |= 1u << i;
+    }
+    return mask;
+  }
+
+ private:
+  ctrl_t ctrl_[kGroupWidth];
+#endif
+};
+
+// Spreads the bits of a hash value, std::hash of integers is the identity.
+inline size_t MixHash(size_t hash) {
+  uint64_t h = static_cast<uint64_t>(hash) * 0x9E3779B97F4A7C15ULL;
+  return static_cast<size_t>(h ^ (h >> 32));
+}
+
+}  // namespace flat_hash_map_internal
+
+template <typename Key, typename T, typename Hash = std::hash<Key>,
+          typename KeyEqual = std::equal_to<Key> >
+class FlatHashMap {
+ private:
+  template <bool kIsConst>
+  class Iterator;
+
+ public:
+  typedef Key key_type;
+  typedef T mapped_type;
+  typedef std::pair<const Key, T> value_type;
+  typedef size_t size_type;
+  typedef Hash hasher;
+  typedef KeyEqual key_equal;
+  typedef Iterator<false> iterator;
+  typedef Iterator<true> const_iterator;
+
+  FlatHashMap()
+      : ctrl_(nullptr),
+        slots_(nullptr),
+        capacity_(0),
+        size_(0),
+        growth_left_(0) {}
+
+  ~FlatHashMap() {
+    DestroySlots();
+    Deallocate(ctrl_, slots_);
+  }
+
+  iterator begin() { return iterator(ctrl_, slots_, ctrl_ + capacity_); }
+  iterator end() {
+    return iterator(ctrl_ + capacity_, slots_ + capacity_, ctrl_ + capacity_);
+  }
+  const_iterator begin() const {
+    return const_iterator(ctrl_, slots_, ctrl_ + capacity_);
+  }
+  const_iterator end() const {
+    return const_iterator(ctrl_ + capacity_, slots_ + capacity_,
+                          ctrl_ + capacity_);
+  }
+
+  size_type size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+
+  iterator find(const Key& key) {
+    size_t index = FindIndex(key, flat_hash_map_internal::MixHash(hash_(key)));
+    if (index == capacity_) return end();
+    return iterator(ctrl_ + index, slots_ + index, ctrl_ + capacity_);
+  }
+
+  const_iterator find(const Key& key) const {
+    size_t index = FindIndex(key, flat_hash_map_internal::MixHash(hash_(key)));
+    if (index == capacity_) return end();
+    return const_iterator(ctrl_ + index, slots_ + index, ctrl_ + capacity_);
+  }
+
+  // Returns the value of the key, a value initialized one is inserted if the
+  // key is not found.
+  T& operator[](const Key& key) {
+    size_t hash = flat_hash_map_internal::MixHash(hash_(key));
+    size_t index = FindIndex(key, hash);
+    if (index == capacity_) {
+      index = PrepareInsert(hash);
+      new (slots_ + index) value_type(std::piecewise_construct,
+                                      std::forward_as_tuple(key),
+                                      std::forward_as_tuple());
+      ctrl_[index] = H2(hash);
+      ++size_;
+    }
+    return slots_[index].second;
+  }
+
+  void erase(iterator it) {
+    size_t index = it.ctrl_ - ctrl_;
+    assert(index < capacity_ && ctrl_[index] >= 0);
+    slots_[index].~value_type();
+    --size_;
+    // A group that has an empty slot never made a lookup probe further, so
+    // the slot can be reused as empty. Otherwise a lookup may have to probe
+    // past this group, the slot is marked deleted.
+    size_t group = index & ~(flat_hash_map_internal::kGroupWidth - 1);
+    if (flat_hash_map_internal::Group(ctrl_ + group).MatchEmpty()) {
+      ctrl_[index] = flat_hash_map_internal::kEmpty;
+      ++growth_left_;
+    } else {
+      ctrl_[index] = flat_hash_map_internal::kDeleted;
+    }
+  }
+
+  // Removes all the elements, the capacity is kept.
+  void clear() {
+    DestroySlots();
+    if (capacity_ > 0) {
+      memset(ctrl_, flat_hash_map_internal::kEmpty, capacity_);
+    }
+    size_ = 0;
+    growth_left_ = MaxSize(capacity_);
+  }
+
+  // Makes room for size_hint elements without rehashing.
+  void resize(size_type size_hint) {
+    if (size_hint > MaxSize(capacity_)) {
+      Resize(CapacityFor(size_hint));
+    }
+  }
+
+ private:
+  template <bool kIsConst>
+  class Iterator {
+   public:
+    typedef std::forward_iterator_tag iterator_category;
+    typedef typename FlatHashMap::value_type value_type;
+    typedef ptrdiff_t difference_type;
+    typedef typename std::conditional<kIsConst, const value_type*,
+                                      value_type*>::type pointer;
+    typedef typename std::conditional<kIsConst, const value_type&,
+                                      value_type&>::type reference;
+
+    Iterator() : ctrl_(nullptr), slot_(nullptr), end_(nullptr) {}
+
+    // An iterator converts to a const_iterator.
+    Iterator(const Iterator<false>& other)
+        : ctrl_(other.ctrl_), slot_(other.slot_), end_(other.end_) {}
+
+    reference operator*() const { return *slot_; }
+    pointer operator->() const { return slot_; }
+
+    Iterator& operator++() {
+      ++ctrl_;
+      ++slot_;
+      SkipFree();
+      return *this;
+    }
+
+    Iterator operator++(int) {
+      Iterator it = *this;
+      ++*this;
+      return it;
+    }
+
+    friend bool operator==(const Iterator& a, const Iterator& b) {
+      return a.ctrl_ == b.ctrl_;
+    }
+    friend bool operator!=(const Iterator& a, const Iterator& b) {
+      return a.ctrl_ != b.ctrl_;
+    }
+
+   private:
+    friend class FlatHashMap;
+    friend class Iterator<true>;
+
+    Iterator(flat_hash_map_internal::ctrl_t* ctrl, value_type* slot,
+             flat_hash_map_internal::ctrl_t* end)
+        : ctrl_(ctrl), slot_(slot), end_(end) {
+      SkipFree();
+    }
+
+    // Moves to the next full slot, or to the end.
+    void SkipFree() {
+      while (ctrl_ != end_ && *ctrl_ < 0) {
+        ++ctrl_;
+        ++slot_;
+      }
+    }
+
+    flat_hash_map_internal::ctrl_t* ctrl_;
+    value_type* slot_;
+    flat_hash_map_internal::ctrl_t* end_;
+  };
+
+  static flat_hash_map_internal::ctrl_t H2(size_t hash) {
+    return static_cast<flat_hash_map_internal::ctrl_t>(hash & 0x7F);
+  }
+
+  // The first group of the probe sequence of the hash.
+  size_t FirstGroup(size_t hash) const {
+    return ((hash >> 7) * flat_hash_map_internal::kGroupWidth) &
+           (capacity_ - 1);
+  }
+
+  // Probes whole groups with triangular steps, it visits every group once
+  // because the number of groups is a power of 2.
+  size_t NextGroup(size_t group, size_t step) const {
+    return (group + step * flat_hash_map_internal::kGroupWidth) &
+           (capacity_ - 1);
+  }
+
+  // Up to 7/8 of the slots may be used, full or deleted.
+  static size_t MaxSize(size_t capacity) { return capacity - capacity / 8; }
+
+  // The smallest capacity holding size elements, a power of 2 multiple of
+  // the group width.
+  static size_t CapacityFor(size_t size) {
+    size_t capacity = flat_hash_map_internal::kGroupWidth;
+    while (MaxSize(capacity) < size) capacity *= 2;
+    return capacity;
+  }
+
+  // Returns the slot index of the key, or capacity_ if it is not found.
+  size_t FindIndex(const Key& key, size_t hash) const {
+    if (size_ == 0) return capacity_;
+    const flat_hash_map_internal::ctrl_t h2 = H2(hash);
+    size_t group = FirstGroup(hash);
+    for (size_t step = 1; step <= capacity_ / flat_hash_map_internal::kGroupWidth;
+         ++step) {
+      flat_hash_map_internal::Group g(ctrl_ + group);
+      for (uint32_t mask = g.Match(h2); mask != 0; mask &= mask - 1) {
+        size_t index = group + flat_hash_map_internal::LowestBit(mask);
+        if (eq_(slots_[index].first, key)) return index;
+      }
+      if (g.MatchEmpty()) break;
+      group = NextGroup(group, step);
+    }
+    return capacity_;
+  }
+
+  // Returns the first empty or deleted slot of the probe sequence.
+  size_t FindFreeSlot(size_t hash) const {
+    size_t group = FirstGroup(hash);
+    for (size_t step = 1;; ++step) {
+      uint32_t mask =
+          flat_hash_map_internal::Group(ctrl_ + group).MatchEmptyOrDeleted();
+      if (mask != 0) {
+        return group + flat_hash_map_internal::LowestBit(mask);
+      }
+      group = NextGroup(group, step);
+    }
+  }
+
+  // Returns a free slot for a new element with the hash, growing the table
+  // or purging the deleted slots if needed.
+  size_t PrepareInsert(size_t hash) {
+    if (capacity_ == 0) {
+      Resize(flat_hash_map_internal::kGroupWidth);
+    }
+    size_t index = FindFreeSlot(hash);
+    if (growth_left_ == 0 && ctrl_[index] == flat_hash_map_internal::kEmpty) {
+      // Grows if more than 7/16 of the slots are full, otherwise the table
+      // is mostly deleted slots and it is rehashed at the same size.
+      Resize(size_ > capacity_ * 7 / 16 ? capacity_ * 2 : capacity_);
+      index = FindFreeSlot(hash);
+    }
+    if (ctrl_[index] == flat_hash_map_internal::kEmpty) {
+      --growth_left_;
+    }
+    return index;
+  }
+
+  // Moves all the elements to new arrays of the given capacity.
+  void Resize(size_t new_capacity) {
+    flat_hash_map_internal::ctrl_t* old_ctrl = ctrl_;
+    value_type* old_slots = slots_;
+    size_t old_capacity = capacity_;
+
+    ctrl_ = new flat_hash_map_internal::ctrl_t[new_capacity];
+    memset(ctrl_, flat_hash_map_internal::kEmpty, new_capacity);
+    slots_ = static_cast<value_type*>(
+        ::operator new(new_capacity * sizeof(value_type)));
+    capacity_ = new_capacity;
+    growth_left_ = MaxSize(new_capacity) - size_;
+
+    for (size_t i = 0; i < old_capacity; ++i) {
+      if (old_ctrl[i] >= 0) {
+        size_t hash = flat_hash_map_internal::MixHash(hash_(old_slots[i].first));
+        size_t index = FindFreeSlot(hash);
+        new (slots_ + index) value_type(std::move(old_slots[i]));
+        ctrl_[index] = H2(hash);
+        old_slots[i].~value_type();
+      }
+    }
+    Deallocate(old_ctrl, old_slots);
+  }
+
+  void DestroySlots() {
+    for (size_t i = 0; i < capacity_; ++i) {
+      if (ctrl_[i] >= 0) slots_[i].~value_type();
+    }
+  }
+
+  static void Deallocate(flat_hash_map_internal::ctrl_t* ctrl,
+                         value_type* slots) {
+    delete[] ctrl;
+    ::operator delete(slots);
+  }
+
+  // Control bytes, one per slot.
+  flat_hash_map_internal::ctrl_t* ctrl_;
+  // The slots, only the full ones are constructed.
+  value_type* slots_;
+  // Number of slots, 0 or a power of 2 multiple of kGroupWidth.
+  size_t capacity_;
+  // Number of full slots.
+  size_t size_;
+  // Number of empty slots that can still be filled before a rehash.
+  size_t growth_left_;
+
+  Hash hash_;
+  KeyEqual eq_;
+
+  GOOGLE_DISALLOW_EVIL_CONSTRUCTORS(FlatHashMap);
+};
+
+}  // namespace service_control_client
+}  // namespace google
+
+#endif  // GOOGLE_SERVICE_CONTROL_CLIENT_UTILS_FLAT_HASH_MAP_H_
@@ -0,0 +1,143 @@
+/* Copyright 2021 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "utils/flat_hash_map.h"
+
+#include <random>
+#include <string>
+#include <unordered_map>
+
+#include "gtest/gtest.h"
+
+namespace google {
+namespace service_control_client {
+namespace {
+
+// Puts every key in the same probe sequence.
+struct ConstantHash {
+  size_t operator()(int key) const { return 42; }
+};
+
+TEST(FlatHashMapTest, TestEmpty) {
+  FlatHashMap<int, int> map;
+  EXPECT_TRUE(map.empty());
+  EXPECT_EQ(map.size(), 0);
+  EXPECT_TRUE(map.begin() == map.end());
+  EXPECT_TRUE(map.find(1) == map.end());
+}
+
+TEST(FlatHashMapTest, TestInsertFindErase) {
+  FlatHashMap<std::string, int> map;
+  map["one"] = 1;
+  map["two"] = 2;
+  EXPECT_EQ(map.size(), 2);
+  EXPECT_EQ(map["one"], 1);
+  EXPECT_EQ(map.size(), 2);
+
+  auto it = map.find("two");
+  ASSERT_TRUE(it != map.end());
+  EXPECT_EQ(it->first, "two");
+  EXPECT_EQ(it->second, 2);
+
+  map.erase(it);
+  EXPECT_EQ(map.size(), 1);
+  EXPECT_TRUE(map.find("two") == map.end());
+  EXPECT_TRUE(map.find("one") != map.end());
+
+  map.clear();
+  EXPECT_TRUE(map.empty());
+  EXPECT_TRUE(map.find("one") == map.end());
+  EXPECT_TRUE(map.begin() == map.end());
+}
+
+TEST(FlatHashMapTest, TestIterate) {
+  FlatHashMap<int, int> map;
+  for (int i = 0; i < 1000; ++i) {
+    map[i] = i * 2;
+  }
+  std::unordered_map<int, int> seen;
+  for (FlatHashMap<int, int>::const_iterator it = map.begin(); it != map.end();
+       ++it) {
+    seen[it->first] = it->second;
+  }
+  ASSERT_EQ(seen.size(), 1000);
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_EQ(seen[i], i * 2);
+  }
+}
+
+TEST(FlatHashMapTest, TestCollidingKeys) {
+  FlatHashMap<int, int, ConstantHash> map;
+  for (int i = 0; i < 100; ++i) {
+    map[i] = i;
+  }
+  for (int i = 0; i < 100; i += 2) {
+    map.erase(map.find(i));
+  }
+  for (int i = 0; i < 100; ++i) {
+    EXPECT_EQ(map.find(i) != map.end(), i % 2 == 1) << i;
+  }
+  // Deleted slots are reused.
+  for (int i = 0; i < 100; i += 2) {
+    map[i] = i;
+  }
+  EXPECT_EQ(map.size(), 100);
+  for (int i = 0; i < 100; ++i) {
+    ASSERT_TRUE(map.find(i) != map.end()) << i;
+    EXPECT_EQ(map.find(i)->second, i);
+  }
+}
+
+TEST(FlatHashMapTest, TestMatchesUnorderedMap) {
+  FlatHashMap<int, int> map;
+  std::unordered_map<int, int> expected;
+  std::mt19937 random(1);
+  for (int i = 0; i < 100000; ++i) {
+    int key = random() % 2000;
+    if (random() % 3 == 0) {
+      auto it = map.find(key);
+      ASSERT_EQ(it != map.end(), expected.count(key) == 1) << key;
+      if (it != map.end()) {
+        map.erase(it);
+        expected.erase(key);
+      }
+    } else {
+      map[key] = i;
+      expected[key] = i;
+    }
+    ASSERT_EQ(map.size(), expected.size());
+  }
+  for (const auto& kv : expected) {
+    auto it = map.find(kv.first);
+    ASSERT_TRUE(it != map.end());
+    EXPECT_EQ(it->second, kv.second);
+  }
+}
+
+TEST(FlatHashMapTest, TestResize) {
+  FlatHashMap<int, int> map;
+  map.resize(1000);
+  for (int i = 0; i < 1000; ++i) {
+    map[i] = i;
+  }
+  EXPECT_EQ(map.size(), 1000);
+  for (int i = 0; i < 1000; ++i) {
+    EXPECT_EQ(map.find(i)->second, i);
+  }
+}
+
+}  // namespace
+}  // namespace service_control_client
+}  // namespace google
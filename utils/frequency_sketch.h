@@ -0,0 +1,118 @@
+/* Copyright 2021 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// A Count-Min sketch estimating how often keys were seen recently, used by
+// the TinyLFU admission policy of SimpleLRUCacheBase.
+//
+// Each key has one 4 bit counter in each of kDepth rows, its frequency is
+// the minimum of these counters. The counters are packed 16 to a 64 bit
+// word. After 10 * capacity increments, all the counters are halved so that
+// the sketch follows the recent popularity of the keys rather than their
+// total count.
+
+#ifndef GOOGLE_SERVICE_CONTROL_CLIENT_UTILS_FREQUENCY_SKETCH_H_
+#define GOOGLE_SERVICE_CONTROL_CLIENT_UTILS_FREQUENCY_SKETCH_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+#include "google_macros.h"
+
+namespace google {
+namespace service_control_client {
+
+class FrequencySketch {
+ public:
+  enum {
+    // Number of counters per key.
+    kDepth = 4,
+    // Largest value of a counter.
+    kMaxFrequency = 15,
+  };
+
+  // capacity is the number of keys expected to be tracked, usually the
+  // number of entries in the cache.
+  explicit FrequencySketch(int64_t capacity) : size_(0) {
+    // One word, so 4 counters per row, for each key.
+    uint64_t words = 1;
+    while (words < static_cast<uint64_t>(capacity)) words <<= 1;
+    table_.assign(words, 0);
+    mask_ = words - 1;
+    sample_size_ = 10 * std::max<int64_t>(capacity, 1);
+  }
+
+  // Records an occurrence of the key with the given hash.
+  void Increment(size_t hash) {
+    bool added = false;
+    for (int i = 0; i < kDepth; ++i) {
+      int shift;
+      uint64_t& word = table_[Locate(hash, i, &shift)];
+      if (((word >> shift) & kMaxFrequency) != kMaxFrequency) {
+        word += uint64_t{1} << shift;
+        added = true;
+      }
+    }
+    if (added && ++size_ >= sample_size_) Reset();
+  }
+
+  // Returns the estimated number of recent occurrences of the key with the
+  // given hash, at most kMaxFrequency.
+  int Frequency(size_t hash) const {
+    int frequency = kMaxFrequency;
+    for (int i = 0; i < kDepth; ++i) {
+      int shift;
+      uint64_t word = table_[Locate(hash, i, &shift)];
+      frequency = std::min(frequency,
+                           static_cast<int>((word >> shift) & kMaxFrequency));
+    }
+    return frequency;
+  }
+
+ private:
+  // Returns the index of the word holding the counter of the key in row i,
+  // and the position of the counter in the word.
+  size_t Locate(size_t hash, int i, int* shift) const {
+    static const uint64_t kSeeds[kDepth] = {
+        0xc3a5c85c97cb3127ULL, 0xb492b66fbe98f273ULL, 0x9ae16a3b2f90404fULL,
+        0xcbf29ce484222325ULL};
+    uint64_t h = (static_cast<uint64_t>(hash) + kSeeds[i]) * kSeeds[i];
+    h ^= h >> 32;
+    // Each row uses its own 4 of the 16 counters of a word.
+    *shift = static_cast<int>(((h >> 60) & 3) + 4 * i) * 4;
+    return static_cast<size_t>(h & mask_);
+  }
+
+  // Halves all the counters.
+  void Reset() {
+    for (uint64_t& word : table_) {
+      word = (word >> 1) & 0x7777777777777777ULL;
+    }
+    size_ /= 2;
+  }
+
+  std::vector<uint64_t> table_;
+  uint64_t mask_;
+  int64_t size_;
+  int64_t sample_size_;
+
+  GOOGLE_DISALLOW_EVIL_CONSTRUCTORS(FrequencySketch);
+};
+
+}  // namespace service_control_client
+}  // namespace google
+
+#endif  // GOOGLE_SERVICE_CONTROL_CLIENT_UTILS_FREQUENCY_SKETCH_H_
@@ -0,0 +1,77 @@
+/* Copyright 2021 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "utils/frequency_sketch.h"
+
+#include <functional>
+
+#include "gtest/gtest.h"
+
+namespace google {
+namespace service_control_client {
+namespace {
+
+size_t Hash(int key) { return std::hash<int>()(key); }
+
+TEST(FrequencySketchTest, TestIncrement) {
+  FrequencySketch sketch(1000);
+  EXPECT_EQ(sketch.Frequency(Hash(1)), 0);
+  for (int i = 0; i < 5; ++i) {
+    sketch.Increment(Hash(1));
+  }
+  sketch.Increment(Hash(2));
+  EXPECT_EQ(sketch.Frequency(Hash(1)), 5);
+  EXPECT_EQ(sketch.Frequency(Hash(2)), 1);
+  EXPECT_EQ(sketch.Frequency(Hash(3)), 0);
+}
+
+TEST(FrequencySketchTest, TestSaturation) {
+  FrequencySketch sketch(1000);
+  for (int i = 0; i < 100; ++i) {
+    sketch.Increment(Hash(1));
+  }
+  EXPECT_EQ(sketch.Frequency(Hash(1)), FrequencySketch::kMaxFrequency);
+}
+
+TEST(FrequencySketchTest, TestReset) {
+  // The counters are halved after 10 * 10 increments.
+  FrequencySketch sketch(10);
+  for (int i = 0; i < 8; ++i) {
+    sketch.Increment(Hash(1));
+  }
+  EXPECT_EQ(sketch.Frequency(Hash(1)), 8);
+  for (int key = 2; key < 94; ++key) {
+    sketch.Increment(Hash(key));
+  }
+  EXPECT_EQ(sketch.Frequency(Hash(1)), 4);
+}
+
+TEST(FrequencySketchTest, TestFewCollisions) {
+  FrequencySketch sketch(1000);
+  for (int key = 0; key < 1000; ++key) {
+    sketch.Increment(Hash(key));
+  }
+  int overestimated = 0;
+  for (int key = 0; key < 1000; ++key) {
+    int frequency = sketch.Frequency(Hash(key));
+    EXPECT_GE(frequency, 1);
+    if (frequency > 1) ++overestimated;
+  }
+  EXPECT_LT(overestimated, 50);
+}
+
+}  // namespace
+}  // namespace service_control_client
+}  // namespace google
@@ -0,0 +1,178 @@
+/* Copyright 2021 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "utils/hash128.h"
+#include <assert.h>
+#include <stdio.h>
+
+namespace google {
+namespace service_control_client {
+namespace {
+
+const uint64_t kC1 = 0x87c37b91114253d5ULL;
+const uint64_t kC2 = 0x4cf5ad432745937fULL;
+
+inline uint64_t Rotl64(uint64_t x, int r) { return (x << r) | (x >> (64 - r)); }
+
+inline uint64_t Fmix64(uint64_t k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+// Reads 8 bytes in little endian order.
+inline uint64_t Load64(const unsigned char* p) {
+  uint64_t v = 0;
+  for (int i = 7; i >= 0; --i) {
+    v = (v << 8) | p[i];
+  }
+  return v;
+}
+
+// Reads up to 8 bytes in little endian order.
+inline uint64_t LoadTail(const unsigned char* p, size_t size) {
+  uint64_t v = 0;
+  for (size_t i = size; i > 0; --i) {
+    v = (v << 8) | p[i - 1];
+  }
+  return v;
+}
+
+inline void Store64(uint64_t v, char* p) {
+  for (int i = 0; i < 8; ++i) {
+    p[i] = static_cast<char>(v >> (8 * i));
+  }
+}
+
+}  // namespace
+
+Hash128::Hash128()
+    : h1_(0), h2_(0), buffer_size_(0), length_(0), finalized_(false) {}
+
+void Hash128::ProcessBlock(const unsigned char* block) {
+  uint64_t k1 = Load64(block);
+  uint64_t k2 = Load64(block + 8);
+
+  k1 *= kC1;
+  k1 = Rotl64(k1, 31);
+  k1 *= kC2;
+  h1_ ^= k1;
+
+  h1_ = Rotl64(h1_, 27);
+  h1_ += h2_;
+  h1_ = h1_ * 5 + 0x52dce729;
+
+  k2 *= kC2;
+  k2 = Rotl64(k2, 33);
+  k2 *= kC1;
+  h2_ ^= k2;
+
+  h2_ = Rotl64(h2_, 31);
+  h2_ += h1_;
+  h2_ = h2_ * 5 + 0x38495ab5;
+}
+
+Hash128& Hash128::Update(const void* data, size_t size) {
+  // Not update after finalized.
+  assert(!finalized_);
+  const unsigned char* p = static_cast<const unsigned char*>(data);
+  length_ += size;
+
+  if (buffer_size_ > 0) {
+    size_t n = sizeof(buffer_) - buffer_size_;
+    if (n > size) n = size;
+    memcpy(buffer_ + buffer_size_, p, n);
+    buffer_size_ += n;
+    p += n;
+    size -= n;
+    if (buffer_size_ < sizeof(buffer_)) {
+      return *this;
+    }
+    ProcessBlock(buffer_);
+    buffer_size_ = 0;
+  }
+
+  for (; size >= sizeof(buffer_); p += sizeof(buffer_), size -= sizeof(buffer_)) {
+    ProcessBlock(p);
+  }
+
+  if (size > 0) {
+    memcpy(buffer_, p, size);
+    buffer_size_ = size;
+  }
+  return *this;
+}
+
+void Hash128::Finalize(uint64_t* low, uint64_t* high) {
+  if (!finalized_) {
+    if (buffer_size_ > 8) {
+      uint64_t k2 = LoadTail(buffer_ + 8, buffer_size_ - 8);
+      k2 *= kC2;
+      k2 = Rotl64(k2, 33);
+      k2 *= kC1;
+      h2_ ^= k2;
+    }
+    if (buffer_size_ > 0) {
+      uint64_t k1 =
+          LoadTail(buffer_, buffer_size_ > 8 ? 8 : buffer_size_);
+      k1 *= kC1;
+      k1 = Rotl64(k1, 31);
+      k1 *= kC2;
+      h1_ ^= k1;
+    }
+
+    h1_ ^= length_;
+    h2_ ^= length_;
+    h1_ += h2_;
+    h2_ += h1_;
+    h1_ = Fmix64(h1_);
+    h2_ = Fmix64(h2_);
+    h1_ += h2_;
+    h2_ += h1_;
+    finalized_ = true;
+  }
+  *low = h1_;
+  *high = h2_;
+}
+
+std::string Hash128::Digest() {
+  uint64_t low, high;
+  Finalize(&low, &high);
+  char digest[kDigestLength];
+  Store64(low, digest);
+  Store64(high, digest + 8);
+  return std::string(digest, kDigestLength);
+}
+
+std::string Hash128::DebugString(const std::string& digest) {
+  assert(digest.size() == kDigestLength);
+  char buf[kDigestLength * 2 + 1];
+  char* p = buf;
+  for (int i = 0; i < kDigestLength; i++, p += 2) {
+    sprintf(p, "%02x", (unsigned char)digest[i]);
+  }
+  *p = 0;
+  return std::string(buf, kDigestLength * 2);
+}
+
+std::string Hash128::operator()(const void* data, size_t size) {
+  return Update(data, size).Digest();
+}
+
+}  // namespace service_control_client
+}  // namespace google
@@ -0,0 +1,86 @@
+/* Copyright 2021 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#ifndef GOOGLE_SERVICE_CONTROL_CLIENT_UTILS_HASH128_H_
+#define GOOGLE_SERVICE_CONTROL_CLIENT_UTILS_HASH128_H_
+
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+namespace google {
+namespace service_control_client {
+
+// A streaming 128 bit non-cryptographic hash, MurmurHash3 x64_128 with a
+// zero seed. It is much faster than MD5 and its collision probability is
+// negligible for cache keys, but it must not be used where an adversary
+// could choose colliding inputs to gain something.
+//
+// Updates can be split at any byte boundary, the digest only depends on the
+// concatenated data.
+class Hash128 {
+ public:
+  Hash128();
+
+  // Updates the hash with data.
+  Hash128& Update(const void* data, size_t size);
+
+  // A helper function for const char*
+  Hash128& Update(const char* str) { return Update(str, strlen(str)); }
+
+  // A helper function for const string
+  Hash128& Update(const std::string& str) {
+    return Update(str.data(), str.size());
+  }
+
+  // A helper function for integers.
+  Hash128& Update(uint64_t d) { return Update(&d, sizeof(d)); }
+
+  // The digest is always 128 bits = 16 bytes
+  static const int kDigestLength = 16;
+
+  // Returns the two halves of the digest. No update is allowed after this.
+  void Finalize(uint64_t* low, uint64_t* high);
+
+  // Returns the digest as string: the low half, then the high half, each in
+  // little endian byte order.
+  std::string Digest();
+
+  // A short form of generating the digest for a string
+  std::string operator()(const void* data, size_t size);
+
+  // Converts a binary digest string to a printable string.
+  // It is for debugging and unit-test only.
+  static std::string DebugString(const std::string& digest);
+
+ private:
+  // Mixes one 16 byte block into the state.
+  void ProcessBlock(const unsigned char* block);
+
+  uint64_t h1_;
+  uint64_t h2_;
+  // Bytes not processed yet, less than one block.
+  unsigned char buffer_[16];
+  size_t buffer_size_;
+  // Total number of bytes hashed.
+  uint64_t length_;
+  // A flag to indicate if Finalize is called or not.
+  bool finalized_;
+};
+
+}  // namespace service_control_client
+}  // namespace google
+
+#endif  // GOOGLE_SERVICE_CONTROL_CLIENT_UTILS_HASH128_H_
@@ -0,0 +1,80 @@
+/* Copyright 2021 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "utils/hash128.h"
+#include "gtest/gtest.h"
+
+namespace google {
+namespace service_control_client {
+namespace {
+
+// Expected digests are from the reference MurmurHash3_x64_128 with seed 0.
+TEST(Hash128Test, TestPrintableDigest) {
+  static const char data[] = "Test Data";
+  ASSERT_EQ("12b4bcdefa12758e0d0f6f754e1eefa1",
+            Hash128::DebugString(Hash128()(data, sizeof(data))));
+  ASSERT_EQ("00000000000000000000000000000000",
+            Hash128::DebugString(Hash128()("", 0)));
+}
+
+TEST(Hash128Test, TestDigestWithTail) {
+  static const char data[] = "0123456789abcdef0123456789abcdefXYZ";
+  ASSERT_EQ("c61fe5a32f543a2695a4cabb8720c227",
+            Hash128::DebugString(Hash128()(data, strlen(data))));
+}
+
+TEST(Hash128Test, TestDigestEqual) {
+  static const char data1[] = "Test Data1";
+  static const char data2[] = "Test Data2";
+  auto d1 = Hash128()(data1, sizeof(data1));
+  auto d11 = Hash128()(data1, sizeof(data1));
+  auto d2 = Hash128()(data2, sizeof(data2));
+  ASSERT_EQ(d11, d1);
+  ASSERT_NE(d1, d2);
+}
+
+TEST(Hash128Test, TestSplitUpdates) {
+  static const char data[] = "0123456789abcdef0123456789abcdefXYZ";
+  const size_t size = strlen(data);
+  std::string expected = Hash128()(data, size);
+  for (size_t first = 0; first <= size; ++first) {
+    for (size_t second = first; second <= size; ++second) {
+      Hash128 hasher;
+      hasher.Update(data, first)
+          .Update(data + first, second - first)
+          .Update(data + second, size - second);
+      ASSERT_EQ(expected, hasher.Digest()) << first << " " << second;
+    }
+  }
+}
+
+TEST(Hash128Test, TestFinalizeMatchesDigest) {
+  Hash128 hasher;
+  hasher.Update("some data");
+  std::string digest = hasher.Digest();
+  uint64_t low, high;
+  hasher.Finalize(&low, &high);
+  std::string halves;
+  for (uint64_t half : {low, high}) {
+    for (int i = 0; i < 8; ++i) {
+      halves.push_back(static_cast<char>(half >> (8 * i)));
+    }
+  }
+  ASSERT_EQ(digest, halves);
+}
+
+}  // namespace
+}  // namespace service_control_client
+}  // namespace google
@@ -25,6 +25,8 @@ limitations under the License.
 namespace google {
 namespace service_control_client {
 
+struct NewDeleteAllocator;
+
 namespace internal {
 template <typename T>
 struct SimpleLRUHash : public std::hash<T> {};
@@ -39,11 +41,22 @@ class SimpleLRUCache;
 // contains a public method:
 //  operator() (Value* value)
 // See example in the associated unittest.
+// Allocator selects how the cache entries are allocated, see
+// slab_allocator.h.
 template <typename Key, typename Value, typename Deleter,
           typename H = internal::SimpleLRUHash<Key>,
-          typename EQ = std::equal_to<Key> >
+          typename EQ = std::equal_to<Key>,
+          typename Allocator = NewDeleteAllocator>
 class SimpleLRUCacheWithDeleter;
 
+// Same as SimpleLRUCacheWithDeleter, but the entries are indexed by a
+// FlatHashMap instead of a std::unordered_map. See flat_hash_map.h.
+template <typename Key, typename Value, typename Deleter,
+          typename H = internal::SimpleLRUHash<Key>,
+          typename EQ = std::equal_to<Key>,
+          typename Allocator = NewDeleteAllocator>
+class SimpleFlatLRUCacheWithDeleter;
+
 }  // namespace service_control_client
 }  // namespace google
 
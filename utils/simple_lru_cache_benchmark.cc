@@ -0,0 +1,185 @@
+/* Copyright 2021 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Benchmarks for SimpleLRUCache lookups and evictions, and for expiration as
+// run by the periodic flush of the report and quota caches.
+//
+// Run with:
+//   bazel run -c opt :simple_lru_cache_benchmark
+//
+// Arguments:
+//   entries:  entries in the cache.
+//   expired:  entries that expired before RemoveExpiredEntries() is called.
+//   flat:     1 to index the entries with FlatHashMap, 0 for
+//             std::unordered_map.
+//   slab:     1 to allocate the entries and values with SlabAllocator, 0 for
+//             new and delete.
+
+#include <unistd.h>
+
+#include <functional>
+#include <vector>
+
+#include "benchmark/benchmark.h"
+#include "utils/simple_lru_cache.h"
+#include "utils/simple_lru_cache_inl.h"
+#include "utils/slab_allocator.h"
+
+namespace google {
+namespace service_control_client {
+namespace {
+
+typedef SimpleLRUCache<int, int> Cache;
+
+typedef std::function<void(int*)> Deleter;
+
+// Keys shaped like the 16 byte signatures of the aggregation caches.
+struct Key {
+  uint64_t low;
+  uint64_t high;
+  bool operator==(const Key& other) const {
+    return low == other.low && high == other.high;
+  }
+};
+
+struct KeyHash {
+  size_t operator()(const Key& key) const { return key.low; }
+};
+
+std::vector<Key> CreateKeys(int count) {
+  std::vector<Key> keys;
+  uint64_t x = 1;
+  for (int i = 0; i < count; ++i) {
+    // xorshift64, spreads the keys like a real hash.
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    keys.push_back(Key{x, x * 31});
+  }
+  return keys;
+}
+
+// Looks up cached keys in a full LRU cache, as the check cache does for
+// every request.
+template <class CacheType>
+void LookupLoop(::benchmark::State& state) {
+  const int entries = static_cast<int>(state.range(0));
+  std::vector<Key> keys = CreateKeys(entries);
+  CacheType cache(entries, [](int* value) { delete value; });
+  for (int i = 0; i < entries; ++i) {
+    cache.Insert(keys[i], new int(i), 1);
+  }
+
+  // Walks the keys in a scrambled order.
+  size_t index = 0;
+  for (auto _ : state) {
+    typename CacheType::ScopedLookup lookup(&cache, keys[index]);
+    ::benchmark::DoNotOptimize(lookup.value());
+    index = (index + 7919) % keys.size();
+  }
+  cache.Clear();
+  state.SetItemsProcessed(state.iterations());
+}
+
+void BM_Lookup(::benchmark::State& state) {
+  if (state.range(1)) {
+    LookupLoop<SimpleFlatLRUCacheWithDeleter<Key, int, Deleter, KeyHash>>(
+        state);
+  } else {
+    LookupLoop<SimpleLRUCacheWithDeleter<Key, int, Deleter, KeyHash>>(state);
+  }
+}
+
+// Inserts new keys into a full cache, each one evicting the least recently
+// used entry, as the check cache does under a stream of distinct requests.
+template <class CacheType>
+void ChurnLoop(::benchmark::State& state) {
+  const int entries = static_cast<int>(state.range(0));
+  std::vector<Key> keys = CreateKeys(entries * 2);
+  CacheType cache(entries, [&cache](int* value) {
+    cache.value_pool().Delete(value);
+  });
+
+  size_t index = 0;
+  for (auto _ : state) {
+    cache.Insert(keys[index], cache.value_pool().New(1), 1);
+    index = (index + 1) % keys.size();
+  }
+  cache.Clear();
+  state.SetItemsProcessed(state.iterations());
+}
+
+void BM_InsertEvict(::benchmark::State& state) {
+  if (state.range(1)) {
+    ChurnLoop<SimpleFlatLRUCacheWithDeleter<Key, int, Deleter, KeyHash,
+                                            std::equal_to<Key>,
+                                            SlabAllocator>>(state);
+  } else {
+    ChurnLoop<SimpleFlatLRUCacheWithDeleter<Key, int, Deleter, KeyHash>>(
+        state);
+  }
+}
+
+// Age of the expired entries, in seconds.
+const double kAgeSeconds = 0.2;
+
+// Blocks until the entries inserted so far are older than kAgeSeconds.
+void WaitForExpiration() {
+  usleep(static_cast<useconds_t>(kAgeSeconds * 1000000) + 1000);
+}
+
+// Measures RemoveExpiredEntries() on an age-based cache. Only the removal is
+// timed, the cache is refilled between iterations. Since the eviction list is
+// ordered by age, the cost depends on expired only, not on entries.
+void BM_RemoveExpiredEntries(::benchmark::State& state) {
+  const int entries = static_cast<int>(state.range(0));
+  const int expired = static_cast<int>(state.range(1));
+  Cache cache(entries);
+  cache.SetAgeBasedEviction(kAgeSeconds);
+
+  for (auto _ : state) {
+    state.PauseTiming();
+    cache.Clear();
+    for (int i = 0; i < expired; ++i) {
+      cache.Insert(i, new int(i), 1);
+    }
+    WaitForExpiration();
+    for (int i = expired; i < entries; ++i) {
+      cache.Insert(i, new int(i), 1);
+    }
+    state.ResumeTiming();
+
+    cache.RemoveExpiredEntries();
+  }
+  cache.Clear();
+  state.SetItemsProcessed(state.iterations() * expired);
+}
+
+BENCHMARK(BM_Lookup)
+    ->ArgNames({"entries", "flat"})
+    ->ArgsProduct({{1000, 10000, 1000000}, {0, 1}});
+BENCHMARK(BM_InsertEvict)
+    ->ArgNames({"entries", "slab"})
+    ->ArgsProduct({{1000, 100000}, {0, 1}});
+BENCHMARK(BM_RemoveExpiredEntries)
+    ->ArgNames({"entries", "expired"})
+    ->ArgsProduct({{1000, 100000}, {0, 10, 1000}})
+    ->Iterations(10);
+
+}  // namespace
+}  // namespace service_control_client
+}  // namespace google
+
+BENCHMARK_MAIN();
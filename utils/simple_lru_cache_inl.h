@@ -41,22 +41,31 @@ limitations under the License.
 //
 // . We also provide support for a strict age-based eviction policy
 //   instead of LRU.  See SetAgeBasedEviction().
+//
+// . Either policy can be combined with W-TinyLFU admission, which keeps
+//   frequently used entries when the cache is full.  See
+//   EnableTinyLfuAdmission().
 
 #ifndef GOOGLE_SERVICE_CONTROL_CLIENT_UTILS_SIMPLE_LRU_CACHE_INL_H_
 #define GOOGLE_SERVICE_CONTROL_CLIENT_UTILS_SIMPLE_LRU_CACHE_INL_H_
 
 #include <stddef.h>
 #include <sys/time.h>
+#include <algorithm>
 #include <cassert>
 #include <cmath>
 #include <limits>
+#include <memory>
 #include <sstream>
 #include <string>
 #include <unordered_map>
 #include <utility>
 
+#include "flat_hash_map.h"
+#include "frequency_sketch.h"
 #include "google_macros.h"
 #include "simple_lru_cache.h"
+#include "slab_allocator.h"
 
 namespace google {
 namespace service_control_client {
@@ -160,6 +169,9 @@ struct SimpleLRUCacheElem {
   SimpleLRUCacheElem* prev = nullptr;  // Prev entry in LRU chain
   int64_t last_use_;                   // Timestamp of last use (in LRU mode)
   //     or creation (in age-based mode)
+  // Chain of the admission window, see EnableTinyLfuAdmission().
+  SimpleLRUCacheElem* window_next = nullptr;
+  SimpleLRUCacheElem* window_prev = nullptr;
 
   SimpleLRUCacheElem(const Key& k, Value* v, int p, size_t u, int64_t last_use)
       : key(k), value(v), pin(p), units(u), last_use_(last_use) {}
@@ -186,6 +198,23 @@ struct SimpleLRUCacheElem {
     next->prev = this;  // i.e. head->next->prev = this;
     prev->next = this;  // i.e. head->next = this;
   }
+
+  bool InWindow() const { return window_next != nullptr; }
+
+  void UnlinkWindow() {
+    if (!InWindow()) return;
+    window_prev->window_next = window_next;
+    window_next->window_prev = window_prev;
+    window_prev = nullptr;
+    window_next = nullptr;
+  }
+
+  void LinkWindow(SimpleLRUCacheElem* head) {
+    window_next = head->window_next;
+    window_prev = head;
+    window_next->window_prev = this;
+    window_prev->window_next = this;
+  }
   static const int64_t kNeverUsed = -1;
 };
 
@@ -298,6 +327,15 @@ class SimpleLRUCacheBase {
   // If necessary, entries will be evicted to comply with the new size.
   void SetMaxSize(int64_t total_units) {
     max_units_ = total_units;
+    SetWindowSize();
+    GarbageCollect();
+  }
+
+  // Change the maximum number of entries, in addition to the maximum size.
+  // Useful when the units are bytes. A negative number, the default, sets no
+  // limit.
+  void SetMaxEntries(int64_t entries) {
+    max_entries_ = entries;
     GarbageCollect();
   }
 
@@ -318,6 +356,23 @@ class SimpleLRUCacheBase {
     SetTimeout(seconds, false /* lru */);
   }
 
+  // Use the W-TinyLFU admission policy instead of plain LRU eviction. Must be
+  // called while the cache is empty, after SetMaxEntries() if the units are
+  // not entries.
+  //
+  // New entries go to a small window holding about 1% of the units. An entry
+  // pushed out of the window only stays in the cache if its key was looked
+  // up more often than the key of the entry it would evict, according to a
+  // frequency sketch of the recent lookups. A burst of keys seen only once
+  // then cycles through the window instead of evicting the frequently used
+  // entries.
+  void EnableTinyLfuAdmission() {
+    assert(table_.size() == 0);
+    sketch_.reset(
+        new FrequencySketch(max_entries_ >= 0 ? max_entries_ : max_units_));
+    SetWindowSize();
+  }
+
   // If cache contains an entry for "k", return a pointer to it.
   // Else return nullptr.
   //
@@ -333,6 +388,18 @@ class SimpleLRUCacheBase {
   // the SimpleLRUCacheOptions object for more information.
   Value* LookupWithOptions(const Key& k, const SimpleLRUCacheOptions& options);
 
+  // If cache contains an entry for "k", return a pointer to it without
+  // pinning it, updating the eviction order or removing expired entries.
+  // Else return nullptr.
+  //
+  // Peek() does not modify the cache, so several threads may call it
+  // concurrently under a reader lock. The value must not be used after the
+  // lock is released, since any other call may evict it.
+  Value* Peek(const Key& k) const {
+    TableConstIterator iter = table_.find(k);
+    return iter != table_.end() ? iter->second->value : nullptr;
+  }
+
   // Removes the pinning done by an earlier "Lookup".  After this call,
   // the caller should no longer depend on the value sticking around.
   //
@@ -408,6 +475,9 @@ class SimpleLRUCacheBase {
 
   // Remove all entries which have exceeded their max idle time or age
   // set using SetMaxIdleSeconds() or SetAgeBasedEviction() respectively.
+  // The eviction list is ordered by last use (or insertion) time, so this
+  // stops at the first entry that has not expired: removing K expired
+  // entries costs O(K), regardless of the cache size.
   void RemoveExpiredEntries() {
     if (max_idle_ >= 0) DiscardIdle(max_idle_);
   }
@@ -431,6 +501,9 @@ class SimpleLRUCacheBase {
   // Return maximum size of cache
   int64_t MaxSize() const { return max_units_; }
 
+  // Return maximum number of entries, -1 if not limited
+  int64_t MaxEntries() const { return max_entries_; }
+
   // Return the age (in microseconds) of the least recently used element in
   // the cache.  If the cache is empty, zero (0) is returned.
   int64_t AgeOfLRUItemInMicroseconds() const;
@@ -497,6 +570,16 @@ class SimpleLRUCacheBase {
   // so we implement it in the derived SimpleLRUCache.
   virtual void RemoveElement(const Key& k, Value* value) = 0;
 
+  typedef SimpleLRUCacheElem<Key, Value> Elem;
+
+  // Override these operations to allocate the entries from a pool, see
+  // SimpleLRUCacheWithDeleter.
+  virtual Elem* NewElem(const Key& k, Value* value, size_t units,
+                        int64_t now) {
+    return new Elem(k, value, 1, units, now);
+  }
+  virtual void DeleteElem(Elem* e) { delete e; }
+
   virtual void DebugIterator(const Key& k, const Value* value, int pin_count,
                              int64_t last_timestamp, bool is_deferred,
                              std::string* output) const {
@@ -519,7 +602,6 @@ class SimpleLRUCacheBase {
   virtual bool IsOverfull() const { return units_ > max_units_; }
 
  private:
-  typedef SimpleLRUCacheElem<Key, Value> Elem;
   typedef MapType Table;
   typedef typename Table::iterator TableIterator;
   typedef typename Table::const_iterator TableConstIterator;
@@ -535,22 +617,32 @@ class SimpleLRUCacheBase {
   DeferredTable defer_;
   int64_t units_;         // Combined units of all elements
   int64_t max_units_;     // Max allowed units
+  int64_t max_entries_;   // Max allowed entries, -1 for no limit
   int64_t pinned_units_;  // Combined units of all pinned elements
   Elem head_;             // Dummy head of LRU list (next is mru elem)
   int64_t max_idle_;      // Maximum number of idle cycles
   bool lru_;              // LRU or age-based eviction?
 
+  // TinyLFU admission, sketch_ is nullptr unless enabled.
+  std::unique_ptr<FrequencySketch> sketch_;
+  typename MapType::hasher hasher_;
+  Elem window_head_;            // Dummy head of the admission window
+  int64_t window_units_;        // Combined units of the window elements
+  int64_t window_max_units_;    // Max units of the window
+
   // Representation invariants:
   // . LRU list is circular doubly-linked list
   // . Each live "Elem" is either in "table_" or "defer_"
   // . LRU list contains elements in "table_" that can be removed to free space
   // . Each "Elem" in "defer_" has a non-zero pin count
+  // . Window list contains the elements in "table_" admitted to the window,
+  //   pinned or not, in LRU (or age-based) order
 
   void Discard(Elem* e) {
     assert(e->pin == 0);
     units_ -= e->units;
     RemoveElement(e->key, e->value);
-    delete e;
+    DeleteElem(e);
   }
 
   // Count the number and total size of the elements in the deferred table.
@@ -561,13 +653,34 @@ class SimpleLRUCacheBase {
   bool InDeferredTable(const Key& k, const Value* value) const;
 
   void GarbageCollect();               // Discard to meet space constraints
+  void AdmitFromWindow();              // Move window overflow to main cache
   void DiscardIdle(int64_t max_idle);  // Discard to meet idle-time constraints
 
   void SetTimeout(double seconds, bool lru);
 
   bool IsOverfullInternal() const {
-    return ((units_ > max_units_) || IsOverfull());
+    return ((units_ > max_units_) ||
+            (max_entries_ >= 0 &&
+             static_cast<int64_t>(table_.size()) > max_entries_) ||
+            IsOverfull());
+  }
+
+  void SetWindowSize() {
+    window_max_units_ = std::max<int64_t>(1, max_units_ / 100);
+  }
+
+  void LeaveWindow(Elem* e) {
+    if (!e->InWindow()) return;
+    e->UnlinkWindow();
+    window_units_ -= e->units;
   }
+
+  int Frequency(const Elem* e) const {
+    return sketch_->Frequency(hasher_(e->key));
+  }
+
+  // Removes an unpinned element from the table and discards it.
+  void Evict(Elem* e);
   void Remove(Elem* e);
 
  public:
@@ -580,12 +693,18 @@ class SimpleLRUCacheBase {
 template <class Key, class Value, class MapType, class EQ>
 SimpleLRUCacheBase<Key, Value, MapType, EQ>::SimpleLRUCacheBase(
     int64_t total_units)
-    : head_(Key(), nullptr, 0, 0, Elem::kNeverUsed) {
+    : head_(Key(), nullptr, 0, 0, Elem::kNeverUsed),
+      window_head_(Key(), nullptr, 0, 0, Elem::kNeverUsed) {
   units_ = 0;
   pinned_units_ = 0;
   max_units_ = total_units;
+  max_entries_ = -1;
   head_.next = &head_;
   head_.prev = &head_;
+  window_head_.window_next = &window_head_;
+  window_head_.window_prev = &window_head_;
+  window_units_ = 0;
+  SetWindowSize();
   max_idle_ = -1;  // Stands for "no expiration"
   lru_ = true;     // default to LRU, not age-based
 }
@@ -665,14 +784,18 @@ void SimpleLRUCacheBase<Key, Value, MapType, EQ>::Clear() {
   table_.clear();
   head_.next = &head_;
   head_.prev = &head_;
+  window_head_.window_next = &window_head_;
+  window_head_.window_prev = &window_head_;
   units_ = 0;
   pinned_units_ = 0;
+  window_units_ = 0;
 }
 
 template <class Key, class Value, class MapType, class EQ>
 Value* SimpleLRUCacheBase<Key, Value, MapType, EQ>::LookupWithOptions(
     const Key& k, const SimpleLRUCacheOptions& options) {
   RemoveExpiredEntries();
+  if (sketch_ != nullptr) sketch_->Increment(hasher_(k));
 
   TableIterator iter = table_.find(k);
   if (iter != table_.end()) {
@@ -736,6 +859,10 @@ void SimpleLRUCacheBase<Key, Value, MapType, EQ>::ReleaseWithOptions(
       e->last_use_ = SimpleCycleTimer::Now();
     }
     e->pin--;
+    if (e->InWindow() && lru_ && options.update_eviction_order()) {
+      e->UnlinkWindow();
+      e->LinkWindow(&window_head_);
+    }
 
     if (e->pin == 0) {
       if (lru_ && options.update_eviction_order()) e->Link(&head_);
@@ -756,7 +883,7 @@ void SimpleLRUCacheBase<Key, Value, MapType, EQ>::InsertPinned(const Key& k,
   Remove(k);
 
   // Make new element
-  Elem* e = new Elem(k, value, 1, units, SimpleCycleTimer::Now());
+  Elem* e = NewElem(k, value, units, SimpleCycleTimer::Now());
 
   // Adjust table, total units fields.
   units_ += units;
@@ -767,6 +894,10 @@ void SimpleLRUCacheBase<Key, Value, MapType, EQ>::InsertPinned(const Key& k,
   // list now and is never removed. In the LRU mode, the list will only contain
   // unpinned entries.
   if (!lru_) e->Link(&head_);
+  if (sketch_ != nullptr) {
+    e->LinkWindow(&window_head_);
+    window_units_ += units;
+  }
   GarbageCollect();
 }
 
@@ -782,11 +913,17 @@ void SimpleLRUCacheBase<Key, Value, MapType, EQ>::UpdateSize(const Key& k,
     if (e->pin > 0) {
       pinned_units_ -= e->units;
     }
+    if (e->InWindow()) {
+      window_units_ -= e->units;
+    }
     e->units = units;
     units_ += e->units;
     if (e->pin > 0) {
       pinned_units_ += e->units;
     }
+    if (e->InWindow()) {
+      window_units_ += e->units;
+    }
   } else {
     const DeferredTableIterator iter = defer_.find(k);
     if (iter != defer_.end()) {
@@ -847,6 +984,7 @@ void SimpleLRUCacheBase<Key, Value, MapType, EQ>::Remove(Elem* e) {
   // Unlink e whether it is in the LRU or the deferred list. It is safe to call
   // Unlink() if it is not in either list.
   e->Unlink();
+  LeaveWindow(e);
   if (e->pin > 0) {
     pinned_units_ -= e->units;
 
@@ -868,22 +1006,65 @@ void SimpleLRUCacheBase<Key, Value, MapType, EQ>::Remove(Elem* e) {
 
 template <class Key, class Value, class MapType, class EQ>
 void SimpleLRUCacheBase<Key, Value, MapType, EQ>::GarbageCollect() {
+  if (sketch_ != nullptr) AdmitFromWindow();
+
   Elem* e = head_.prev;
   while (IsOverfullInternal() && (e != &head_)) {
     Elem* prev = e->prev;
     if (e->pin == 0) {
-      // Erase from hash-table
-      TableIterator iter = table_.find(e->key);
-      assert(iter != table_.end());
-      assert(iter->second == e);
-      table_.erase(iter);
-      e->Unlink();
-      Discard(e);
+      Evict(e);
     }
     e = prev;
   }
 }
 
+template <class Key, class Value, class MapType, class EQ>
+void SimpleLRUCacheBase<Key, Value, MapType, EQ>::Evict(Elem* e) {
+  assert(e->pin == 0);
+  // Erase from hash-table
+  TableIterator iter = table_.find(e->key);
+  assert(iter != table_.end());
+  assert(iter->second == e);
+  table_.erase(iter);
+  e->Unlink();
+  LeaveWindow(e);
+  Discard(e);
+}
+
+// While the window is too big, its least recently used element, the
+// candidate, moves to the main cache. If the cache is then overfull, the
+// candidate and the least recently used element of the main cache, the
+// victim, compete: the one whose key is less frequent is evicted. On a tie
+// the victim stays, since it has been in the cache longer.
+//
+// The elements keep their place in the LRU list, which stays ordered by
+// last use (or insertion) time for DiscardIdle().
+template <class Key, class Value, class MapType, class EQ>
+void SimpleLRUCacheBase<Key, Value, MapType, EQ>::AdmitFromWindow() {
+  Elem* candidate = window_head_.window_prev;
+  while (window_units_ > window_max_units_ && candidate != &window_head_) {
+    if (candidate->pin > 0) {
+      // Pinned elements cannot be evicted, leave them in the window.
+      candidate = candidate->window_prev;
+      continue;
+    }
+    LeaveWindow(candidate);
+
+    if (IsOverfullInternal()) {
+      Elem* victim = head_.prev;
+      while (victim != &head_ &&
+             (victim->pin > 0 || victim->InWindow() || victim == candidate)) {
+        victim = victim->prev;
+      }
+      if (victim != &head_) {
+        Evict(Frequency(candidate) > Frequency(victim) ? victim : candidate);
+      }
+    }
+    // Evict() may run RemoveElement(), which may change the window.
+    candidate = window_head_.window_prev;
+  }
+}
+
 // Not using cycle. Instead using second from time()
 static const int kAcceptableClockSynchronizationDriftCycles = 1;
 
@@ -1060,7 +1241,11 @@ class SimpleLRUCache
   GOOGLE_DISALLOW_EVIL_CONSTRUCTORS(SimpleLRUCache);
 };
 
-template <class Key, class Value, class Deleter, class H, class EQ>
+// The Allocator (see slab_allocator.h) allocates the cache entries. Its
+// value pool can also be used by the caller to allocate the values, which
+// the deleter then returns to it.
+template <class Key, class Value, class Deleter, class H, class EQ,
+          class Allocator>
 class SimpleLRUCacheWithDeleter
     : public SimpleLRUCacheBase<
           Key, Value,
@@ -1068,22 +1253,72 @@ class SimpleLRUCacheWithDeleter
   typedef std::unordered_map<Key, SimpleLRUCacheElem<Key, Value>*, H, EQ>
       HashMap;
   typedef SimpleLRUCacheBase<Key, Value, HashMap, EQ> Base;
+  typedef typename Base::Elem Elem;
 
  public:
+  typedef typename Allocator::template Pool<Value> ValuePool;
+
   explicit SimpleLRUCacheWithDeleter(int64_t total_units)
       : Base(total_units), deleter_() {}
 
   SimpleLRUCacheWithDeleter(int64_t total_units, Deleter deleter)
       : Base(total_units), deleter_(deleter) {}
 
+  ValuePool& value_pool() { return value_pool_; }
+
  protected:
   virtual void RemoveElement(const Key& k, Value* value) { deleter_(value); }
 
+  virtual Elem* NewElem(const Key& k, Value* value, size_t units,
+                        int64_t now) {
+    return elem_pool_.New(k, value, 1, units, now);
+  }
+  virtual void DeleteElem(Elem* e) { elem_pool_.Delete(e); }
+
  private:
   Deleter deleter_;
+  typename Allocator::template Pool<Elem> elem_pool_;
+  ValuePool value_pool_;
   GOOGLE_DISALLOW_EVIL_CONSTRUCTORS(SimpleLRUCacheWithDeleter);
 };
 
+template <class Key, class Value, class Deleter, class H, class EQ,
+          class Allocator>
+class SimpleFlatLRUCacheWithDeleter
+    : public SimpleLRUCacheBase<
+          Key, Value,
+          FlatHashMap<Key, SimpleLRUCacheElem<Key, Value>*, H, EQ>, EQ> {
+  typedef FlatHashMap<Key, SimpleLRUCacheElem<Key, Value>*, H, EQ> HashMap;
+  typedef SimpleLRUCacheBase<Key, Value, HashMap, EQ> Base;
+  typedef typename Base::Elem Elem;
+
+ public:
+  typedef typename Allocator::template Pool<Value> ValuePool;
+
+  explicit SimpleFlatLRUCacheWithDeleter(int64_t total_units)
+      : Base(total_units), deleter_() {}
+
+  SimpleFlatLRUCacheWithDeleter(int64_t total_units, Deleter deleter)
+      : Base(total_units), deleter_(deleter) {}
+
+  ValuePool& value_pool() { return value_pool_; }
+
+ protected:
+  virtual void RemoveElement(const Key& k, Value* value) { deleter_(value); }
+
+  virtual Elem* NewElem(const Key& k, Value* value, size_t units,
+                        int64_t now) {
+    return elem_pool_.New(k, value, 1, units, now);
+  }
+  virtual void DeleteElem(Elem* e) { elem_pool_.Delete(e); }
+
+ private:
+  Deleter deleter_;
+  typename Allocator::template Pool<Elem> elem_pool_;
+  ValuePool value_pool_;
+  GOOGLE_DISALLOW_EVIL_CONSTRUCTORS(SimpleFlatLRUCacheWithDeleter);
+};
+
 }  // namespace service_control_client
 }  // namespace google
 
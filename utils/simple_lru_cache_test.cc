@@ -68,9 +68,22 @@ struct TestValue {
   // Make sure that TestCache can delete TestValue when declared as friend.
   friend class SimpleLRUCache<int, TestValue>;
   friend class TestCache;
+  friend struct TestValueDeleter;
   ~TestValue() {}
 };
 
+// Deleter of the SimpleFlatLRUCacheWithDeleter tests.
+struct TestValueDeleter {
+  void operator()(TestValue* v) {
+    assert(in_cache[v->label]);
+    in_cache[v->label] = false;
+    delete v;
+  }
+};
+
+typedef SimpleFlatLRUCacheWithDeleter<int, TestValue, TestValueDeleter>
+    FlatTestCache;
+
 class TestCache : public SimpleLRUCache<int, TestValue> {
  public:
   explicit TestCache(int64_t size, bool check_in_cache = true)
@@ -1108,5 +1121,187 @@ TEST_F(SimpleLRUCacheTest, LookupWithoutEvictionOrderUpdateAndRemove) {
   EXPECT_THAT(TestCache::ScopedLookup(cache_.get(), 2).value(), NotNull());
 }
 
+TEST_F(SimpleLRUCacheTest, FlatMapInOrderEvictions) {
+  FlatTestCache cache(kCacheSize);
+  for (int i = 0; i < kElems; i++) {
+    ASSERT_TRUE(!cache.Lookup(i));
+    in_cache[i] = true;
+    cache.Insert(i, new TestValue(i), 1);
+    if (i >= kCacheSize) {
+      ASSERT_TRUE(!in_cache[i - kCacheSize]);
+    }
+  }
+  int count = 0;
+  for (FlatTestCache::const_iterator pos = cache.begin(); pos != cache.end();
+       ++pos) {
+    ++count;
+    ASSERT_EQ(pos->first, pos->second->label);
+    ASSERT_TRUE(in_cache[pos->first]);
+  }
+  ASSERT_EQ(count, kCacheSize);
+  cache.Clear();
+}
+
+TEST_F(SimpleLRUCacheTest, FlatMapRemovePinned) {
+  FlatTestCache cache(kCacheSize);
+  for (int i = 0; i < kCacheSize; i++) {
+    in_cache[i] = true;
+    cache.Insert(i, new TestValue(i), 1);
+  }
+  // A pinned element goes to the deferred table until it is released.
+  TestValue* const v = cache.Lookup(1);
+  ASSERT_TRUE(v);
+  cache.Remove(1);
+  ASSERT_EQ(cache.Entries(), kCacheSize - 1);
+  ASSERT_EQ(cache.DeferredEntries(), 1);
+  ASSERT_TRUE(cache.StillInUse(1, v));
+  ASSERT_TRUE(in_cache[1]);
+  cache.Release(1, v);
+  ASSERT_EQ(cache.DeferredEntries(), 0);
+  ASSERT_TRUE(!in_cache[1]);
+
+  cache.RemoveUnpinned();
+  ASSERT_EQ(cache.Entries(), 0);
+  cache.Clear();
+}
+
+TEST_F(SimpleLRUCacheTest, FlatMapExpiration) {
+  FlatTestCache cache(kCacheSize);
+  cache.SetAgeBasedEviction(0.2);
+  for (int i = 0; i < kCacheSize / 2; i++) {
+    in_cache[i] = true;
+    cache.Insert(i, new TestValue(i), 1);
+  }
+  usleep(300000);
+  for (int i = kCacheSize / 2; i < kCacheSize; i++) {
+    in_cache[i] = true;
+    cache.Insert(i, new TestValue(i), 1);
+  }
+  cache.RemoveExpiredEntries();
+  ASSERT_EQ(cache.Entries(), kCacheSize - kCacheSize / 2);
+  for (int i = 0; i < kCacheSize; i++) {
+    ASSERT_EQ(in_cache[i], i >= kCacheSize / 2) << i;
+  }
+  cache.Clear();
+}
+
+// Looks up a key, inserting it on a miss as the aggregators do. Returns
+// whether the key was found.
+template <class CacheType>
+static bool LookupOrInsert(CacheType* cache, int key) {
+  typename CacheType::ScopedLookup lookup(cache, key);
+  if (lookup.Found()) return true;
+  cache->Insert(key, new int(key), 1);
+  return false;
+}
+
+// Looks up hot keys, interleaved with a scan of 4 times as many keys seen
+// only once. Returns the percentage of the hot lookups that hit.
+template <class CacheType>
+static int HotHitPercentDuringScan(CacheType* cache, int hot_keys) {
+  for (int round = 0; round < 5; ++round) {
+    for (int i = 0; i < hot_keys; ++i) LookupOrInsert(cache, i);
+  }
+  int hits = 0;
+  const int lookups = 10 * hot_keys;
+  int scan_key = hot_keys;
+  for (int i = 0; i < lookups; ++i) {
+    if (LookupOrInsert(cache, i % hot_keys)) ++hits;
+    for (int j = 0; j < 4; ++j) LookupOrInsert(cache, scan_key++);
+  }
+  return 100 * hits / lookups;
+}
+
+typedef SimpleFlatLRUCacheWithDeleter<int, int, std::default_delete<int>>
+    IntCache;
+
+TEST_F(SimpleLRUCacheTest, MaxEntries) {
+  // The units are bytes, the entries are limited separately.
+  IntCache cache(1000);
+  cache.SetMaxEntries(3);
+  EXPECT_EQ(cache.MaxEntries(), 3);
+  for (int i = 0; i < 5; ++i) {
+    cache.Insert(i, new int(i), 10);
+  }
+  EXPECT_EQ(cache.Entries(), 3);
+  EXPECT_EQ(cache.Size(), 30);
+  EXPECT_FALSE(cache.StillInUse(1));
+  EXPECT_TRUE(cache.StillInUse(2));
+
+  // The size limit still applies.
+  cache.Insert(5, new int(5), 990);
+  EXPECT_EQ(cache.Entries(), 2);
+  EXPECT_EQ(cache.Size(), 1000);
+  cache.Clear();
+}
+
+TEST_F(SimpleLRUCacheTest, TinyLfuScanResistance) {
+  IntCache lru(1000);
+  EXPECT_LT(HotHitPercentDuringScan(&lru, 500), 10);
+  lru.Clear();
+
+  IntCache tinylfu(1000);
+  tinylfu.EnableTinyLfuAdmission();
+  EXPECT_GT(HotHitPercentDuringScan(&tinylfu, 500), 90);
+  EXPECT_EQ(tinylfu.Entries(), 1000);
+  tinylfu.Clear();
+}
+
+TEST_F(SimpleLRUCacheTest, TinyLfuAdmitsFrequentKeys) {
+  IntCache cache(100);
+  cache.EnableTinyLfuAdmission();
+  for (int round = 0; round < 2; ++round) {
+    for (int i = 0; i < 100; ++i) LookupOrInsert(&cache, i);
+  }
+
+  // A new key looked up more often than the cached ones replaces one of them.
+  for (int round = 0; round < 10; ++round) LookupOrInsert(&cache, -1);
+  cache.Insert(-2, new int(-2), 1);
+  EXPECT_TRUE(cache.StillInUse(-1));
+  EXPECT_EQ(cache.Entries(), 100);
+  cache.Clear();
+}
+
+TEST_F(SimpleLRUCacheTest, TinyLfuWithRemoveAndUpdateSize) {
+  IntCache cache(10);
+  cache.EnableTinyLfuAdmission();
+  for (int i = 0; i < 20; ++i) {
+    cache.Insert(i, new int(i), 1);
+  }
+  EXPECT_EQ(cache.Entries(), 10);
+  for (int i = 0; i < 20; ++i) {
+    cache.Remove(i);
+  }
+  EXPECT_EQ(cache.Entries(), 0);
+  EXPECT_EQ(cache.Size(), 0);
+
+  cache.Insert(1, new int(1), 1);
+  cache.UpdateSize(1, nullptr, 5);
+  EXPECT_EQ(cache.Size(), 5);
+  cache.RemoveAll();
+  EXPECT_EQ(cache.Size(), 0);
+}
+
+TEST_F(SimpleLRUCacheTest, TinyLfuExpiration) {
+  FlatTestCache cache(kCacheSize);
+  cache.EnableTinyLfuAdmission();
+  cache.SetAgeBasedEviction(0.2);
+  for (int i = 0; i < kCacheSize / 2; i++) {
+    in_cache[i] = true;
+    cache.Insert(i, new TestValue(i), 1);
+  }
+  usleep(300000);
+  for (int i = kCacheSize / 2; i < kCacheSize; i++) {
+    in_cache[i] = true;
+    cache.Insert(i, new TestValue(i), 1);
+  }
+  cache.RemoveExpiredEntries();
+  ASSERT_EQ(cache.Entries(), kCacheSize - kCacheSize / 2);
+  for (int i = 0; i < kCacheSize; i++) {
+    ASSERT_EQ(in_cache[i], i >= kCacheSize / 2) << i;
+  }
+  cache.Clear();
+}
+
 }  // namespace service_control_client
 }  // namespace google
@@ -0,0 +1,137 @@
+/* Copyright 2021 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+// Object pools for the cache entries, selected by the Allocator template
+// parameter of the caches in simple_lru_cache_inl.h.
+//
+// . NewDeleteAllocator allocates each object with new and delete.
+//
+// . SlabAllocator carves the objects out of slabs, and keeps the freed ones
+//   on a free list for reuse. A cache churning through its entries then
+//   does not call malloc at all once the slabs cover its peak size. The
+//   slabs are only released when the pool is destroyed.
+//
+// Pools do no locking, they are guarded by the lock of their cache.
+
+#ifndef GOOGLE_SERVICE_CONTROL_CLIENT_UTILS_SLAB_ALLOCATOR_H_
+#define GOOGLE_SERVICE_CONTROL_CLIENT_UTILS_SLAB_ALLOCATOR_H_
+
+#include <stddef.h>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "google_macros.h"
+
+namespace google {
+namespace service_control_client {
+
+struct NewDeleteAllocator {
+  template <class T>
+  class Pool {
+   public:
+    Pool() {}
+
+    template <class... Args>
+    T* New(Args&&... args) {
+      return new T(std::forward<Args>(args)...);
+    }
+
+    void Delete(T* object) { delete object; }
+
+   private:
+    GOOGLE_DISALLOW_EVIL_CONSTRUCTORS(Pool);
+  };
+};
+
+// A pool of objects of type T carved out of slabs. Slabs start at
+// kMinSlabObjects objects and double in size up to kMaxSlabObjects.
+template <class T>
+class SlabPool {
+ public:
+  static const size_t kMinSlabObjects = 16;
+  static const size_t kMaxSlabObjects = 1024;
+
+  SlabPool() : free_(nullptr), next_slab_objects_(kMinSlabObjects) {}
+
+  // All the objects must have been deleted.
+  ~SlabPool() {}
+
+  template <class... Args>
+  T* New(Args&&... args) {
+    if (free_ == nullptr) Grow();
+    Block* block = free_;
+    free_ = block->next;
+    return new (&block->storage) T(std::forward<Args>(args)...);
+  }
+
+  void Delete(T* object) {
+    if (object == nullptr) return;
+    object->~T();
+    Block* block = reinterpret_cast<Block*>(object);
+    block->next = free_;
+    free_ = block;
+  }
+
+  // Number of objects the slabs can hold.
+  size_t Capacity() const {
+    size_t capacity = 0;
+    for (const auto& slab : slabs_) capacity += slab.second;
+    return capacity;
+  }
+
+ private:
+  // A free block links to the next free one, an allocated one holds a T.
+  union Block {
+    Block* next;
+    typename std::aligned_storage<sizeof(T), alignof(T)>::type storage;
+  };
+
+  // Adds a slab and puts its blocks on the free list.
+  void Grow() {
+    size_t count = next_slab_objects_;
+    std::unique_ptr<Block[]> slab(new Block[count]);
+    // Blocks are handed out in address order.
+    for (size_t i = count; i > 0; --i) {
+      slab[i - 1].next = free_;
+      free_ = &slab[i - 1];
+    }
+    slabs_.emplace_back(std::move(slab), count);
+    if (next_slab_objects_ < kMaxSlabObjects) next_slab_objects_ *= 2;
+  }
+
+  std::vector<std::pair<std::unique_ptr<Block[]>, size_t>> slabs_;
+  Block* free_;
+  size_t next_slab_objects_;
+
+  GOOGLE_DISALLOW_EVIL_CONSTRUCTORS(SlabPool);
+};
+
+template <class T>
+const size_t SlabPool<T>::kMinSlabObjects;
+template <class T>
+const size_t SlabPool<T>::kMaxSlabObjects;
+
+struct SlabAllocator {
+  template <class T>
+  using Pool = SlabPool<T>;
+};
+
+}  // namespace service_control_client
+}  // namespace google
+
+#endif  // GOOGLE_SERVICE_CONTROL_CLIENT_UTILS_SLAB_ALLOCATOR_H_
@@ -0,0 +1,111 @@
+/* Copyright 2021 Google Inc. All Rights Reserved.
+
+Licensed under the Apache License, Version 2.0 (the "License");
+you may not use this file except in compliance with the License.
+You may obtain a copy of the License at
+
+    http://www.apache.org/licenses/LICENSE-2.0
+
+Unless required by applicable law or agreed to in writing, software
+distributed under the License is distributed on an "AS IS" BASIS,
+WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+See the License for the specific language governing permissions and
+limitations under the License.
+==============================================================================*/
+
+#include "utils/slab_allocator.h"
+
+#include <set>
+#include <string>
+#include <vector>
+
+#include "gtest/gtest.h"
+
+namespace google {
+namespace service_control_client {
+namespace {
+
+struct Counted {
+  Counted(int* live, const std::string& name) : live(live), name(name) {
+    ++*live;
+  }
+  ~Counted() { --*live; }
+
+  int* live;
+  std::string name;
+};
+
+TEST(SlabAllocatorTest, TestNewDelete) {
+  int live = 0;
+  SlabPool<Counted> pool;
+  Counted* a = pool.New(&live, "a");
+  Counted* b = pool.New(&live, "b");
+  EXPECT_EQ(live, 2);
+  EXPECT_EQ(a->name, "a");
+  EXPECT_EQ(b->name, "b");
+  EXPECT_NE(a, b);
+  EXPECT_EQ(pool.Capacity(), SlabPool<Counted>::kMinSlabObjects);
+
+  pool.Delete(a);
+  pool.Delete(b);
+  pool.Delete(nullptr);
+  EXPECT_EQ(live, 0);
+}
+
+TEST(SlabAllocatorTest, TestReusesFreedObjects) {
+  int live = 0;
+  SlabPool<Counted> pool;
+  Counted* a = pool.New(&live, "a");
+  pool.Delete(a);
+  Counted* b = pool.New(&live, "b");
+  EXPECT_EQ(a, b);
+  pool.Delete(b);
+
+  // Churning at a steady size does not add slabs.
+  std::vector<Counted*> objects;
+  for (int i = 0; i < 100; ++i) {
+    objects.push_back(pool.New(&live, "x"));
+  }
+  size_t capacity = pool.Capacity();
+  for (int round = 0; round < 10; ++round) {
+    for (Counted* object : objects) pool.Delete(object);
+    objects.clear();
+    for (int i = 0; i < 100; ++i) {
+      objects.push_back(pool.New(&live, "y"));
+    }
+  }
+  EXPECT_EQ(pool.Capacity(), capacity);
+  EXPECT_EQ(live, 100);
+  for (Counted* object : objects) pool.Delete(object);
+  EXPECT_EQ(live, 0);
+}
+
+TEST(SlabAllocatorTest, TestSlabGrowth) {
+  int live = 0;
+  SlabPool<Counted> pool;
+  std::set<Counted*> objects;
+  const int count = 5000;
+  for (int i = 0; i < count; ++i) {
+    objects.insert(pool.New(&live, std::to_string(i)));
+  }
+  EXPECT_EQ(objects.size(), count);
+  EXPECT_GE(pool.Capacity(), count);
+  // Slabs stop doubling at kMaxSlabObjects.
+  EXPECT_LT(pool.Capacity(), count + SlabPool<Counted>::kMaxSlabObjects);
+  for (Counted* object : objects) pool.Delete(object);
+  EXPECT_EQ(live, 0);
+}
+
+TEST(SlabAllocatorTest, TestNewDeleteAllocator) {
+  int live = 0;
+  NewDeleteAllocator::Pool<Counted> pool;
+  Counted* a = pool.New(&live, "a");
+  EXPECT_EQ(live, 1);
+  EXPECT_EQ(a->name, "a");
+  pool.Delete(a);
+  EXPECT_EQ(live, 0);
+}
+
+}  // namespace
+}  // namespace service_control_client
+}  // namespace google
@@ -20,6 +20,7 @@ limitations under the License.
 
 #include <future>
 #include <mutex>
+#include <shared_mutex>
 #include <thread>
 
 namespace google {
@@ -30,6 +31,11 @@ namespace service_control_client {
 typedef std::mutex Mutex;
 typedef std::unique_lock<Mutex> MutexLock;
 
+// A mutex that can be held by many readers or one writer.
+typedef std::shared_timed_mutex SharedMutex;
+typedef std::shared_lock<SharedMutex> ReaderMutexLock;
+typedef std::unique_lock<SharedMutex> WriterMutexLock;
+
 typedef std::future<::google::protobuf::util::Status> StatusFuture;
 typedef std::promise<::google::protobuf::util::Status> StatusPromise;
 